@@ -0,0 +1,338 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "bscompose.h"
+#include "bspatch.h"
+
+#include <string.h>
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+struct compose_index
+{
+	struct bspatch_block* blocks;
+	int64_t count;
+};
+
+/* Finds the block of the index that produces new byte pos */
+static const struct bspatch_block* index_find(const struct compose_index* index, int64_t pos)
+{
+	int64_t lo = 0, hi = index->count;
+
+	while (hi - lo > 1) {
+		const int64_t mid = lo + (hi - lo) / 2;
+		if (index->blocks[mid].new_offset <= pos) lo = mid; else hi = mid;
+	}
+
+	if (index->count == 0 || pos < index->blocks[lo].new_offset ||
+		pos >= index->blocks[lo].new_offset + index->blocks[lo].ctrl[0] + index->blocks[lo].ctrl[1])
+		return NULL;
+
+	return &index->blocks[lo];
+}
+
+struct compose_state
+{
+	const uint8_t* patch_a;
+	const uint8_t* patch_b;
+	struct compose_index a;
+	struct bsdiff_stream* stream;
+
+	/* Pending output block: diff bytes then extra bytes, staged in buffer */
+	uint8_t* buffer;
+	int64_t oldpos;
+	int64_t difflen;
+	int64_t extralen;
+};
+
+static int flush(struct compose_state* st, int64_t nextpos)
+{
+	uint8_t buf[BSPATCH_CTRL_SIZE];
+
+	bsformat_offtout(st->difflen,buf);
+	bsformat_offtout(st->extralen,buf+8);
+	bsformat_offtout(nextpos-(st->oldpos+st->difflen),buf+16);
+
+	if (bsformat_write(st->stream, buf, sizeof(buf)) ||
+		bsformat_write(st->stream, st->buffer, st->difflen + st->extralen))
+		return -1;
+
+	st->oldpos = nextpos;
+	st->difflen = 0;
+	st->extralen = 0;
+	return 0;
+}
+
+/* Emits n bytes of v3 that are v1 bytes from oldpos plus the sum of two diff strings */
+static int emit_diff(struct compose_state* st, int64_t oldpos,
+		const uint8_t* da, const uint8_t* db, int64_t n)
+{
+	int64_t i;
+
+	if ((st->extralen != 0 || st->oldpos + st->difflen != oldpos) && flush(st, oldpos))
+		return -1;
+
+	for(i=0;i<n;i++)
+		st->buffer[st->difflen+i]=da[i]+db[i];
+	st->difflen += n;
+	return 0;
+}
+
+/* Emits n literal bytes of v3, a literal from patch_a plus an optional diff string */
+static void emit_extra(struct compose_state* st, const uint8_t* ea, const uint8_t* db, int64_t n)
+{
+	uint8_t* out = st->buffer + st->difflen + st->extralen;
+	int64_t i;
+
+	for(i=0;i<n;i++)
+		out[i]=ea[i]+(db ? db[i] : 0);
+	st->extralen += n;
+}
+
+/* Emits n literal bytes of v3 that patch_a fills with byte, plus a diff string */
+static void emit_filled(struct compose_state* st, uint8_t byte, const uint8_t* db, int64_t n)
+{
+	uint8_t* out = st->buffer + st->difflen + st->extralen;
+	int64_t i;
+
+	for(i=0;i<n;i++)
+		out[i]=byte+db[i];
+	st->extralen += n;
+}
+
+/* Passes a fill block of patch_b through, after the pending block */
+static int emit_fill(struct compose_state* st, uint8_t byte, int64_t n)
+{
+	uint8_t buf[BSPATCH_CTRL_SIZE];
+
+	if ((st->difflen != 0 || st->extralen != 0) && flush(st, st->oldpos + st->difflen))
+		return -1;
+
+	bsformat_offtout(BSPATCH_OP_FILL,buf);
+	bsformat_offtout(n,buf+8);
+	bsformat_offtout(byte,buf+16);
+	return bsformat_write(st->stream, buf, sizeof(buf)) ? -1 : 0;
+}
+
+static int compose_block(struct compose_state* st, const struct bspatch_block* blk)
+{
+	const uint8_t* db = st->patch_b + blk->patch_offset + BSPATCH_CTRL_SIZE;
+	int64_t pos = blk->old_offset;
+	int64_t remaining = blk->ctrl[0];
+
+	if (blk->op == BSPATCH_OP_FILL)
+		return emit_fill(st, blk->fill_byte, blk->ctrl[1]);
+
+	/* Diff bytes of patch_b apply to v2, which patch_a maps back to v1 */
+	while (remaining > 0) {
+		const struct bspatch_block* a = index_find(&st->a, pos);
+		if (a == NULL)
+			return -1;
+
+		const int64_t rel = pos - a->new_offset;
+		const uint8_t* pa = st->patch_a + a->patch_offset + BSPATCH_CTRL_SIZE + rel;
+		int64_t n;
+
+		if (rel < a->ctrl[0]) {
+			n = MIN(remaining, a->ctrl[0] - rel);
+			if (emit_diff(st, a->old_offset + rel, pa, db, n))
+				return -1;
+		} else if (a->op == BSPATCH_OP_FILL) {
+			n = MIN(remaining, a->ctrl[1] - rel);
+			emit_filled(st, a->fill_byte, db, n);
+		} else {
+			n = MIN(remaining, a->ctrl[0] + a->ctrl[1] - rel);
+			emit_extra(st, pa, db, n);
+		}
+
+		db += n;
+		pos += n;
+		remaining -= n;
+	}
+
+	/* Extra bytes of patch_b are literals of v3 */
+	emit_extra(st, db, NULL, blk->ctrl[1]);
+	return 0;
+}
+
+/* Finds the data of the first op block of patch, which has been indexed already */
+static const uint8_t* find_op(const uint8_t* patch, int64_t patch_size, int op, int64_t* size)
+{
+	struct bspatch_block blk;
+
+	memset(&blk, 0, sizeof(blk));
+	while (blk.patch_offset < patch_size) {
+		bspatch_block_decode(&blk, patch + blk.patch_offset);
+		if (blk.op == op) {
+			*size = blk.op_size;
+			return patch + blk.patch_offset + BSPATCH_CTRL_SIZE;
+		}
+		bspatch_block_next(&blk);
+	}
+
+	return NULL;
+}
+
+/* Writes an op block, its control words and size bytes of data */
+static int write_op(struct bsdiff_stream* stream, int op, const uint8_t* data, int64_t size)
+{
+	uint8_t buf[BSPATCH_CTRL_SIZE];
+
+	bsformat_offtout(op,buf);
+	bsformat_offtout(size,buf+8);
+	bsformat_offtout(0,buf+16);
+	return bsformat_write(stream, buf, sizeof(buf)) || bsformat_write(stream, data, size) ? -1 : 0;
+}
+
+/* Indexes the blocks of patch, the caller frees index->blocks */
+static int index_build(const uint8_t* patch, int64_t patch_size,
+		struct compose_index* index, struct bsdiff_stream* stream)
+{
+	if((index->count=bspatch_index(patch, patch_size, NULL, 0))<0)
+		return -1;
+
+	if((index->blocks=stream->malloc((index->count+1)*sizeof(*index->blocks)))==NULL)
+		return -1;
+
+	bspatch_index(patch, patch_size, index->blocks, index->count);
+	return 0;
+}
+
+int bscompose(const uint8_t* patch_a, int64_t patch_a_size,
+		const uint8_t* patch_b, int64_t patch_b_size,
+		struct bsdiff_stream* stream)
+{
+	struct compose_index b;
+	struct compose_state st;
+	uint8_t buf[BSPATCH_CTRL_SIZE];
+	uint8_t digest[BSPATCH_DIGEST_BLOCK_SIZE];
+	const uint8_t* op;
+	int64_t i, newsize, op_size;
+	int filter, result = 0;
+
+	memset(&st, 0, sizeof(st));
+	st.patch_a = patch_a;
+	st.patch_b = patch_b;
+	st.stream = stream;
+
+	if (index_build(patch_a, patch_a_size, &st.a, stream))
+		return -1;
+
+	if (index_build(patch_b, patch_b_size, &b, stream))
+	{
+		stream->free(st.a.blocks);
+		return -1;
+	}
+
+	/* A staged block is never larger than v3 */
+	newsize = 0;
+	if (b.count > 0)
+		newsize = b.blocks[b.count-1].new_offset + b.blocks[b.count-1].ctrl[0] + b.blocks[b.count-1].ctrl[1];
+
+	/* Both diffs must be in the same filtered space, which the result stays in */
+	filter = bspatch_patch_filter(patch_b, patch_b_size);
+	if (bspatch_patch_filter(patch_a, patch_a_size) != filter ||
+		(st.buffer=stream->malloc(newsize+1))==NULL)
+	{
+		stream->free(b.blocks);
+		stream->free(st.a.blocks);
+		return -1;
+	}
+
+	/* The v1 bytes read are a subset of those patch_a reads, which its precheck covers */
+	op = find_op(patch_a, patch_a_size, BSPATCH_OP_PRECHECK, &op_size);
+	if (op == patch_a + BSPATCH_CTRL_SIZE)
+		result = write_op(stream, BSPATCH_OP_PRECHECK, op, op_size);
+
+	if (filter != BSFILTER_NONE && result == 0)
+	{
+		bsformat_offtout(BSPATCH_OP_FILTER,buf);
+		bsformat_offtout(0,buf+8);
+		bsformat_offtout(filter,buf+16);
+		result = bsformat_write(stream, buf, sizeof(buf)) ? -1 : 0;
+	}
+
+	for (i = 0; i < b.count && result == 0; i++)
+		result = compose_block(&st, &b.blocks[i]);
+	if (result == 0 && (st.difflen != 0 || st.extralen != 0))
+		result = flush(&st, st.oldpos + st.difflen);
+
+	/* v3 is what patch_b makes; the v1 reads were never hashed in this order */
+	if (result == 0 && (op = find_op(patch_b, patch_b_size, BSPATCH_OP_DIGEST, &op_size)) != NULL)
+	{
+		memset(digest, 0, BSPATCH_DIGEST_SIZE);
+		memcpy(digest + BSPATCH_DIGEST_SIZE, op + BSPATCH_DIGEST_SIZE, BSPATCH_DIGEST_SIZE);
+		result = write_op(stream, BSPATCH_OP_DIGEST, digest, sizeof(digest));
+	}
+
+	stream->free(st.buffer);
+	stream->free(b.blocks);
+	stream->free(st.a.blocks);
+
+	return result;
+}
+
+#if defined(BSCOMPOSE_EXECUTABLE)
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int __write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	if (fwrite(buffer, size, 1, (FILE*)stream->opaque) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc,char *argv[])
+{
+	int fd;
+	uint8_t *patch_a,*patch_b;
+	off_t patch_a_size,patch_b_size;
+	FILE * pf;
+	struct bsdiff_stream stream;
+
+	stream.malloc = malloc;
+	stream.free = free;
+	stream.write = __write;
+
+	if(argc!=4) errx(1,"usage: %s patch_v1_v2 patch_v2_v3 patch_v1_v3\n",argv[0]);
+
+	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
+		((patch_a_size=lseek(fd,0,SEEK_END))==-1) ||
+		((patch_a=malloc(patch_a_size+1))==NULL) ||
+		(lseek(fd,0,SEEK_SET)!=0) ||
+		(read(fd,patch_a,patch_a_size)!=patch_a_size) ||
+		(close(fd)==-1)) err(1,"%s",argv[1]);
+
+	if(((fd=open(argv[2],O_RDONLY,0))<0) ||
+		((patch_b_size=lseek(fd,0,SEEK_END))==-1) ||
+		((patch_b=malloc(patch_b_size+1))==NULL) ||
+		(lseek(fd,0,SEEK_SET)!=0) ||
+		(read(fd,patch_b,patch_b_size)!=patch_b_size) ||
+		(close(fd)==-1)) err(1,"%s",argv[2]);
+
+	if ((pf = fopen(argv[3], "w")) == NULL)
+		err(1, "%s", argv[3]);
+
+	stream.opaque = pf;
+	if (bscompose(patch_a, patch_a_size, patch_b, patch_b_size, &stream))
+		errx(1, "bscompose");
+
+	if (fclose(pf))
+		err(1, "fclose");
+
+	free(patch_a);
+	free(patch_b);
+
+	return 0;
+}
+
+#endif
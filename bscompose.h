@@ -0,0 +1,37 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSCOMPOSE_H
+# define BSCOMPOSE_H
+
+# include <stdint.h>
+
+# include "bsdiff.h"
+
+/*
+ * Composes patch_a (v1->v2) and patch_b (v2->v3) into a single v1->v3 patch, written
+ * to stream.
+ *
+ * No suffix sort is needed: every byte of v3 is traced back through patch_b to v2, and
+ * through patch_a to either a byte of v1 or a literal. Diff bytes that land on v1 are
+ * summed, everything else becomes extra data. Runs of v1 bytes that follow each other
+ * are merged into one control block. Both patches must have been made with the same
+ * branch filter, which the result keeps.
+ *
+ * The v1 bytes the result reads are among those patch_a reads, so a precheck block
+ * at the start of patch_a is copied to the start of the result. If patch_b has a
+ * digest block, the result ends with one carrying its new digest; the old digest is
+ * left as zeros, not recorded, since the result reads v1 in another order than
+ * patch_a hashed it. bspatch then checks v3 but not the v1 bytes it reads.
+ *
+ * Uses stream->malloc for an index of the blocks of each patch and for one buffer the
+ * size of v3.
+ *
+ * Returns 0 on success, -1 on a malformed patch, a filter mismatch or write/allocation failure
+ */
+int bscompose(const uint8_t* patch_a, int64_t patch_a_size,
+		const uint8_t* patch_b, int64_t patch_b_size,
+		struct bsdiff_stream* stream);
+
+#endif
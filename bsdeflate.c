@@ -0,0 +1,910 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#if defined(BSDEFLATE_EXECUTABLE) && !defined(BSDEFLATE_ZLIB)
+#define BSDEFLATE_ZLIB
+#endif
+
+#if defined(BSDEFLATE_ZLIB)
+
+#include "bsdeflate.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+/* zlib takes lengths as uInt */
+#define ZCHUNK (1 << 30)
+
+/*
+ * Inflates the stream at buf, storing its compressed and raw length. The raw data
+ * goes to raw if it is not NULL, which must then hold raw_size bytes.
+ */
+static int inflate_section(const uint8_t* buf, int64_t size, int window_bits,
+	uint8_t* raw, int64_t raw_size, int64_t* length, int64_t* raw_length)
+{
+	uint8_t scratch[16384];
+	z_stream z;
+	int64_t in = 0, out = 0;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, window_bits) != Z_OK)
+		return -1;
+
+	do {
+		if (z.avail_in == 0) {
+			if (in == size)
+				break;
+			z.next_in = (uint8_t*)buf + in;
+			z.avail_in = MIN(size - in, ZCHUNK);
+			in += z.avail_in;
+		}
+		if (raw != NULL) {
+			z.next_out = raw + out;
+			z.avail_out = MIN(raw_size - out, ZCHUNK);
+		} else {
+			z.next_out = scratch;
+			z.avail_out = sizeof(scratch);
+		}
+		const uInt avail = z.avail_out;
+		ret = inflate(&z, Z_NO_FLUSH);
+		out += avail - z.avail_out;
+	} while (ret == Z_OK);
+
+	*length = in - z.avail_in;
+	*raw_length = out;
+	inflateEnd(&z);
+
+	return ret == Z_STREAM_END ? 0 : -1;
+}
+
+/* Tries zlib parameters until one set reproduces comp from raw */
+static int find_params(const uint8_t* raw, int64_t raw_length,
+	const uint8_t* comp, int64_t length, struct bsdeflate_section* s)
+{
+	static const int levels[] = { 6, 9, 1, 2, 3, 4, 5, 7, 8 };
+	static const int mem_levels[] = { 8, 9 };
+	uint8_t chunk[16384];
+	z_stream z;
+
+	for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+	for (size_t m = 0; m < sizeof(mem_levels) / sizeof(mem_levels[0]); m++) {
+		int64_t in = 0, out = 0;
+		int ret, match = 1;
+
+		memset(&z, 0, sizeof(z));
+		if (deflateInit2(&z, levels[l], Z_DEFLATED, s->window_bits, mem_levels[m],
+				Z_DEFAULT_STRATEGY) != Z_OK)
+			continue;
+
+		/* Compare as the output comes, most parameters fail in the first chunk */
+		do {
+			if (z.avail_in == 0 && in < raw_length) {
+				z.next_in = (uint8_t*)raw + in;
+				z.avail_in = MIN(raw_length - in, ZCHUNK);
+				in += z.avail_in;
+			}
+			z.next_out = chunk;
+			z.avail_out = sizeof(chunk);
+			ret = deflate(&z, in == raw_length ? Z_FINISH : Z_NO_FLUSH);
+			const int64_t n = sizeof(chunk) - z.avail_out;
+			if (out + n > length || memcmp(chunk, comp + out, n) != 0)
+				match = 0;
+			out += n;
+		} while (match && ret != Z_STREAM_END && ret != Z_STREAM_ERROR);
+
+		deflateEnd(&z);
+		if (match && ret == Z_STREAM_END && out == length) {
+			s->level = levels[l];
+			s->mem_level = mem_levels[m];
+			s->strategy = Z_DEFAULT_STRATEGY;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Returns where the deflate data of a gzip member at buf starts, or -1 */
+static int64_t gzip_header(const uint8_t* buf, int64_t size)
+{
+	int64_t pos = 10;
+
+	if (size < 18 || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8 || (buf[3] & 0xe0))
+		return -1;
+
+	if (buf[3] & 0x04) {	/* FEXTRA */
+		pos += 2 + (buf[10] | (buf[11] << 8));
+	}
+	if (buf[3] & 0x08) {	/* FNAME */
+		while (pos < size && buf[pos] != 0) pos++;
+		pos++;
+	}
+	if (buf[3] & 0x10) {	/* FCOMMENT */
+		while (pos < size && buf[pos] != 0) pos++;
+		pos++;
+	}
+	if (buf[3] & 0x02) {	/* FHCRC */
+		pos += 2;
+	}
+
+	return pos + 8 <= size ? pos : -1;
+}
+
+static uint32_t le32(const uint8_t* buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+struct section_list
+{
+	struct bsdeflate_section* sections;
+	int64_t count;
+	int64_t capacity;
+};
+
+static int append(struct section_list* list, const struct bsdeflate_section* s,
+	struct bsdiff_stream* stream)
+{
+	if (list->count == list->capacity) {
+		const int64_t capacity = list->capacity ? list->capacity * 2 : 16;
+		struct bsdeflate_section* grown = stream->malloc(capacity * sizeof(*grown));
+		if (grown == NULL)
+			return -1;
+		if (list->sections != NULL) {
+			memcpy(grown, list->sections, list->count * sizeof(*grown));
+			stream->free(list->sections);
+		}
+		list->sections = grown;
+		list->capacity = capacity;
+	}
+
+	list->sections[list->count++] = *s;
+	return 0;
+}
+
+/*
+ * Finds the zlib streams and gzip members of buf. With recompress set, only sections
+ * that zlib recompresses bit-exactly are kept, along with their parameters.
+ */
+static int scan(const uint8_t* buf, int64_t size, int recompress,
+	struct bsdiff_stream* stream, struct section_list* list)
+{
+	int64_t pos = 0;
+
+	while (pos + 2 <= size) {
+		struct bsdeflate_section s;
+		int64_t start = pos, trailer = 0;
+
+		memset(&s, 0, sizeof(s));
+		if ((buf[pos] & 0x0f) == 8 && (buf[pos] >> 4) <= 7 && !(buf[pos + 1] & 0x20) &&
+			((buf[pos] << 8) | buf[pos + 1]) % 31 == 0) {
+			s.window_bits = (buf[pos] >> 4) + 8;
+		} else if ((start = gzip_header(buf + pos, size - pos)) >= 0) {
+			start += pos;
+			s.window_bits = -15;
+			trailer = 8;
+		} else {
+			pos++;
+			continue;
+		}
+
+		s.offset = start;
+		if (inflate_section(buf + start, size - start, s.window_bits, NULL, 0,
+				&s.length, &s.raw_length) != 0 ||
+			s.length < BSDEFLATE_MIN_SIZE || start + s.length + trailer > size) {
+			pos++;
+			continue;
+		}
+
+		uint8_t* raw = stream->malloc(s.raw_length + 1);
+		if (raw == NULL)
+			return -1;
+		inflate_section(buf + start, s.length, s.window_bits, raw, s.raw_length,
+			&s.length, &s.raw_length);
+
+		/* A gzip member is only taken if its trailer matches */
+		int ok = trailer == 0 ||
+			(le32(buf + start + s.length) == crc32(crc32(0, NULL, 0), raw, s.raw_length) &&
+			 le32(buf + start + s.length + 4) == (uint32_t)s.raw_length);
+		if (ok && recompress)
+			ok = find_params(raw, s.raw_length, buf + start, s.length, &s) == 0;
+		stream->free(raw);
+
+		if (!ok) {
+			pos++;
+			continue;
+		}
+		if (append(list, &s, stream))
+			return -1;
+		pos = start + s.length + trailer;
+	}
+
+	return 0;
+}
+
+int64_t bsdeflate_expand(const uint8_t* buf, int64_t size,
+	const struct bsdeflate_section* sections, int64_t nsections, uint8_t* out)
+{
+	int64_t pos = 0, xpos = 0;
+
+	for (int64_t i = 0; i <= nsections; i++) {
+		const int64_t end = i < nsections ? sections[i].offset : size;
+		int64_t length, raw_length;
+
+		if (end < pos || end > size)
+			return -1;
+		if (out != NULL)
+			memcpy(out + xpos, buf + pos, end - pos);
+		xpos += end - pos;
+		pos = end;
+		if (i == nsections)
+			break;
+
+		const struct bsdeflate_section* s = &sections[i];
+		if (s->length < 0 || s->raw_length < 0 || s->length > size - pos)
+			return -1;
+		if (out != NULL &&
+			(inflate_section(buf + pos, s->length, s->window_bits, out + xpos, s->raw_length,
+				&length, &raw_length) != 0 ||
+			 length != s->length || raw_length != s->raw_length))
+			return -1;
+		xpos += s->raw_length;
+		pos += s->length;
+	}
+
+	return xpos;
+}
+
+static int write_sections(struct bsdiff_stream* stream, const struct section_list* list)
+{
+	uint8_t buf[BSDEFLATE_SECTION_SIZE];
+
+	bsformat_offtout(list->count, buf);
+	if (bsformat_write(stream, buf, 8))
+		return -1;
+
+	for (int64_t i = 0; i < list->count; i++) {
+		const struct bsdeflate_section* s = &list->sections[i];
+		bsformat_offtout(s->offset, buf);
+		bsformat_offtout(s->length, buf + 8);
+		bsformat_offtout(s->raw_length, buf + 16);
+		bsformat_offtout(s->window_bits, buf + 24);
+		bsformat_offtout(s->level, buf + 32);
+		bsformat_offtout(s->mem_level, buf + 40);
+		bsformat_offtout(s->strategy, buf + 48);
+		if (bsformat_write(stream, buf, sizeof(buf)))
+			return -1;
+	}
+
+	return 0;
+}
+
+int bsdeflate_diff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	struct section_list olds = { 0 }, news = { 0 };
+	uint8_t *xold = NULL, *xnew = NULL;
+	uint8_t filter[8];
+	int64_t xoldsize, xnewsize;
+	int result = -1;
+
+	if (scan(old, oldsize, 0, stream, &olds) || scan(new, newsize, 1, stream, &news))
+		goto out;
+
+	xoldsize = bsdeflate_expand(old, oldsize, olds.sections, olds.count, NULL);
+	xnewsize = bsdeflate_expand(new, newsize, news.sections, news.count, NULL);
+	if (xoldsize < 0 || xnewsize < 0 ||
+		(xold = stream->malloc(xoldsize + 1)) == NULL ||
+		(xnew = stream->malloc(xnewsize + 1)) == NULL ||
+		bsdeflate_expand(old, oldsize, olds.sections, olds.count, xold) != xoldsize ||
+		bsdeflate_expand(new, newsize, news.sections, news.count, xnew) != xnewsize)
+		goto out;
+
+	bsformat_offtout(options != NULL ? options->filter : BSFILTER_NONE, filter);
+	if (bsformat_write(stream, BSDEFLATE_MAGIC, BSDEFLATE_MAGIC_SIZE) ||
+		bsformat_write(stream, filter, sizeof(filter)) ||
+		write_sections(stream, &olds) || write_sections(stream, &news))
+		goto out;
+
+	result = bsdiff_ex(xold, xoldsize, xnew, xnewsize, stream, options);
+
+out:
+	if (xnew != NULL) stream->free(xnew);
+	if (xold != NULL) stream->free(xold);
+	if (news.sections != NULL) stream->free(news.sections);
+	if (olds.sections != NULL) stream->free(olds.sections);
+
+	return result;
+}
+
+static voidpf stream_alloc(voidpf opaque, uInt items, uInt size)
+{
+	return ((struct bsdiff_stream*)opaque)->malloc((size_t)items * size);
+}
+
+static void stream_free(voidpf opaque, voidpf address)
+{
+	((struct bsdiff_stream*)opaque)->free(address);
+}
+
+/* A z_stream that allocates from stream, or NULL */
+static z_stream* zstream_new(struct bsdiff_stream* stream)
+{
+	z_stream* z = stream->malloc(sizeof(*z));
+
+	if (z != NULL) {
+		memset(z, 0, sizeof(*z));
+		z->zalloc = stream_alloc;
+		z->zfree = stream_free;
+		z->opaque = stream;
+	}
+
+	return z;
+}
+
+/* Reads through read64() if the stream has it, positions past INT_MAX need it */
+static int read_at(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length)
+{
+	if (stream->magic == BSPATCH_STREAM_MAGIC && stream->read64 != NULL)
+		return stream->read64(stream, buffer, pos, length);
+	if (pos > INT_MAX)
+		return BSPATCH_ERROR;
+	return stream->read(stream, buffer, (int)pos, length);
+}
+
+static void input_close(struct bsdeflate_input* in)
+{
+	if (in->zstream != NULL) {
+		inflateEnd(in->zstream);
+		in->stream->free(in->zstream);
+		in->zstream = NULL;
+	}
+	in->section = -1;
+}
+
+/* Inflates the open section s until raw byte target is in the window */
+static int input_inflate(struct bsdeflate_input* in, const struct bsdeflate_section* s,
+	int64_t target)
+{
+	z_stream* z = in->zstream;
+
+	while (in->raw_pos <= target) {
+		if (z->avail_in == 0) {
+			const int n = MIN(s->length - in->in_pos, (int64_t)sizeof(in->in));
+			if (n == 0 || read_at(in->old, in->in, s->offset + in->in_pos, n) != BSPATCH_SUCCESS)
+				return BSPATCH_ERROR;
+			z->next_in = in->in;
+			z->avail_in = n;
+			in->in_pos += n;
+		}
+
+		const int64_t slot = in->raw_pos % BSDEFLATE_WINDOW;
+		z->next_out = in->window + slot;
+		z->avail_out = MIN(BSDEFLATE_WINDOW - slot, s->raw_length - in->raw_pos);
+		const uInt avail = z->avail_out;
+		const int ret = inflate(z, Z_NO_FLUSH);
+		in->raw_pos += avail - z->avail_out;
+		if (ret == Z_STREAM_END) {
+			/* The section must end exactly where the table says */
+			if (in->raw_pos != s->raw_length || in->in_pos - z->avail_in != s->length)
+				return BSPATCH_ERROR;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			return BSPATCH_ERROR;
+		}
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+static int input_read64(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length)
+{
+	struct bsdeflate_input* in = stream->opaque;
+	uint8_t* dst = buffer;
+	int64_t i = 0, shift = 0;
+
+	if (pos < 0 || length < 0)
+		return BSPATCH_ERROR;
+
+	while (length > 0) {
+		/* Sections before pos, and the gap or section it falls in */
+		for (; i < in->nsections && in->sections[i].offset + shift + in->sections[i].raw_length <= pos; i++)
+			shift += in->sections[i].raw_length - in->sections[i].length;
+
+		if (i == in->nsections || pos < in->sections[i].offset + shift) {
+			const int n = i < in->nsections ? MIN(length, in->sections[i].offset + shift - pos) : length;
+			if (read_at(in->old, dst, pos - shift, n) != BSPATCH_SUCCESS)
+				return BSPATCH_ERROR;
+			dst += n;
+			pos += n;
+			length -= n;
+			continue;
+		}
+
+		const struct bsdeflate_section* s = &in->sections[i];
+		const int64_t raw = pos - (s->offset + shift);
+
+		/* Start the section over when it is not open or raw has left the window */
+		if (in->section != i || raw < in->raw_pos - BSDEFLATE_WINDOW) {
+			input_close(in);
+			if ((in->zstream = zstream_new(in->stream)) == NULL)
+				return BSPATCH_ERROR;
+			if (inflateInit2((z_stream*)in->zstream, s->window_bits) != Z_OK) {
+				in->stream->free(in->zstream);
+				in->zstream = NULL;
+				return BSPATCH_ERROR;
+			}
+			in->section = i;
+			in->raw_pos = 0;
+			in->in_pos = 0;
+		}
+		if (input_inflate(in, s, raw) != BSPATCH_SUCCESS) {
+			input_close(in);
+			return BSPATCH_ERROR;
+		}
+
+		const int n = MIN(MIN(length, in->raw_pos - raw), BSDEFLATE_WINDOW - raw % BSDEFLATE_WINDOW);
+		memcpy(dst, in->window + raw % BSDEFLATE_WINDOW, n);
+		dst += n;
+		pos += n;
+		length -= n;
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+static int input_read(const struct bspatch_stream_i* stream, void* buffer, int pos, int length)
+{
+	return input_read64(stream, buffer, pos, length);
+}
+
+int64_t bsdeflate_input_init(struct bsdeflate_input* in, const struct bsdeflate_section* sections,
+	int64_t nsections, const struct bspatch_stream_i* old, int64_t oldsize,
+	struct bsdiff_stream* stream, struct bspatch_stream_i* xold)
+{
+	int64_t xoldsize = oldsize;
+
+	for (int64_t i = 0; i < nsections; i++) {
+		if (sections[i].offset < (i ? sections[i - 1].offset + sections[i - 1].length : 0) ||
+			sections[i].length <= 0 || sections[i].length > oldsize - sections[i].offset ||
+			sections[i].raw_length < 0 || sections[i].raw_length > INT64_MAX / 2 - xoldsize)
+			return BSPATCH_ERROR;
+		xoldsize += sections[i].raw_length - sections[i].length;
+	}
+
+	memset(in, 0, sizeof(*in));
+	in->sections = sections;
+	in->nsections = nsections;
+	in->old = old;
+	in->stream = stream;
+	in->section = -1;
+	if ((in->window = stream->malloc(BSDEFLATE_WINDOW)) == NULL)
+		return BSPATCH_ERROR;
+
+	bspatch_stream_i_init(xold);
+	xold->opaque = in;
+	xold->read = input_read;
+	xold->read64 = input_read64;
+
+	return xoldsize;
+}
+
+void bsdeflate_input_finish(struct bsdeflate_input* in)
+{
+	input_close(in);
+	if (in->window != NULL) {
+		in->stream->free(in->window);
+		in->window = NULL;
+	}
+}
+
+/* Writes compressed output produced so far, finishing the section with flush */
+static int deflate_out(struct bsdeflate_output* o, int flush)
+{
+	z_stream* z = o->zstream;
+	int ret;
+
+	do {
+		z->next_out = o->buf;
+		z->avail_out = sizeof(o->buf);
+		ret = deflate(z, flush);
+		if (ret == Z_STREAM_ERROR)
+			return BSPATCH_ERROR;
+		const int n = sizeof(o->buf) - z->avail_out;
+		if (n > 0 && o->out->write(o->out, o->buf, n) < 0)
+			return BSPATCH_ERROR;
+	} while (z->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return BSPATCH_SUCCESS;
+}
+
+static void output_close(struct bsdeflate_output* o)
+{
+	if (o->zstream != NULL) {
+		deflateEnd(o->zstream);
+		o->stream->free(o->zstream);
+		o->zstream = NULL;
+	}
+}
+
+static int output_write(const struct bspatch_stream_n* stream, const void* buffer, int length)
+{
+	struct bsdeflate_output* o = stream->opaque;
+	const uint8_t* src = buffer;
+
+	while (length > 0) {
+		const struct bsdeflate_section* s = &o->sections[o->section];
+
+		if (o->zstream == NULL) {
+			/* Bytes up to the next section are copied through */
+			const int64_t gap = o->section < o->nsections ?
+				s->offset + o->shift - o->pos : INT64_MAX;
+			if (gap > 0) {
+				const int n = MIN(length, gap);
+				if (o->out->write(o->out, src, n) < 0)
+					return BSPATCH_ERROR;
+				src += n;
+				length -= n;
+				o->pos += n;
+				continue;
+			}
+
+			if ((o->zstream = zstream_new(o->stream)) == NULL)
+				return BSPATCH_ERROR;
+			if (deflateInit2((z_stream*)o->zstream, s->level, Z_DEFLATED, s->window_bits,
+					s->mem_level, s->strategy) != Z_OK) {
+				o->stream->free(o->zstream);
+				o->zstream = NULL;
+				return BSPATCH_ERROR;
+			}
+			o->section_in = 0;
+		}
+
+		z_stream* z = o->zstream;
+		const int n = MIN(length, s->raw_length - o->section_in);
+		const int finish = o->section_in + n == s->raw_length;
+		z->next_in = (uint8_t*)src;
+		z->avail_in = n;
+		if (deflate_out(o, finish ? Z_FINISH : Z_NO_FLUSH) != BSPATCH_SUCCESS)
+			return BSPATCH_ERROR;
+		src += n;
+		length -= n;
+		o->pos += n;
+		o->section_in += n;
+
+		if (finish) {
+			const int exact = z->total_out == (uLong)s->length;
+			output_close(o);
+			if (!exact)
+				return BSPATCH_ERROR;
+			o->shift += s->raw_length - s->length;
+			o->section++;
+		}
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+int bsdeflate_output_init(struct bsdeflate_output* o, const struct bsdeflate_section* sections,
+	int64_t nsections, const struct bspatch_stream_n* out, struct bsdiff_stream* stream,
+	struct bspatch_stream_n* new)
+{
+	for (int64_t i = 0; i < nsections; i++) {
+		if (sections[i].offset < (i ? sections[i - 1].offset + sections[i - 1].length : 0) ||
+			sections[i].raw_length <= 0 || sections[i].length < 0)
+			return BSPATCH_ERROR;
+	}
+
+	memset(o, 0, sizeof(*o));
+	o->sections = sections;
+	o->nsections = nsections;
+	o->out = out;
+	o->stream = stream;
+
+	bspatch_stream_n_init(new);
+	new->opaque = o;
+	new->write = output_write;
+
+	return BSPATCH_SUCCESS;
+}
+
+int bsdeflate_output_finish(struct bsdeflate_output* o)
+{
+	const int complete = o->zstream == NULL && o->section == o->nsections;
+
+	output_close(o);
+
+	return complete ? BSPATCH_SUCCESS : BSPATCH_ERROR;
+}
+
+/* Header fields of a bsdeflate patch, in order */
+enum {
+	PATCH_MAGIC,
+	PATCH_FILTER,
+	PATCH_OLD_COUNT,
+	PATCH_OLD_SECTION,
+	PATCH_NEW_COUNT,
+	PATCH_NEW_SECTION,
+	PATCH_BODY,
+};
+
+void bsdeflate_patch_init(struct bsdeflate_patch* p, const struct bspatch_stream_i* old,
+	int64_t oldsize, const struct bspatch_stream_n* new, struct bsdiff_stream* stream)
+{
+	memset(p, 0, sizeof(*p));
+	p->old = old;
+	p->oldsize = oldsize;
+	p->new = new;
+	p->stream = stream;
+	p->state = PATCH_MAGIC;
+}
+
+/* Takes in the header field in p->field, moving on to the next one */
+static int patch_field(struct bsdeflate_patch* p)
+{
+	const int table = p->state == PATCH_NEW_COUNT || p->state == PATCH_NEW_SECTION;
+	int64_t xoldsize;
+
+	switch (p->state) {
+	case PATCH_MAGIC:
+		if (memcmp(p->field, BSDEFLATE_MAGIC, BSDEFLATE_MAGIC_SIZE) != 0)
+			return BSPATCH_ERROR;
+		p->state = PATCH_FILTER;
+		return BSPATCH_SUCCESS;
+
+	case PATCH_FILTER:
+		p->filter = (int)bsformat_offtin(p->field);
+		p->state = PATCH_OLD_COUNT;
+		return BSPATCH_SUCCESS;
+
+	case PATCH_OLD_COUNT:
+	case PATCH_NEW_COUNT:
+		/* Old sections take at least BSDEFLATE_MIN_SIZE bytes of old each */
+		p->count[table] = bsformat_offtin(p->field);
+		if (p->count[table] < 0 || p->count[table] > INT32_MAX ||
+			(!table && p->count[table] > p->oldsize / BSDEFLATE_MIN_SIZE) ||
+			(p->sections[table] = p->stream->malloc((p->count[table] + 1) *
+				sizeof(struct bsdeflate_section))) == NULL)
+			return BSPATCH_ERROR;
+		p->nread = 0;
+		p->state++;
+		break;
+
+	case PATCH_OLD_SECTION:
+	case PATCH_NEW_SECTION: {
+		struct bsdeflate_section* s = &p->sections[table][p->nread++];
+		s->offset = bsformat_offtin(p->field);
+		s->length = bsformat_offtin(p->field + 8);
+		s->raw_length = bsformat_offtin(p->field + 16);
+		s->window_bits = bsformat_offtin(p->field + 24);
+		s->level = bsformat_offtin(p->field + 32);
+		s->mem_level = bsformat_offtin(p->field + 40);
+		s->strategy = bsformat_offtin(p->field + 48);
+		break;
+	}
+	}
+
+	/* A table ends after its count of sections, the patch body follows the new one */
+	if (p->nread < p->count[table])
+		return BSPATCH_SUCCESS;
+	if (!table) {
+		p->state = PATCH_NEW_COUNT;
+		return BSPATCH_SUCCESS;
+	}
+
+	/* The patch was made against the expanded old image */
+	if ((xoldsize = bsdeflate_input_init(&p->input, p->sections[0], p->count[0], p->old,
+			p->oldsize, p->stream, &p->xold)) < 0 ||
+		bsdeflate_output_init(&p->output, p->sections[1], p->count[1], p->new, p->stream,
+			&p->xnew) != BSPATCH_SUCCESS ||
+		bspatch_set_filter(&p->ctx, p->filter, xoldsize) != BSPATCH_SUCCESS)
+		return BSPATCH_ERROR;
+	p->state = PATCH_BODY;
+
+	return BSPATCH_SUCCESS;
+}
+
+int bsdeflate_patch(struct bsdeflate_patch* p, const uint8_t* patch, int patch_size)
+{
+	while (patch_size > 0 && p->state != PATCH_BODY) {
+		const int size = p->state == PATCH_OLD_SECTION || p->state == PATCH_NEW_SECTION ?
+			BSDEFLATE_SECTION_SIZE : 8;
+		const int n = MIN(patch_size, size - p->field_len);
+
+		memcpy(p->field + p->field_len, patch, n);
+		p->field_len += n;
+		patch += n;
+		patch_size -= n;
+		if (p->field_len == size) {
+			p->field_len = 0;
+			if (patch_field(p) != BSPATCH_SUCCESS)
+				return BSPATCH_ERROR;
+		}
+	}
+
+	if (patch_size == 0)
+		return BSPATCH_SUCCESS;
+
+	return bspatch(&p->ctx, &p->xold, &p->xnew, patch, patch_size);
+}
+
+int bsdeflate_patch_finish(struct bsdeflate_patch* p)
+{
+	int result = BSPATCH_ERROR;
+
+	if (p->state == PATCH_BODY) {
+		result = bspatch_finish(&p->ctx, &p->xnew);
+		if (bsdeflate_output_finish(&p->output) != BSPATCH_SUCCESS)
+			result = BSPATCH_ERROR;
+		bsdeflate_input_finish(&p->input);
+	} else {
+		/* Either stage may be set up already if setting up the other failed */
+		output_close(&p->output);
+		bsdeflate_input_finish(&p->input);
+	}
+
+	for (int t = 0; t < 2; t++) {
+		if (p->sections[t] != NULL) {
+			p->stream->free(p->sections[t]);
+			p->sections[t] = NULL;
+		}
+	}
+
+	return result;
+}
+
+#endif
+
+#if defined(BSDEFLATE_EXECUTABLE)
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static int __write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	if (fwrite(buffer, size, 1, (FILE*)stream->opaque) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+static int file_write(const struct bspatch_stream_n* stream, const void* buffer, int length)
+{
+	if (fwrite(buffer, length, 1, (FILE*)stream->opaque) != 1) {
+		return BSPATCH_ERROR;
+	}
+	return BSPATCH_SUCCESS;
+}
+
+static int file_read64(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length)
+{
+	if (pread(*(int*)stream->opaque, buffer, length, pos) != length) {
+		return BSPATCH_ERROR;
+	}
+	return BSPATCH_SUCCESS;
+}
+
+static int file_read(const struct bspatch_stream_i* stream, void* buffer, int pos, int length)
+{
+	return file_read64(stream, buffer, pos, length);
+}
+
+static uint8_t* load(const char* name, off_t* size)
+{
+	uint8_t* buf;
+	int fd;
+
+	if(((fd=open(name,O_RDONLY,0))<0) ||
+		((*size=lseek(fd,0,SEEK_END))==-1) ||
+		((buf=malloc(*size+1))==NULL) ||
+		(lseek(fd,0,SEEK_SET)!=0) ||
+		(read(fd,buf,*size)!=*size) ||
+		(close(fd)==-1)) err(1,"%s",name);
+
+	return buf;
+}
+
+int main(int argc,char *argv[])
+{
+	uint8_t *old,*new;
+	off_t oldsize,newsize;
+	FILE *pf, *ppf;
+	int fd;
+	struct bsdiff_stream stream;
+	struct bsdiff_options options = { .filter = BSFILTER_NONE };
+	int apply = 0;
+	int ch;
+
+	stream.malloc = malloc;
+	stream.free = free;
+	stream.write = __write;
+
+	while ((ch = getopt(argc, argv, "af:s:")) != -1) {
+		switch (ch) {
+		case 'a':
+			apply = 1;
+			break;
+		case 'f':
+			if ((options.filter = bsfilter_from_name(optarg)) < 0)
+				errx(1, "unknown filter %s", optarg);
+			break;
+		case 's':
+			options.speed = atoi(optarg);
+			if (options.speed < 0 || options.speed > BSDIFF_SPEED_MAX)
+				errx(1, "speed must be 0 to %d", BSDIFF_SPEED_MAX);
+			break;
+		default:
+			errx(1,"usage: %s [-f none|arm|thumb] [-s speed] oldfile newfile patchfile\n"
+				"       %s -a oldfile newfile patchfile\n",argv[0],argv[0]);
+		}
+	}
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc!=4) errx(1,"usage: %s [-f none|arm|thumb] [-s speed] oldfile newfile patchfile\n"
+		"       %s -a oldfile newfile patchfile\n",argv[0],argv[0]);
+	if(apply && (options.filter != BSFILTER_NONE || options.speed))
+		errx(1,"-f and -s are only used when diffing");
+
+	if (apply) {
+		struct bsdeflate_patch p;
+		struct bspatch_stream_i in = { BSPATCH_STREAM_INIT, .opaque = &fd, .read = file_read, .read64 = file_read64 };
+		struct bspatch_stream_n out = { BSPATCH_STREAM_INIT, .write = file_write };
+		uint8_t chunk[65536];
+		size_t n;
+
+		/* Neither image nor the patch is loaded whole */
+		if (((fd = open(argv[1], O_RDONLY, 0)) < 0) ||
+			((oldsize = lseek(fd, 0, SEEK_END)) == -1))
+			err(1, "%s", argv[1]);
+		if ((ppf = fopen(argv[3], "r")) == NULL)
+			err(1, "%s", argv[3]);
+		if ((pf = fopen(argv[2], "w")) == NULL)
+			err(1, "%s", argv[2]);
+		out.opaque = pf;
+		bsdeflate_patch_init(&p, &in, oldsize, &out, &stream);
+		while ((n = fread(chunk, 1, sizeof(chunk), ppf)) > 0) {
+			if (bsdeflate_patch(&p, chunk, n) != BSPATCH_SUCCESS) {
+				bsdeflate_patch_finish(&p);
+				errx(1, "bsdeflate_patch");
+			}
+		}
+		if (ferror(ppf))
+			err(1, "%s", argv[3]);
+		if (bsdeflate_patch_finish(&p) != BSPATCH_SUCCESS)
+			errx(1, "bsdeflate_patch");
+		if (fclose(pf) || fclose(ppf) || close(fd))
+			err(1, "fclose");
+		return 0;
+	}
+
+	old = load(argv[1], &oldsize);
+	new = load(argv[2], &newsize);
+
+	if ((pf = fopen(argv[3], "w")) == NULL)
+		err(1, "%s", argv[3]);
+
+	stream.opaque = pf;
+	if (bsdeflate_diff(old, oldsize, new, newsize, &stream, &options))
+		errx(1, "bsdeflate_diff");
+
+	if (fclose(pf))
+		err(1, "fclose");
+
+	free(old);
+	free(new);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSDEFLATE_H
+# define BSDEFLATE_H
+
+/*
+ * Compression-aware diffing, built with -DBSDEFLATE_ZLIB and linked with zlib.
+ *
+ * A small change to data inside a deflate stream rewrites the whole stream, so a
+ * plain bsdiff of two images with compressed assets is mostly extra data.
+ * bsdeflate_diff() finds zlib streams and gzip members in both images and diffs
+ * their decompressed contents instead. New sections are only expanded if zlib
+ * recompresses them bit-exactly with some set of parameters, which are recorded in
+ * the patch so bspatch can rebuild the compressed stream on the fly.
+ *
+ * Patch layout, all integers in the 8-byte format of the control words:
+ *
+ *   | "BSDEFL01" | filter | old count | old sections | new count | new sections | bsdiff patch |
+ *
+ * Each section is offset, length, raw_length, window_bits, level, mem_level and
+ * strategy. The bsdiff patch turns the expanded old image into the expanded new one,
+ * with the branch filter (enum bsfilter) from the options applied.
+ */
+
+# include <stdint.h>
+
+# include "bsdiff.h"
+# include "bspatch.h"
+
+# define BSDEFLATE_MAGIC "BSDEFL01"
+# define BSDEFLATE_MAGIC_SIZE 8
+# define BSDEFLATE_SECTION_SIZE (7 * 8)
+
+/* Compressed streams shorter than this are left alone */
+# ifndef BSDEFLATE_MIN_SIZE
+#  define BSDEFLATE_MIN_SIZE 64
+# endif
+
+struct bsdeflate_section
+{
+	int64_t offset;		/* start of the compressed data in the image */
+	int64_t length;		/* compressed length */
+	int64_t raw_length;	/* decompressed length */
+	int window_bits;	/* zlib windowBits, negative for the raw deflate of a gzip member */
+	int level;		/* recompression parameters, only set for new sections */
+	int mem_level;
+	int strategy;
+};
+
+/*
+ * Diffs old against new, expanding compressed sections of both first. Work memory
+ * comes from stream->malloc: the two expanded images plus what bsdiff_ex() needs for
+ * the expanded old image.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int bsdeflate_diff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/*
+ * Expands the sections of buf, writing the result to out if it is not NULL.
+ *
+ * Returns the expanded size, or -1 if a section does not inflate as recorded
+ */
+int64_t bsdeflate_expand(const uint8_t* buf, int64_t size,
+	const struct bsdeflate_section* sections, int64_t nsections, uint8_t* out);
+
+/* Raw bytes of the section being read that bsdeflate_input keeps, for reads that step back */
+# ifndef BSDEFLATE_WINDOW
+#  define BSDEFLATE_WINDOW 32768
+# endif
+
+/*
+ * Reader of the expanded old image, over a reader of the compressed one. Bytes
+ * between sections are read from old as they are. A read inside a section inflates
+ * it from old up to there, keeping the last BSDEFLATE_WINDOW raw bytes, so reads
+ * that move forward or step back within that window cost one pass over the section;
+ * a read further back inflates the section again from its start.
+ *
+ * One section is open at a time. Its memory comes from stream->malloc: the inflate
+ * state, about 7 KB plus the 2^window_bits bytes (up to 32 KB) of the zlib window,
+ * and BSDEFLATE_WINDOW bytes.
+ */
+struct bsdeflate_input
+{
+	/* Internal */
+	const struct bsdeflate_section* sections;
+	int64_t nsections;
+	const struct bspatch_stream_i* old;
+	struct bsdiff_stream* stream;
+	int64_t section;	/* open section, or -1 */
+	int64_t raw_pos;	/* raw bytes of the open section inflated so far */
+	int64_t in_pos;		/* compressed bytes of it read from old */
+	void* zstream;
+	uint8_t* window;	/* raw byte i of the section is at i % BSDEFLATE_WINDOW */
+	uint8_t in[4096];
+};
+
+/*
+ * Sets up in and points xold at it. sections must stay valid until
+ * bsdeflate_input_finish().
+ *
+ * Returns the size of the expanded image, or BSPATCH_ERROR if the sections overlap
+ * or do not fit in oldsize
+ */
+int64_t bsdeflate_input_init(struct bsdeflate_input* in, const struct bsdeflate_section* sections,
+	int64_t nsections, const struct bspatch_stream_i* old, int64_t oldsize,
+	struct bsdiff_stream* stream, struct bspatch_stream_i* xold);
+
+/* Releases the inflate state of in */
+void bsdeflate_input_finish(struct bsdeflate_input* in);
+
+/*
+ * Output stage that recompresses the new sections: bspatch writes the expanded new
+ * image to the stream set up by bsdeflate_output_init(), and the compressed image is
+ * written to out. out->write() must not return BSPATCH_WOULD_BLOCK.
+ *
+ * One section is open at a time. Its deflate state comes from stream->malloc: about
+ * 6 KB plus 2^(window_bits + 2) + 2^(mem_level + 9) bytes, 256 KB with the zlib
+ * defaults.
+ */
+struct bsdeflate_output
+{
+	/* Internal */
+	const struct bsdeflate_section* sections;
+	int64_t nsections;
+	const struct bspatch_stream_n* out;
+	struct bsdiff_stream* stream;
+	int64_t pos;		/* position in the expanded image */
+	int64_t shift;		/* expanded minus compressed offset, before the current section */
+	int64_t section;	/* current or next section */
+	int64_t section_in;	/* raw bytes of the current section fed to zlib */
+	void* zstream;		/* deflate state while inside a section */
+	uint8_t buf[4096];
+};
+
+/*
+ * Sets up o and points new at it. sections must stay valid until
+ * bsdeflate_output_finish().
+ *
+ * Returns BSPATCH_SUCCESS, or BSPATCH_ERROR if the sections overlap
+ */
+int bsdeflate_output_init(struct bsdeflate_output* o, const struct bsdeflate_section* sections,
+	int64_t nsections, const struct bspatch_stream_n* out, struct bsdiff_stream* stream,
+	struct bspatch_stream_n* new);
+
+/*
+ * Releases the deflate state of o.
+ *
+ * Returns BSPATCH_SUCCESS, or BSPATCH_ERROR if the output ended inside a section or
+ * before the last one
+ */
+int bsdeflate_output_finish(struct bsdeflate_output* o);
+
+/*
+ * Applies a patch made by bsdeflate_diff(), which is passed to bsdeflate_patch() in
+ * chunks of any size, like bspatch(). Old is read through bsdeflate_input and new
+ * written through bsdeflate_output, so neither image is held in memory: work memory
+ * is the two section tables (56 bytes a section) and one open section on each side,
+ * all from stream->malloc; stream->write is not used. old->read() and new->write()
+ * must not return BSPATCH_WOULD_BLOCK.
+ */
+struct bsdeflate_patch
+{
+	/* Internal */
+	const struct bspatch_stream_i* old;
+	int64_t oldsize;
+	const struct bspatch_stream_n* new;
+	struct bsdiff_stream* stream;
+	int state;		/* header field being read */
+	uint8_t field[BSDEFLATE_SECTION_SIZE];
+	int field_len;
+	int filter;
+	struct bsdeflate_section* sections[2];	/* old, new */
+	int64_t count[2];
+	int64_t nread;		/* sections of the current table read so far */
+	struct bsdeflate_input input;
+	struct bsdeflate_output output;
+	struct bspatch_stream_i xold;
+	struct bspatch_stream_n xnew;
+	struct bspatch_ctx ctx;
+};
+
+/* Sets up p to patch old, of oldsize bytes, into new */
+void bsdeflate_patch_init(struct bsdeflate_patch* p, const struct bspatch_stream_i* old,
+	int64_t oldsize, const struct bspatch_stream_n* new, struct bsdiff_stream* stream);
+
+/*
+ * Processes patch_size bytes of patch.
+ *
+ * Returns BSPATCH_SUCCESS, BSPATCH_ERROR on a malformed patch or allocation failure,
+ * or any error of bspatch()
+ */
+int bsdeflate_patch(struct bsdeflate_patch* p, const uint8_t* patch, int patch_size);
+
+/*
+ * Call once all patch bytes have been passed to bsdeflate_patch(), or to give up
+ * after an error. Flushes the output and releases the work memory.
+ *
+ * Returns BSPATCH_SUCCESS, or BSPATCH_ERROR if the patch or the output is incomplete
+ */
+int bsdeflate_patch_finish(struct bsdeflate_patch* p);
+
+#endif
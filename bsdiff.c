@@ -26,11 +26,15 @@
  */
 
 #include "bsdiff.h"
+#include "bsformat.h"
+#include "bssha256.h"
 
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
 
 static void split(int64_t *I,int64_t *V,int64_t start,int64_t len,int64_t h)
 {
@@ -141,8 +145,9 @@ static int64_t matchlen(const uint8_t *old,int64_t oldsize,const uint8_t *new,in
 	return i;
 }
 
-static int64_t search(const int64_t *I,const uint8_t *old,int64_t oldsize,
-		const uint8_t *new,int64_t newsize,int64_t st,int64_t en,int64_t *pos)
+/* Same as search(), returning where the match is in the suffix array */
+static int64_t search_rank(const int64_t *I,const uint8_t *old,int64_t oldsize,
+		const uint8_t *new,int64_t newsize,int64_t st,int64_t en,int64_t *rank)
 {
 	int64_t x,y;
 
@@ -151,59 +156,52 @@ static int64_t search(const int64_t *I,const uint8_t *old,int64_t oldsize,
 		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*rank=st;
 			return x;
 		} else {
-			*pos=I[en];
+			*rank=en;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
 	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+		return search_rank(I,old,oldsize,new,newsize,x,en,rank);
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		return search_rank(I,old,oldsize,new,newsize,st,x,rank);
 	};
 }
 
-static void offtout(int64_t x,uint8_t *buf)
+static int64_t search(const int64_t *I,const uint8_t *old,int64_t oldsize,
+		const uint8_t *new,int64_t newsize,int64_t st,int64_t en,int64_t *pos)
 {
-	int64_t y;
+	int64_t rank,len;
 
-	if(x<0) y=-x; else y=x;
-
-	buf[0]=y%256;y-=buf[0];
-	y=y/256;buf[1]=y%256;y-=buf[1];
-	y=y/256;buf[2]=y%256;y-=buf[2];
-	y=y/256;buf[3]=y%256;y-=buf[3];
-	y=y/256;buf[4]=y%256;y-=buf[4];
-	y=y/256;buf[5]=y%256;y-=buf[5];
-	y=y/256;buf[6]=y%256;y-=buf[6];
-	y=y/256;buf[7]=y%256;
-
-	if(x<0) buf[7]|=0x80;
+	len=search_rank(I,old,oldsize,new,newsize,st,en,&rank);
+	*pos=I[rank];
+	return len;
 }
 
-static int64_t writedata(struct bsdiff_stream* stream, const void* buffer, int64_t length)
+/* Writes the bytewise difference new[i]-old[i], staged through a buffer of BSDIFF_EMIT_SIZE bytes */
+static int writediff(struct bsdiff_stream* stream, uint8_t* buffer,
+	const uint8_t* new, const uint8_t* old, int64_t length)
 {
-	int64_t result = 0;
+	int64_t i, n;
 
 	while (length > 0)
 	{
-		const int smallsize = (int)MIN(length, INT_MAX);
-		const int writeresult = stream->write(stream, buffer, smallsize);
-		if (writeresult == -1)
-		{
+		n = MIN(length, BSDIFF_EMIT_SIZE);
+		for(i=0;i<n;i++)
+			buffer[i]=new[i]-old[i];
+		if (bsformat_write(stream, buffer, n))
 			return -1;
-		}
 
-		result += writeresult;
-		length -= smallsize;
-		buffer = (uint8_t*)buffer + smallsize;
+		new += n;
+		old += n;
+		length -= n;
 	}
 
-	return result;
+	return 0;
 }
 
 struct bsdiff_request
@@ -213,37 +211,760 @@ struct bsdiff_request
 	const uint8_t* new;
 	int64_t newsize;
 	struct bsdiff_stream* stream;
-	int64_t *I;
-	uint8_t *buffer;
+	const int64_t *I;	/* suffix array of old */
+	int64_t *scratch;	/* oldsize + 1 free entries, or NULL */
+	uint8_t *emit;		/* BSDIFF_EMIT_SIZE bytes for the diff data */
+	int speed;
+	/* Unfiltered new image, for the digest block; NULL for none */
+	const uint8_t* digest_new;
+	/* Unfiltered old image, for the precheck block; NULL for none */
+	const uint8_t* precheck_old;
+	int filter;
+	int fill;
+	int optimal;
 };
 
+/* A control block, kept until the precheck block ahead of it has been written */
+struct bsdiff_block
+{
+	int64_t newpos;
+	int64_t oldpos;
+	int64_t diff;
+	int64_t extra;
+	int64_t seek;
+	int64_t fill;	/* a fill block of this many copies of new[newpos], or 0 */
+};
+
+/* Blocks held back for the precheck block */
+struct bsdiff_blocks
+{
+	struct bsdiff_block* blocks;
+	int64_t count;
+	int64_t capacity;
+};
+
+static int write_block(const struct bsdiff_request* req, const struct bsdiff_block* blk,
+	struct bssha256* old_hash)
+{
+	uint8_t buf[8 * 3];
+
+	if (blk->fill > 0) {
+		bsformat_offtout(BSPATCH_OP_FILL,buf);
+		bsformat_offtout(blk->fill,buf+8);
+		bsformat_offtout(req->new[blk->newpos],buf+16);
+		return bsformat_write(req->stream, buf, sizeof(buf)) ? -1 : 0;
+	}
+
+	bsformat_offtout(blk->diff,buf);
+	bsformat_offtout(blk->extra,buf+8);
+	bsformat_offtout(blk->seek,buf+16);
+
+	/* Write control data */
+	if (bsformat_write(req->stream, buf, sizeof(buf)))
+		return -1;
+
+	/* Write diff data */
+	if (writediff(req->stream, req->emit, req->new+blk->newpos, req->old+blk->oldpos, blk->diff))
+		return -1;
+	if (old_hash != NULL)
+		bssha256_update(old_hash, req->old+blk->oldpos, blk->diff);
+
+	/* Write extra data, straight from new */
+	if (bsformat_write(req->stream, req->new+blk->newpos+blk->diff, blk->extra))
+		return -1;
+
+	return 0;
+}
+
+/* Writes blk, or holds it back if held is set */
+static int put_block(const struct bsdiff_request* req, const struct bsdiff_block* blk,
+	struct bssha256* old_hash, struct bsdiff_blocks* held)
+{
+	struct bsdiff_block* grown;
+
+	if (held == NULL)
+		return write_block(req, blk, old_hash);
+
+	if (held->count == held->capacity) {
+		const int64_t capacity = held->capacity ? held->capacity * 2 : 64;
+		if((grown=req->stream->malloc(capacity*sizeof(*grown)))==NULL)
+			return -1;
+		if (held->blocks != NULL) {
+			memcpy(grown, held->blocks, held->count*sizeof(*grown));
+			req->stream->free(held->blocks);
+		}
+		held->blocks = grown;
+		held->capacity = capacity;
+	}
+	held->blocks[held->count++] = *blk;
+	return 0;
+}
+
+/*
+ * Puts blk, with runs of at least BSDIFF_FILL_MIN equal bytes of new cut out of its
+ * diff and extra data into fill blocks. The parts around a run seek in old so that
+ * every diff byte is still added to the same old byte.
+ */
+static int put_block_fills(const struct bsdiff_request* req, const struct bsdiff_block* blk,
+	struct bssha256* old_hash, struct bsdiff_blocks* held)
+{
+	const uint8_t* new = req->new + blk->newpos;
+	const int64_t len = blk->diff + blk->extra;
+	int64_t i, j, c = 0, oldcur = blk->oldpos;
+	struct bsdiff_block part;
+
+	if (!req->fill)
+		return put_block(req, blk, old_hash, held);
+
+	for (i = 0; i < len; i = j) {
+		for (j = i + 1; j < len && new[j] == new[i]; j++);
+		if (j - i < BSDIFF_FILL_MIN)
+			continue;
+
+		/* The bytes before the run, then seek to where diff data resumes after it */
+		part.newpos = blk->newpos + c;
+		part.oldpos = oldcur;
+		part.diff = MAX(MIN(i, blk->diff) - c, 0);
+		part.extra = i - c - part.diff;
+		part.seek = blk->oldpos + MIN(j, blk->diff) - (oldcur + part.diff);
+		part.fill = 0;
+		if ((part.diff + part.extra != 0 || part.seek != 0) &&
+			put_block(req, &part, old_hash, held))
+			return -1;
+		oldcur += part.diff + part.seek;
+
+		part.newpos = blk->newpos + i;
+		part.diff = part.extra = part.seek = 0;
+		part.fill = j - i;
+		if (put_block(req, &part, old_hash, held))
+			return -1;
+		c = j;
+	}
+
+	/* The rest of the block, ending where blk would have left old */
+	part.newpos = blk->newpos + c;
+	part.oldpos = oldcur;
+	part.diff = MAX(blk->diff - c, 0);
+	part.extra = len - c - part.diff;
+	part.seek = blk->oldpos + blk->diff + blk->seek - (oldcur + part.diff);
+	part.fill = 0;
+	if (c == 0 || part.diff + part.extra != 0 || part.seek != 0)
+		return put_block(req, &part, old_hash, held);
+
+	return 0;
+}
+
+static int compare_ranges(const void* a, const void* b)
+{
+	const int64_t x = ((const int64_t*)a)[0], y = ((const int64_t*)b)[0];
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Writes the precheck block: the old ranges the diff data of blocks is added to,
+ * merged where they are less than BSDIFF_PRECHECK_GAP apart, and the SHA-256 of
+ * the old bytes in them.
+ */
+static int write_precheck(const struct bsdiff_request* req, const struct bsdiff_block* blocks,
+	int64_t nblocks)
+{
+	/* A filtered read also looks at the candidates that cross its ends */
+	const int64_t margin = req->filter != BSFILTER_NONE ? BSFILTER_INSN_SIZE - 1 : 0;
+	int64_t* ranges;
+	int64_t i, n = 0, m = 0;
+	struct bssha256 sha;
+	uint8_t buf[8 * 3], digest[BSSHA256_SIZE];
+	int result = 0;
+
+	if((ranges=req->stream->malloc((nblocks+1)*2*sizeof(int64_t)))==NULL)
+		return -1;
+
+	for (i = 0; i < nblocks; i++) {
+		if (blocks[i].diff == 0)
+			continue;
+		ranges[2*n] = MAX(blocks[i].oldpos - margin, 0);
+		ranges[2*n+1] = MIN(blocks[i].oldpos + blocks[i].diff + margin, req->oldsize);
+		n++;
+	}
+	qsort(ranges, n, 2*sizeof(int64_t), compare_ranges);
+
+	/* Merge in place, ranges[2*i+1] becomes the length */
+	for (i = 0; i < n; i++) {
+		if (m > 0 && ranges[2*i] <= ranges[2*m-1] + BSDIFF_PRECHECK_GAP) {
+			ranges[2*m-1] = MAX(ranges[2*m-1], ranges[2*i+1]);
+			continue;
+		}
+		ranges[2*m] = ranges[2*i];
+		ranges[2*m+1] = ranges[2*i+1];
+		m++;
+	}
+	bssha256_init(&sha);
+	for (i = 0; i < m; i++) {
+		bssha256_update(&sha, req->precheck_old+ranges[2*i], ranges[2*i+1]-ranges[2*i]);
+		ranges[2*i+1] -= ranges[2*i];
+	}
+	bssha256_final(&sha, digest);
+
+	bsformat_offtout(BSPATCH_OP_PRECHECK,buf);
+	bsformat_offtout(8+m*16+BSSHA256_SIZE,buf+8);
+	bsformat_offtout(0,buf+16);
+	if (bsformat_write(req->stream, buf, sizeof(buf)))
+		result = -1;
+	bsformat_offtout(m,buf);
+	if (result == 0 && bsformat_write(req->stream, buf, 8))
+		result = -1;
+	for (i = 0; result == 0 && i < m; i++) {
+		bsformat_offtout(ranges[2*i],buf);
+		bsformat_offtout(ranges[2*i+1],buf+8);
+		if (bsformat_write(req->stream, buf, 16))
+			result = -1;
+	}
+	if (result == 0 && bsformat_write(req->stream, digest, sizeof(digest)))
+		result = -1;
+
+	req->stream->free(ranges);
+	return result;
+}
+
+/* Writes the filter block, which goes ahead of every block that produces output */
+static int write_filter(const struct bsdiff_request* req)
+{
+	uint8_t buf[8 * 3];
+
+	if (req->filter == BSFILTER_NONE)
+		return 0;
+
+	bsformat_offtout(BSPATCH_OP_FILTER,buf);
+	bsformat_offtout(0,buf+8);
+	bsformat_offtout(req->filter,buf+16);
+	return bsformat_write(req->stream, buf, sizeof(buf)) ? -1 : 0;
+}
+
+/*
+ * Writes the blocks held back for the precheck block, after it and the filter block,
+ * and then the digest block if old_hash is set. Frees the held blocks.
+ */
+static int write_tail(const struct bsdiff_request* req, struct bsdiff_blocks* held,
+	struct bssha256* old_hash)
+{
+	uint8_t buf[8 * 3];
+	uint8_t digest[BSPATCH_DIGEST_BLOCK_SIZE];
+	int64_t i;
+
+	if (held != NULL) {
+		int result = write_precheck(req, held->blocks, held->count);
+		if (result == 0)
+			result = write_filter(req);
+		for (i = 0; result == 0 && i < held->count; i++)
+			result = write_block(req, &held->blocks[i], old_hash);
+		if (held->blocks != NULL) req->stream->free(held->blocks);
+		if (result)
+			return -1;
+	}
+
+	if (old_hash != NULL) {
+		/* Digest block: the old bytes the diff data was added to, then new */
+		struct bssha256 new_hash;
+		bssha256_final(old_hash, digest);
+		bssha256_init(&new_hash);
+		bssha256_update(&new_hash, req->digest_new, req->newsize);
+		bssha256_final(&new_hash, digest + BSSHA256_SIZE);
+
+		bsformat_offtout(BSPATCH_OP_DIGEST,buf);
+		bsformat_offtout(sizeof(digest),buf+8);
+		bsformat_offtout(0,buf+16);
+		if (bsformat_write(req->stream, buf, sizeof(buf)) ||
+			bsformat_write(req->stream, digest, sizeof(digest)))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Speed levels: after this many missed searches in a row, the search stride doubles
+ * with every further miss, up to the maximum. Indexed by bsdiff_options.speed.
+ */
+static const struct {
+	int64_t misses;
+	int64_t max_stride;
+} speed_levels[BSDIFF_SPEED_MAX + 1] = {
+	{ INT64_MAX, 1 },
+	{ 64, 8 },
+	{ 32, 32 },
+	{ 16, 128 },
+};
+
+/*
+ * Optimal parse, see bsdiff_options.optimal. Costs estimate the compressed size of
+ * the patch contents, in eighths of a bit.
+ */
+#define OPT_COST_ZERO 2		/* a diff byte of 0 */
+#define OPT_COST_DIFF 80	/* any other diff byte */
+#define OPT_COST_EXTRA 40	/* an extra byte */
+#define OPT_COST_BLOCK 1280	/* the control words of a block */
+
+/* Exact matches shorter than this start no track */
+#define OPT_MIN_MATCH 8
+/* Old positions tried for each match, all sharing it according to the LCP array */
+#define OPT_CANDIDATES 8
+/* A track ends this many bytes after it last gained on its mismatches */
+#define OPT_SLACK 128
+/* Alignments of earlier matches that are tried again on each match */
+#define OPT_HISTORY (2 * OPT_CANDIDATES)
+/*
+ * Bound on the tracks for n bytes of new: matches do not overlap and are at least
+ * OPT_MIN_MATCH long, and each has at most 1 + len / OPT_MIN_MATCH candidates
+ */
+#define OPT_MAX_TRACKS(n) (2 * ((n) / OPT_MIN_MATCH + 1))
+
+#define OPT_INF (INT64_MAX / 4)
+#define OPT_EXTRA (-1)
+#define OPT_START (-2)
+
+/* One alignment of new against old, over the range of new where it is worth using */
+struct opt_track
+{
+	int64_t lo;
+	int64_t hi;
+	int64_t offset;	/* old position minus new position */
+	int64_t cost;	/* of the best parse up to the current position that ends here */
+	int64_t bits;	/* first bit of the track in the entered bitmap */
+};
+
+static int compare_tracks(const void* a, const void* b)
+{
+	const struct opt_track *x = a, *y = b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+static int compare_track_starts(const void* a, const void* b)
+{
+	const struct opt_track *x = a, *y = b;
+
+	return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/*
+ * Longest common prefix of each suffix in I with the one before it, by Kasai's
+ * algorithm, capped at INT32_MAX. The rank array goes in req->scratch if there is one.
+ */
+static int32_t* build_lcp(const struct bsdiff_request* req)
+{
+	const int64_t n = req->oldsize;
+	int64_t *rank, i, j, h = 0;
+	int32_t *lcp;
+
+	if((lcp=req->stream->malloc((n+1)*sizeof(*lcp)))==NULL)
+		return NULL;
+	if(((rank=req->scratch)==NULL) &&
+		((rank=req->stream->malloc((n+1)*sizeof(*rank)))==NULL)) {
+		req->stream->free(lcp);
+		return NULL;
+	}
+
+	for(i=0;i<=n;i++) rank[req->I[i]]=i;
+	lcp[0]=0;
+	for(i=0;i<=n;i++) {
+		if(rank[i]==0) { h=0; continue; }
+		j=req->I[rank[i]-1];
+		while(i+h<n && j+h<n && req->old[i+h]==req->old[j+h]) h++;
+		lcp[rank[i]]=(int32_t)MIN(h,INT32_MAX);
+		if(h>0) h--;
+	}
+
+	if (rank != req->scratch) req->stream->free(rank);
+	return lcp;
+}
+
+/*
+ * Appends the track of the match of new[scan] at old[pos], extended both ways but
+ * kept within [lo, hi) of new
+ */
+static int add_track(const struct bsdiff_request* req, struct opt_track** tracks,
+	int64_t* count, int64_t* capacity, int64_t scan, int64_t pos, int64_t lo, int64_t hi)
+{
+	struct opt_track* grown;
+	int64_t i, s, score, lenf = 0, lenb = 0;
+
+	/* Forward, as far as matches minus mismatches peak */
+	for(i=0,s=0,score=0;scan+i<hi && pos+i<req->oldsize;i++) {
+		if(req->old[pos+i]==req->new[scan+i]) s++;
+		if(s*2-(i+1)>score) { score=s*2-(i+1); lenf=i+1; }
+		if(i+1-lenf>OPT_SLACK) break;
+	}
+
+	/* Backward, the same way */
+	for(i=1,s=0,score=0;scan-i>=lo && pos-i>=0;i++) {
+		if(req->old[pos-i]==req->new[scan-i]) s++;
+		if(s*2-i>score) { score=s*2-i; lenb=i; }
+		if(i-lenb>OPT_SLACK) break;
+	}
+
+	if (*count == *capacity) {
+		const int64_t capacity2 = MIN(*capacity ? *capacity * 2 : 256, OPT_MAX_TRACKS(req->newsize));
+		if(capacity2<=*count ||
+			(grown=req->stream->malloc(capacity2*sizeof(*grown)))==NULL)
+			return -1;
+		if (*tracks != NULL) {
+			memcpy(grown, *tracks, *count*sizeof(*grown));
+			req->stream->free(*tracks);
+		}
+		*tracks = grown;
+		*capacity = capacity2;
+	}
+	(*tracks)[*count].lo = scan-lenb;
+	(*tracks)[*count].hi = scan+lenf;
+	(*tracks)[*count].offset = pos-scan;
+	(*count)++;
+	return 0;
+}
+
+/* Appends offset to the n offsets unless it is there already or they are max */
+static int64_t push_offset(int64_t* offsets, int64_t n, int64_t max, int64_t offset)
+{
+	int64_t k;
+
+	for (k = 0; k < n; k++)
+		if (offsets[k] == offset)
+			return n;
+	if (n < max)
+		offsets[n++] = offset;
+	return n;
+}
+
+/*
+ * Adds the tracks of the match of len bytes at new[scan], old[I[rank]]. offsets holds
+ * the recent alignments, most recent first, and is updated with the ones of this match.
+ */
+static int add_match(const struct bsdiff_request* req, const int32_t* lcp,
+	struct opt_track** tracks, int64_t* count, int64_t* capacity,
+	int64_t scan, int64_t len, int64_t rank, int64_t lo, int64_t hi,
+	int64_t* offsets, int64_t* noffsets)
+{
+	/* Short matches get fewer candidates, which bounds the tracks, see OPT_MAX_TRACKS */
+	const int64_t max = MIN(OPT_CANDIDATES, 1 + len / OPT_MIN_MATCH);
+	int64_t found[OPT_HISTORY];
+	int64_t r, k, n = 0, m;
+
+	/* Recent alignments that hold here too come first, so that their tracks merge,
+	 * much as bsdiff_internal() stays on lastoffset */
+	for (k = 0; k < *noffsets; k++) {
+		const int64_t pos = scan + offsets[k];
+		if (pos >= 0 && pos + len <= req->oldsize &&
+			memcmp(req->old + pos, req->new + scan, len) == 0)
+			n = push_offset(found, n, max, offsets[k]);
+	}
+
+	/* Then the suffixes around rank that share at least len bytes with it */
+	n = push_offset(found, n, max, req->I[rank] - scan);
+	for (r = rank; r > 0 && lcp[r] >= len && n < max; r--)
+		n = push_offset(found, n, max, req->I[r-1] - scan);
+	for (r = rank + 1; r <= req->oldsize && lcp[r] >= len && n < max; r++)
+		n = push_offset(found, n, max, req->I[r] - scan);
+
+	for (k = 0; k < n; k++)
+		if (add_track(req, tracks, count, capacity, scan, scan + found[k], lo, hi))
+			return -1;
+
+	/* Older alignments stay behind these, in case this match was a stray one */
+	for (k = 0, m = n; k < *noffsets; k++)
+		m = push_offset(found, m, OPT_HISTORY, offsets[k]);
+	memcpy(offsets, found, m * sizeof(*offsets));
+	*noffsets = m;
+	return 0;
+}
+
+/*
+ * Finds the tracks: for each exact match found in the suffix array, the old
+ * positions that share it, each extended into the range of new where its alignment
+ * pays off. Tracks of the same alignment are merged. Returns them sorted by start.
+ *
+ * As in bsdiff_internal(), a match extends back no further than the end of the match
+ * before it, and forward no further than the end of the one after it. Every byte of
+ * new is then covered by the tracks of at most two matches, which keeps the summed
+ * track length, and the work and memory of choose_path(), linear in the size of new
+ * even on periodic data, where every alignment would otherwise run to both ends.
+ */
+static int find_tracks(const struct bsdiff_request* req, struct opt_track** tracks, int64_t* count)
+{
+	int64_t scan, len, rank = 0, capacity = 0, i, m;
+	int64_t mscan = 0, mlen = 0, mrank = 0, covered = 0;
+	int64_t offsets[OPT_HISTORY], noffsets = 0;
+	int32_t* lcp;
+
+	*tracks = NULL;
+	*count = 0;
+	if ((lcp = build_lcp(req)) == NULL)
+		return -1;
+
+	for (scan = 0; ; ) {
+		len = 0;
+		if (scan < req->newsize) {
+			len = search_rank(req->I, req->old, req->oldsize, req->new + scan,
+				req->newsize - scan, 0, req->oldsize, &rank);
+			if (len < OPT_MIN_MATCH) {
+				scan++;
+				continue;
+			}
+		}
+
+		/* Now that the next match is known, the one before it can be extended */
+		if (mlen > 0) {
+			if (add_match(req, lcp, tracks, count, &capacity, mscan, mlen, mrank, covered, scan + len,
+				offsets, &noffsets))
+				goto fail;
+			covered = mscan + mlen;
+		}
+		if (scan >= req->newsize)
+			break;
+
+		mscan = scan;
+		mlen = len;
+		mrank = rank;
+		scan += len;
+	}
+	req->stream->free(lcp);
+
+	if (*count == 0)
+		return 0;
+	/* Bridge the few mismatched bytes where one match hands over to the next, so the
+	 * parse can stay in the same block */
+	qsort(*tracks, *count, sizeof(**tracks), compare_tracks);
+	for (i = 1, m = 0; i < *count; i++) {
+		struct opt_track* last = &(*tracks)[m];
+		const struct opt_track* t = &(*tracks)[i];
+		if (t->offset == last->offset && t->lo <= last->hi + OPT_MIN_MATCH) {
+			last->hi = MAX(last->hi, t->hi);
+			continue;
+		}
+		(*tracks)[++m] = *t;
+	}
+	*count = m + 1;
+	qsort(*tracks, *count, sizeof(**tracks), compare_track_starts);
+
+	return 0;
+
+fail:
+	req->stream->free(lcp);
+	if (*tracks != NULL) req->stream->free(*tracks);
+	return -1;
+}
+
+#define BIT_SET(map, i) ((map)[(i) >> 3] |= (uint8_t)(1 << ((i) & 7)))
+#define BIT_GET(map, i) (((map)[(i) >> 3] >> ((i) & 7)) & 1)
+
+/*
+ * Chooses the state of every byte of new: diff data along one of the tracks, or
+ * extra data. Moving onto a track starts a block, extra data continues the block it
+ * follows. The cheapest parse is found by dynamic programming over the tracks that
+ * cover each position; path receives the state of each byte, and starts flags the
+ * bytes where a block starts.
+ */
+static int choose_path(const struct bsdiff_request* req, struct opt_track* tracks, int64_t count,
+	int32_t* path, uint8_t* starts)
+{
+	const int64_t n = req->newsize;
+	int32_t *best_all = path, *best_track, *active;
+	uint8_t *entered = NULL, *from_extra;
+	int64_t i, k, nbits = 0, nactive = 0, next = 0;
+	int64_t prev_all, prev_track, extra = OPT_INF;
+	int32_t s;
+
+	for (k = 0; k < count; k++) {
+		tracks[k].bits = nbits;
+		nbits += tracks[k].hi - tracks[k].lo;
+	}
+	if(((best_track=req->stream->malloc((n+1)*sizeof(*best_track)))==NULL) ||
+		((active=req->stream->malloc((count+1)*sizeof(*active)))==NULL)) {
+		if (best_track != NULL) req->stream->free(best_track);
+		return -1;
+	}
+	if((entered=req->stream->malloc(nbits/8+1+n/8+1))==NULL) {
+		req->stream->free(active);
+		req->stream->free(best_track);
+		return -1;
+	}
+	memset(entered, 0, nbits/8+1+n/8+1);
+	from_extra = entered + nbits/8+1;
+
+	/* Before the first byte, any state is entered with a new block */
+	prev_all = 0;
+	prev_track = OPT_COST_BLOCK;
+
+	for (i = 0; i < n; i++) {
+		int64_t all, on_track = OPT_INF;
+		int32_t all_id, track_id = OPT_START;
+
+		/* Drop the tracks that ended, take on the ones that start here */
+		for (k = 0, s = 0; k < nactive; k++)
+			if (tracks[active[k]].hi > i) active[s++] = active[k];
+		nactive = s;
+		for (; next < count && tracks[next].lo == i; next++) {
+			tracks[next].cost = OPT_INF;
+			active[nactive++] = (int32_t)next;
+		}
+
+		for (k = 0; k < nactive; k++) {
+			struct opt_track* t = &tracks[active[k]];
+			int64_t cost = t->cost;
+			if (prev_all + OPT_COST_BLOCK < cost) {
+				cost = prev_all + OPT_COST_BLOCK;
+				BIT_SET(entered, t->bits + i - t->lo);
+			}
+			cost += req->old[i+t->offset] == req->new[i] ? OPT_COST_ZERO : OPT_COST_DIFF;
+			t->cost = cost;
+			if (cost < on_track) { on_track = cost; track_id = active[k]; }
+		}
+
+		/* Extra data goes on after extra data or a track, in the same block */
+		if (extra <= prev_track) {
+			BIT_SET(from_extra, i);
+		} else {
+			extra = prev_track;
+		}
+		extra += OPT_COST_EXTRA;
+
+		all = on_track;
+		all_id = track_id;
+		if (extra < all) { all = extra; all_id = OPT_EXTRA; }
+
+		best_all[i] = all_id;
+		best_track[i] = track_id;
+		prev_all = all;
+		prev_track = on_track;
+	}
+
+	/* Walk back from the cheapest final state. best_all[i] and best_track[i] are
+	 * only read at i + 1, so path can take over best_all as it goes */
+	s = n > 0 ? best_all[n-1] : OPT_START;
+	memset(starts, 0, n/8+1);
+	for (i = n - 1; i >= 0; i--) {
+		const int32_t state = s;
+		if (state == OPT_EXTRA) {
+			if (!BIT_GET(from_extra, i)) {
+				s = i > 0 ? best_track[i-1] : OPT_START;
+				if (s == OPT_START) BIT_SET(starts, i);
+			}
+		} else {
+			const struct opt_track* t = &tracks[state];
+			if (BIT_GET(entered, t->bits + i - t->lo)) {
+				BIT_SET(starts, i);
+				s = i > 0 ? best_all[i-1] : OPT_START;
+			}
+		}
+		path[i] = state;
+	}
+
+	req->stream->free(entered);
+	req->stream->free(active);
+	req->stream->free(best_track);
+	return 0;
+}
+
+/* Diffs new along the cheapest parse instead of the greedy scan of bsdiff_internal() */
+static int bsdiff_optimal(const struct bsdiff_request* req)
+{
+	const int64_t n = req->newsize;
+	struct bssha256 old_hash;
+	struct bssha256* hash = req->digest_new != NULL ? &old_hash : NULL;
+	struct bsdiff_blocks held = { NULL, 0, 0 };
+	struct bsdiff_block blk, next;
+	struct opt_track* tracks;
+	int32_t* path = NULL;
+	uint8_t* starts = NULL;
+	int64_t count, i, j;
+	int result = -1;
+
+	bssha256_init(&old_hash);
+	if (find_tracks(req, &tracks, &count))
+		return -1;
+	if (count >= INT32_MAX ||
+		(path=req->stream->malloc((n+1)*sizeof(*path)))==NULL ||
+		(starts=req->stream->malloc(n/8+1))==NULL ||
+		choose_path(req, tracks, count, path, starts))
+		goto out;
+
+	/* Turn the path into blocks: a track run, then the extra run after it */
+	memset(&blk, 0, sizeof(blk));
+	for (i = 0; i < n; i = j) {
+		next.newpos = i;
+		next.oldpos = path[i] == OPT_EXTRA ? blk.oldpos + blk.diff + blk.seek :
+			i + tracks[path[i]].offset;
+		next.diff = 0;
+		next.extra = 0;
+		next.seek = 0;
+		next.fill = 0;
+		for (j = i; j < n && path[j] == path[i] && path[i] != OPT_EXTRA &&
+			(j == i || !BIT_GET(starts, j)); j++)
+			next.diff++;
+		for (; j < n && path[j] == OPT_EXTRA && (j == i || !BIT_GET(starts, j)); j++)
+			next.extra++;
+
+		/* The block before seeks to where this one reads old */
+		if (i == 0) {
+			if (next.oldpos != 0 &&
+				put_block_fills(req, &(struct bsdiff_block){ 0, 0, 0, 0, next.oldpos, 0 }, hash,
+					req->precheck_old != NULL ? &held : NULL))
+				goto out;
+		} else {
+			blk.seek = next.oldpos - (blk.oldpos + blk.diff);
+			if (put_block_fills(req, &blk, hash, req->precheck_old != NULL ? &held : NULL))
+				goto out;
+		}
+		blk = next;
+	}
+	if (n > 0 && put_block_fills(req, &blk, hash, req->precheck_old != NULL ? &held : NULL))
+		goto out;
+
+	result = write_tail(req, req->precheck_old != NULL ? &held : NULL, hash);
+	held.blocks = NULL;
+
+out:
+	if (held.blocks != NULL) req->stream->free(held.blocks);
+	if (starts != NULL) req->stream->free(starts);
+	if (path != NULL) req->stream->free(path);
+	if (tracks != NULL) req->stream->free(tracks);
+	return result;
+}
+
 static int bsdiff_internal(const struct bsdiff_request req)
 {
-	int64_t *I,*V;
+	const int64_t *I;
 	int64_t scan,pos,len;
 	int64_t lastscan,lastpos,lastoffset;
 	int64_t oldscore,scsc;
 	int64_t s,Sf,lenf,Sb,lenb;
 	int64_t overlap,Ss,lens;
 	int64_t i;
-	uint8_t *buffer;
-	uint8_t buf[8 * 3];
-
-	if((V=req.stream->malloc((req.oldsize+1)*sizeof(int64_t)))==NULL) return -1;
-	I = req.I;
+	int64_t misses,step;
+	struct bssha256 old_hash;
+	struct bssha256* hash = req.digest_new != NULL ? &old_hash : NULL;
+	struct bsdiff_block blk;
+	struct bsdiff_blocks held = { NULL, 0, 0 };
+
+	/* Without a precheck block, nothing is held back and the filter block goes first */
+	if (req.precheck_old == NULL && write_filter(&req))
+		return -1;
 
-	qsufsort(I,V,req.old,req.oldsize);
-	req.stream->free(V);
+	if (req.optimal)
+		return bsdiff_optimal(&req);
 
-	buffer = req.buffer;
+	bssha256_init(&old_hash);
+	I = req.I;
 
 	/* Compute the differences, writing ctrl as we go */
 	scan=0;len=0;pos=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<req.newsize) {
 		oldscore=0;
+		misses=0;step=1;
 
-		for(scsc=scan+=len;scan<req.newsize;scan++) {
+		for(scsc=scan+=len;scan<req.newsize;scan+=step) {
 			len=search(I,req.old,req.oldsize,req.new+scan,req.newsize-scan,
 					0,req.oldsize,&pos);
 
@@ -253,11 +974,34 @@ static int bsdiff_internal(const struct bsdiff_request req)
 				oldscore++;
 
 			if(((len==oldscore) && (len!=0)) || 
-				(len>oldscore+8)) break;
+				(len>oldscore+8)) {
+				if(step==1) break;
+
+				/* The match may start in the bytes skipped over, probe
+					every byte again from the last miss on, at least up to
+					where the match was found */
+				scan-=step;
+				scsc=scan+1;
+				oldscore=0;
+				misses=-step;step=1;
+				continue;
+			};
 
-			if((scan+lastoffset<req.oldsize) &&
-				(req.old[scan+lastoffset] == req.new[scan]))
-				oldscore--;
+			if(++misses<=speed_levels[req.speed].misses) {
+				if((scan+lastoffset<req.oldsize) &&
+					(req.old[scan+lastoffset] == req.new[scan]))
+					oldscore--;
+				continue;
+			};
+
+			/* Skip ahead, dropping the skipped bytes from oldscore */
+			step=MIN(step*2,speed_levels[req.speed].max_stride);
+			step=MIN(step,req.newsize-scan);
+			for(i=scan;i<scan+step;i++)
+				if((i<scsc) && (i+lastoffset<req.oldsize) &&
+					(req.old[i+lastoffset] == req.new[i]))
+					oldscore--;
+			if(scsc<scan+step) scsc=scan+step;
 		};
 
 		if((len!=oldscore) || (scan==req.newsize)) {
@@ -292,25 +1036,19 @@ static int bsdiff_internal(const struct bsdiff_request req)
 				lenb-=lens;
 			};
 
-			offtout(lenf,buf);
-			offtout((scan-lenb)-(lastscan+lenf),buf+8);
-			offtout((pos-lenb)-(lastpos+lenf),buf+16);
-
-			/* Write control data */
-			if (writedata(req.stream, buf, sizeof(buf)))
-				return -1;
-
-			/* Write diff data */
-			for(i=0;i<lenf;i++)
-				buffer[i]=req.new[lastscan+i]-req.old[lastpos+i];
-			if (writedata(req.stream, buffer, lenf))
-				return -1;
-
-			/* Write extra data */
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				buffer[i]=req.new[lastscan+lenf+i];
-			if (writedata(req.stream, buffer, (scan-lenb)-(lastscan+lenf)))
+			blk.newpos=lastscan;
+			blk.oldpos=lastpos;
+			blk.diff=lenf;
+			blk.extra=(scan-lenb)-(lastscan+lenf);
+			blk.seek=(pos-lenb)-(lastpos+lenf);
+			blk.fill=0;
+
+			/* Held back until the precheck block knows every range */
+			if (put_block_fills(&req, &blk, hash,
+				req.precheck_old != NULL ? &held : NULL)) {
+				if (held.blocks != NULL) req.stream->free(held.blocks);
 				return -1;
+			}
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
@@ -318,37 +1056,280 @@ static int bsdiff_internal(const struct bsdiff_request req)
 		};
 	};
 
-	return 0;
+	return write_tail(&req, req.precheck_old != NULL ? &held : NULL, hash);
 }
 
 int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream)
 {
-	int result;
-	struct bsdiff_request req;
+	return bsdiff_ex(old, oldsize, new, newsize, stream, NULL);
+}
+
 
-	if((req.I=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL)
+/* Makes sure *buf holds at least size bytes, keeping it if it already does */
+static int grow(struct bsdiff_ctx* ctx, struct bsdiff_stream* stream,
+	void** buf, int64_t* capacity, int64_t size)
+{
+	if (*capacity >= size)
+		return 0;
+
+	if (*buf != NULL)
+		ctx->free(*buf);
+	*capacity = 0;
+
+	if((*buf=stream->malloc(size))==NULL)
 		return -1;
 
-	if((req.buffer=stream->malloc(newsize+1))==NULL)
+	*capacity = size;
+	return 0;
+}
+
+/*
+ * Diffs with the work memory of ctx. The scratch array of the sort is kept for the
+ * next call if keep_scratch is set, and freed as soon as the sort is done otherwise.
+ */
+static int ctx_diff(struct bsdiff_ctx* ctx, const uint8_t* old, int64_t oldsize,
+	const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options, int keep_scratch)
+{
+	struct bsdiff_request req;
+
+	req.digest_new = NULL;
+	if (options != NULL && options->digest)
+		req.digest_new = new;
+	req.precheck_old = NULL;
+	if (options != NULL && options->precheck)
+		req.precheck_old = old;
+	req.filter = options != NULL ? options->filter : BSFILTER_NONE;
+	req.fill = options != NULL && options->fill;
+	req.optimal = options != NULL && options->optimal;
+
+	/* Memory is returned with the allocator it came from */
+	if (ctx->free != NULL && ctx->free != stream->free)
+		bsdiff_ctx_free(ctx);
+	ctx->free = stream->free;
+
+	if (options != NULL && options->filter != BSFILTER_NONE)
 	{
-		stream->free(req.I);
-		return -1;
+		/* Diff filtered copies, bspatch undoes the filter on its output */
+		if (grow(ctx, stream, (void**)&ctx->fold, &ctx->fold_capacity, oldsize+1) ||
+			grow(ctx, stream, (void**)&ctx->fnew, &ctx->fnew_capacity, newsize+1))
+			return -1;
+		memcpy(ctx->fold, old, oldsize);
+		memcpy(ctx->fnew, new, newsize);
+		bsfilter_code(options->filter, ctx->fold, oldsize, 0, 1);
+		bsfilter_code(options->filter, ctx->fnew, newsize, 0, 1);
+		old = ctx->fold;
+		new = ctx->fnew;
+	}
+
+	if (ctx->capacity < oldsize+1)
+	{
+		if (ctx->I != NULL) ctx->free(ctx->I);
+		if (ctx->V != NULL) ctx->free(ctx->V);
+		ctx->V = NULL;
+		ctx->capacity = 0;
+
+		if((ctx->I=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL)
+			return -1;
+		ctx->capacity = oldsize+1;
 	}
+	if((ctx->V==NULL) &&
+		((ctx->V=stream->malloc(ctx->capacity*sizeof(int64_t)))==NULL))
+		return -1;
 
 	req.old = old;
 	req.oldsize = oldsize;
 	req.new = new;
 	req.newsize = newsize;
 	req.stream = stream;
+	qsufsort(ctx->I,ctx->V,old,oldsize);
+	if (!keep_scratch) {
+		ctx->free(ctx->V);
+		ctx->V = NULL;
+	}
+	if((ctx->emit==NULL) &&
+		((ctx->emit=stream->malloc(BSDIFF_EMIT_SIZE))==NULL))
+		return -1;
+	req.emit = ctx->emit;
+	req.I = ctx->I;
+	req.scratch = ctx->V;
+	req.speed = 0;
+	if (options != NULL && options->speed > 0)
+		req.speed = MIN(options->speed, BSDIFF_SPEED_MAX);
+
+	return bsdiff_internal(req);
+}
+
+int bsdiff_ctx_diff(struct bsdiff_ctx* ctx, const uint8_t* old, int64_t oldsize,
+	const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	return ctx_diff(ctx, old, oldsize, new, newsize, stream, options, 1);
+}
+
+int bsdiff_ex(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	struct bsdiff_ctx ctx;
+	int result;
+
+	memset(&ctx, 0, sizeof(ctx));
+	result = ctx_diff(&ctx, old, oldsize, new, newsize, stream, options, 0);
+	bsdiff_ctx_free(&ctx);
+
+	return result;
+}
+
+int64_t bsdiff_memory(int64_t oldsize, int64_t newsize, const struct bsdiff_options* options)
+{
+	const int64_t o = oldsize+1, n = newsize+1;
+	const int64_t tracks = OPT_MAX_TRACKS(newsize)*(int64_t)sizeof(struct opt_track);
+	/* The suffix array and diff buffer, next to the scratch array until the sort is done */
+	int64_t size = o*sizeof(int64_t) + BSDIFF_EMIT_SIZE, phase = o*sizeof(int64_t);
+
+	if (options != NULL && options->filter != BSFILTER_NONE)
+		size += o + n;
+
+	if (options != NULL && options->optimal) {
+		/* find_tracks(): the LCP array, next to the rank array that builds it and then
+		 * to the track array, twice over while it grows */
+		phase = MAX(phase, o*sizeof(int32_t) + MAX(o*sizeof(int64_t), 2*tracks));
+		/* choose_path(): the tracks, path, starts, best_track, active and the entered
+		 * bitmap, which covers each byte of new for at most 2*OPT_CANDIDATES tracks
+		 * plus the OPT_MIN_MATCH bridged at each merge */
+		phase = MAX(phase, tracks + 2*n*sizeof(int32_t) + 2*(n/8+1) +
+			(OPT_MAX_TRACKS(newsize)+1)*sizeof(int32_t) +
+			(2*OPT_CANDIDATES*newsize + OPT_MIN_MATCH*OPT_MAX_TRACKS(newsize))/8+1);
+	}
+
+	return size + phase;
+}
+
+int64_t bsdiff_index_memory(int64_t oldsize, int filter)
+{
+	int64_t size = (oldsize+1)*sizeof(int64_t);
+
+	if (filter != BSFILTER_NONE)
+		size += oldsize+1;
+
+	return size;
+}
+
+int bsdiff_index_build(struct bsdiff_index* index, const uint8_t* old, int64_t oldsize,
+	int filter, struct bsdiff_stream* stream)
+{
+	int64_t *V;
+
+	memset(index, 0, sizeof(*index));
+	index->old = old;
+	index->oldsize = oldsize;
+	index->filter = filter;
+	index->free = stream->free;
+
+	if (filter != BSFILTER_NONE)
+	{
+		if((index->fold=stream->malloc(oldsize+1))==NULL)
+			return -1;
+		memcpy(index->fold, old, oldsize);
+		bsfilter_code(filter, index->fold, oldsize, 0, 1);
+		old = index->fold;
+	}
+
+	/* V is only needed while sorting */
+	if(((index->I=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL) ||
+		((V=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL))
+	{
+		bsdiff_index_free(index);
+		return -1;
+	}
+	qsufsort(index->I,V,old,oldsize);
+	stream->free(V);
+
+	return 0;
+}
+
+int bsdiff_index_diff(const struct bsdiff_index* index, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	struct bsdiff_request req;
+	uint8_t* fnew = NULL;
+	int result;
+
+	if ((options != NULL ? options->filter : BSFILTER_NONE) != index->filter)
+		return -1;
+
+	req.digest_new = NULL;
+	if (options != NULL && options->digest)
+		req.digest_new = new;
+	req.precheck_old = NULL;
+	if (options != NULL && options->precheck)
+		req.precheck_old = index->old;
+	req.filter = index->filter;
+	req.fill = options != NULL && options->fill;
+	req.optimal = options != NULL && options->optimal;
+
+	if (index->filter != BSFILTER_NONE)
+	{
+		if((fnew=stream->malloc(newsize+1))==NULL)
+			return -1;
+		memcpy(fnew, new, newsize);
+		bsfilter_code(index->filter, fnew, newsize, 0, 1);
+		new = fnew;
+	}
+
+	req.old = index->fold != NULL ? index->fold : index->old;
+	req.oldsize = index->oldsize;
+	req.new = new;
+	req.newsize = newsize;
+	req.stream = stream;
+	req.I = index->I;
+	req.scratch = NULL;
+	req.speed = 0;
+	if (options != NULL && options->speed > 0)
+		req.speed = MIN(options->speed, BSDIFF_SPEED_MAX);
+
+	/* The index is shared between threads, the diff buffer is not */
+	if((req.emit=stream->malloc(BSDIFF_EMIT_SIZE))==NULL)
+	{
+		if (fnew != NULL)
+			stream->free(fnew);
+		return -1;
+	}
 
 	result = bsdiff_internal(req);
 
-	stream->free(req.buffer);
-	stream->free(req.I);
+	stream->free(req.emit);
+	if (fnew != NULL)
+		stream->free(fnew);
 
 	return result;
 }
 
+void bsdiff_index_free(struct bsdiff_index* index)
+{
+	if (index->free != NULL)
+	{
+		if (index->I != NULL) index->free(index->I);
+		if (index->fold != NULL) index->free(index->fold);
+	}
+
+	memset(index, 0, sizeof(*index));
+}
+
+void bsdiff_ctx_free(struct bsdiff_ctx* ctx)
+{
+	if (ctx->free != NULL)
+	{
+		if (ctx->I != NULL) ctx->free(ctx->I);
+		if (ctx->V != NULL) ctx->free(ctx->V);
+		if (ctx->fold != NULL) ctx->free(ctx->fold);
+		if (ctx->fnew != NULL) ctx->free(ctx->fnew);
+		if (ctx->emit != NULL) ctx->free(ctx->emit);
+	}
+
+	memset(ctx, 0, sizeof(*ctx));
+}
+
 #if defined(BSDIFF_EXECUTABLE)
 
 #include <sys/types.h>
@@ -374,12 +1355,45 @@ int main(int argc,char *argv[])
 	off_t oldsize,newsize;
 	FILE * pf;
 	struct bsdiff_stream stream;
+	struct bsdiff_options options = { .filter = BSFILTER_NONE };
+	int ch;
 
 	stream.malloc = malloc;
 	stream.free = free;
 	stream.write = __write;
 
-	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
+	while ((ch = getopt(argc, argv, "cdf:ors:")) != -1) {
+		switch (ch) {
+		case 'c':
+			options.precheck = 1;
+			break;
+		case 'd':
+			options.digest = 1;
+			break;
+		case 'f':
+			if ((options.filter = bsfilter_from_name(optarg)) < 0)
+				errx(1, "unknown filter %s", optarg);
+			break;
+		case 'o':
+			options.optimal = 1;
+			break;
+		case 'r':
+			options.fill = 1;
+			break;
+		case 's':
+			options.speed = atoi(optarg);
+			if (options.speed < 0 || options.speed > BSDIFF_SPEED_MAX)
+				errx(1, "speed must be 0 to %d", BSDIFF_SPEED_MAX);
+			break;
+		default:
+			errx(1,"usage: %s [-c] [-d] [-f none|arm|thumb] [-o] [-r] [-s speed] oldfile newfile patchfile\n",argv[0]);
+		}
+	}
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc!=4) errx(1,"usage: %s [-c] [-d] [-f none|arm|thumb] [-o] [-r] [-s speed] oldfile newfile patchfile\n",argv[0]);
 
 	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
 		that we never try to malloc(0) and get a NULL pointer */
@@ -405,7 +1419,7 @@ int main(int argc,char *argv[])
 		err(1, "%s", argv[3]);
 
 	stream.opaque = pf;
-	if (bsdiff(old, oldsize, new, newsize, &stream))
+	if (bsdiff_ex(old, oldsize, new, newsize, &stream, &options))
 		err(1, "bsdiff");
 
 	if (fclose(pf))
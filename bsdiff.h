@@ -31,6 +31,8 @@
 # include <stddef.h>
 # include <stdint.h>
 
+# include "bsfilter.h"
+
 struct bsdiff_stream
 {
 	void* opaque;
@@ -40,6 +42,148 @@ struct bsdiff_stream
 	int (*write)(struct bsdiff_stream* stream, const void* buffer, int size);
 };
 
+struct bsdiff_options
+{
+	/* Branch filter (enum bsfilter) applied to old and new before diffing. bspatch
+	 * must be given the same filter with bspatch_set_filter(). */
+	int filter;
+	/*
+	 * 0 (the default) searches for a match at every byte of new. Higher levels, up
+	 * to BSDIFF_SPEED_MAX, widen the search stride sooner and further after repeated
+	 * misses, which pays off in unmatched regions (new code, compressed data) at the
+	 * cost of a slightly larger patch.
+	 */
+	int speed;
+	/*
+	 * Non-zero to end the patch with a digest block: SHA-256 of the old bytes the
+	 * diff data is added to and of new, which bspatch_set_verify() checks. Patches
+	 * with a digest block are rejected by bspatch builds that predate it.
+	 */
+	int digest;
+	/*
+	 * Non-zero to start the patch with a precheck block: the old ranges the patch
+	 * reads and their SHA-256, which bspatch_precheck() checks before patching.
+	 */
+	int precheck;
+	/*
+	 * Non-zero to write runs of at least BSDIFF_FILL_MIN equal bytes of new, like
+	 * erased flash and padding, as fill blocks that bspatch writes without reading
+	 * old or the patch. Patches with fill blocks are rejected by bspatch builds that
+	 * predate them.
+	 */
+	int fill;
+	/*
+	 * Non-zero to choose the blocks by dynamic programming over the candidate matches
+	 * of every byte of new, minimising an estimate of the compressed patch size with
+	 * the control words counted in, instead of the greedy scan. Slower, and needs
+	 * up to 20 bytes per byte of old and 22 per byte of new, see bsdiff_memory();
+	 * speed is ignored.
+	 */
+	int optimal;
+};
+
+/* Old ranges less than this many bytes apart share one entry of the precheck block */
+# ifndef BSDIFF_PRECHECK_GAP
+#  define BSDIFF_PRECHECK_GAP 4096
+# endif
+
+/* Runs of equal bytes shorter than this are left in the diff and extra data */
+# ifndef BSDIFF_FILL_MIN
+#  define BSDIFF_FILL_MIN 64
+# endif
+
+# define BSDIFF_SPEED_MAX 3
+
+/* Diff bytes are emitted through a buffer of this many bytes, from stream->malloc */
+# ifndef BSDIFF_EMIT_SIZE
+#  define BSDIFF_EMIT_SIZE 16384
+# endif
+
+/*
+ * Work memory that can be kept across bsdiff runs. The suffix array and its
+ * scratch array (8 bytes per old byte each) and the filter copies only grow
+ * when a larger image comes along, and are released by bsdiff_ctx_free() along
+ * with the diff buffer.
+ * bsdiff() and bsdiff_ex() use a context of their own and free the scratch array
+ * as soon as the sort is done. Zero-initialize before first use.
+ */
+struct bsdiff_ctx
+{
+	int64_t *I;
+	int64_t *V;
+	int64_t capacity;
+
+	uint8_t *fold;
+	int64_t fold_capacity;
+	uint8_t *fnew;
+	int64_t fnew_capacity;
+
+	uint8_t *emit;	/* BSDIFF_EMIT_SIZE bytes */
+
+	void (*free)(void* ptr);
+};
+
 int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream);
 
+/* Same as bsdiff(), options may be NULL for the defaults */
+int bsdiff_ex(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/* Same as bsdiff_ex(), keeping work memory in ctx for the next call */
+int bsdiff_ctx_diff(struct bsdiff_ctx* ctx, const uint8_t* old, int64_t oldsize,
+	const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/* Releases the work memory of ctx, which can then be reused from scratch */
+void bsdiff_ctx_free(struct bsdiff_ctx* ctx);
+
+/*
+ * Peak work memory bsdiff_ex() takes from stream->malloc for the given sizes and
+ * options, not counting the list of blocks a precheck block holds back (48 bytes a
+ * block). That is 16 bytes per old byte for the greedy scan, and at most 20 per old
+ * byte plus 22 per new byte for the optimal parse, plus the filter copies and the
+ * BSDIFF_EMIT_SIZE diff buffer.
+ */
+int64_t bsdiff_memory(int64_t oldsize, int64_t newsize, const struct bsdiff_options* options);
+
+/*
+ * Suffix array index of an old image, built once and shared by any number of diffs
+ * against that image, from any thread. Holds 8 bytes per old byte, plus a filtered
+ * copy of old when a branch filter is used.
+ */
+struct bsdiff_index
+{
+	const uint8_t* old;	/* the caller's image, must outlive the index */
+	int64_t oldsize;
+	int filter;
+
+	/* Internal */
+	int64_t *I;
+	uint8_t *fold;
+	void (*free)(void* ptr);
+};
+
+/* Memory bsdiff_index_build() keeps for an image of oldsize bytes */
+int64_t bsdiff_index_memory(int64_t oldsize, int filter);
+
+/*
+ * Sorts old into index, for diffs with the branch filter (enum bsfilter) filter.
+ * Memory comes from stream->malloc and peaks at twice bsdiff_index_memory() while
+ * sorting.
+ *
+ * Returns 0 on success, -1 on allocation failure
+ */
+int bsdiff_index_build(struct bsdiff_index* index, const uint8_t* old, int64_t oldsize,
+	int filter, struct bsdiff_stream* stream);
+
+/*
+ * Same as bsdiff_ex() against the image of index, without sorting it again.
+ * options->filter must be the filter the index was built for.
+ */
+int bsdiff_index_diff(const struct bsdiff_index* index, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/* Releases the memory of index */
+void bsdiff_index_free(struct bsdiff_index* index);
+
 #endif
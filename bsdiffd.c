@@ -0,0 +1,652 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Local diff service. Keeps the suffix array indices of recently used old images in
+ * an LRU cache, so that diffs against a hot base image skip reloading and sorting it.
+ * Requests come in over a Unix domain socket and are served by a pool of threads;
+ * the patch is streamed back as bsdiff produces it.
+ *
+ * Request, integers coded like the control words of a patch:
+ *
+ *   "BSDIFFD1" | filter | speed | digest | precheck | fill | optimal | old path length |
+ *   new path length | old path | new path
+ *
+ * Reply, a sequence of frames that each start with a length:
+ *
+ *   n > 0: n bytes of patch follow
+ *   n = 0: the patch is complete
+ *   n < 0: -n bytes of error message follow, and the patch is abandoned
+ *
+ * Old images are cached by device, inode, size and modification time, so a file that
+ * is replaced is loaded again. Paths are opened by the service, relative to its
+ * working directory, with its permissions. The socket is created with mode 0600, so
+ * only the user the service runs as can connect and have it read files.
+ */
+
+#if defined(BSDIFFD_EXECUTABLE)
+
+#include "bsdiff.h"
+#include "bsformat.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BSDIFFD_MAGIC "BSDIFFD1"
+#define BSDIFFD_MAGIC_SIZE 8
+#define BSDIFFD_REQUEST_INTS 8
+
+/* Connections accepted but not yet picked up by a worker */
+#define BSDIFFD_BACKLOG 64
+
+/* Patch bytes are sent in frames of up to this many bytes */
+#define BSDIFFD_FRAME_SIZE 65536
+
+static int readall(int fd, void* buf, int64_t size)
+{
+	uint8_t* p = buf;
+
+	while (size > 0) {
+		ssize_t n = read(fd, p, size > INT_MAX ? INT_MAX : size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int writeall(int fd, const void* buf, int64_t size)
+{
+	const uint8_t* p = buf;
+
+	while (size > 0) {
+		ssize_t n = write(fd, p, size > INT_MAX ? INT_MAX : size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Loads a whole file, with st describing it */
+static uint8_t* load(const char* name, struct stat* st)
+{
+	uint8_t* buf;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, st) != 0 || (buf = malloc(st->st_size + 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (readall(fd, buf, st->st_size) != 0) {
+		free(buf);
+		buf = NULL;
+	}
+	close(fd);
+
+	return buf;
+}
+
+/* One old image in the cache */
+struct cache_entry
+{
+	struct cache_entry* next;
+
+	/* Identity of the file the index was built from */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	int filter;
+
+	uint8_t* old;
+	struct bsdiff_index index;
+	int64_t memory;
+	int ready;		/* 0 while the index is being built */
+	int failed;
+	int refs;		/* requests using the entry */
+	uint64_t used;		/* LRU stamp */
+};
+
+struct service
+{
+	pthread_mutex_t lock;
+	pthread_cond_t built;
+	pthread_cond_t queued;
+	pthread_cond_t taken;
+
+	struct cache_entry* entries;
+	int64_t memory;		/* held by all entries */
+	int64_t budget;
+	uint64_t clock;
+
+	int queue[BSDIFFD_BACKLOG];
+	int head;
+	int count;
+};
+
+static int64_t entry_memory(off_t size, int filter)
+{
+	return size + 1 + bsdiff_index_memory(size, filter);
+}
+
+static void entry_free(struct cache_entry* entry)
+{
+	bsdiff_index_free(&entry->index);
+	free(entry->old);
+	free(entry);
+}
+
+/* Unlinks entry from the cache, called with the lock held */
+static void cache_remove(struct service* svc, struct cache_entry* entry)
+{
+	struct cache_entry** p;
+
+	for (p = &svc->entries; *p != entry; p = &(*p)->next)
+		;
+	*p = entry->next;
+	svc->memory -= entry->memory;
+}
+
+/*
+ * Drops least recently used entries nobody is using until need more bytes fit in the
+ * budget, called with the lock held. Entries in use are never dropped, so the cache
+ * can go over budget while they are.
+ */
+static void cache_evict(struct service* svc, int64_t need)
+{
+	while (svc->budget > 0 && svc->memory + need > svc->budget) {
+		struct cache_entry *entry, *lru = NULL;
+		for (entry = svc->entries; entry != NULL; entry = entry->next)
+			if (entry->refs == 0 && (lru == NULL || entry->used < lru->used))
+				lru = entry;
+		if (lru == NULL)
+			break;
+		cache_remove(svc, lru);
+		entry_free(lru);
+	}
+}
+
+/*
+ * Returns the cache entry of the old image at path, loading and indexing it if it
+ * is not cached yet, or NULL with *error set. Release it with cache_release().
+ */
+static struct cache_entry* cache_acquire(struct service* svc, const char* path, int filter,
+	const char** error, int* hit)
+{
+	struct cache_entry* entry;
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		*error = "cannot stat old file";
+		return NULL;
+	}
+
+	pthread_mutex_lock(&svc->lock);
+	for (entry = svc->entries; entry != NULL; entry = entry->next)
+		if (entry->dev == st.st_dev && entry->ino == st.st_ino && entry->size == st.st_size &&
+			entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+			entry->mtime.tv_nsec == st.st_mtim.tv_nsec && entry->filter == filter)
+			break;
+
+	if (entry != NULL) {
+		/* Someone else may still be building it */
+		entry->refs++;
+		while (!entry->ready)
+			pthread_cond_wait(&svc->built, &svc->lock);
+		if (entry->failed) {
+			if (--entry->refs == 0)
+				entry_free(entry);
+			pthread_mutex_unlock(&svc->lock);
+			*error = "cannot index old file";
+			return NULL;
+		}
+		entry->used = ++svc->clock;
+		*hit = 1;
+		pthread_mutex_unlock(&svc->lock);
+		return entry;
+	}
+
+	if ((entry = calloc(1, sizeof(*entry))) == NULL) {
+		pthread_mutex_unlock(&svc->lock);
+		*error = "out of memory";
+		return NULL;
+	}
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+	entry->size = st.st_size;
+	entry->mtime = st.st_mtim;
+	entry->filter = filter;
+	entry->memory = entry_memory(st.st_size, filter);
+	entry->refs = 1;
+	entry->used = ++svc->clock;
+	cache_evict(svc, entry->memory);
+	entry->next = svc->entries;
+	svc->entries = entry;
+	svc->memory += entry->memory;
+	*hit = 0;
+	pthread_mutex_unlock(&svc->lock);
+
+	/* Build outside the lock, requests for other images go on meanwhile */
+	struct bsdiff_stream stream = { .malloc = malloc, .free = free };
+	struct stat loaded;
+	if ((entry->old = load(path, &loaded)) == NULL || loaded.st_size != st.st_size) {
+		*error = "cannot read old file";
+		entry->failed = 1;
+	} else if (bsdiff_index_build(&entry->index, entry->old, st.st_size, filter, &stream) != 0) {
+		*error = "out of memory";
+		entry->failed = 1;
+	}
+
+	pthread_mutex_lock(&svc->lock);
+	entry->ready = 1;
+	pthread_cond_broadcast(&svc->built);
+	if (entry->failed) {
+		/* Waiters see failed and drop their references, the last one frees it */
+		cache_remove(svc, entry);
+		entry->memory = 0;
+		if (--entry->refs == 0)
+			entry_free(entry);
+		entry = NULL;
+	}
+	pthread_mutex_unlock(&svc->lock);
+
+	return entry;
+}
+
+static void cache_release(struct service* svc, struct cache_entry* entry)
+{
+	pthread_mutex_lock(&svc->lock);
+	entry->refs--;
+	cache_evict(svc, 0);
+	pthread_mutex_unlock(&svc->lock);
+}
+
+/* Reply frames, staged so that small patch writes do not each become a frame */
+struct reply
+{
+	int fd;
+	int len;
+	uint8_t buf[8 + BSDIFFD_FRAME_SIZE];
+};
+
+static int reply_flush(struct reply* reply)
+{
+	if (reply->len == 0)
+		return 0;
+	bsformat_offtout(reply->len, reply->buf);
+	if (writeall(reply->fd, reply->buf, 8 + reply->len) != 0)
+		return -1;
+	reply->len = 0;
+	return 0;
+}
+
+static int reply_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	struct reply* reply = stream->opaque;
+	const uint8_t* p = buffer;
+
+	while (size > 0) {
+		int n = BSDIFFD_FRAME_SIZE - reply->len;
+		n = n < size ? n : size;
+		memcpy(reply->buf + 8 + reply->len, p, n);
+		reply->len += n;
+		p += n;
+		size -= n;
+		if (reply->len == BSDIFFD_FRAME_SIZE && reply_flush(reply) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void reply_error(struct reply* reply, const char* message)
+{
+	uint8_t len[8];
+
+	bsformat_offtout(-(int64_t)strlen(message), len);
+	if (writeall(reply->fd, len, sizeof(len)) == 0)
+		writeall(reply->fd, message, strlen(message));
+}
+
+static void serve(struct service* svc, int fd)
+{
+	uint8_t header[BSDIFFD_MAGIC_SIZE + 8 * BSDIFFD_REQUEST_INTS];
+	int64_t req[BSDIFFD_REQUEST_INTS];
+	char *oldpath = NULL, *newpath = NULL;
+	uint8_t* new = NULL;
+	struct reply* reply;
+	struct cache_entry* entry = NULL;
+	struct bsdiff_options options;
+	struct stat st;
+	const char* error = NULL;
+	struct timespec start, end;
+	int i, hit = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((reply = malloc(sizeof(*reply))) == NULL) {
+		close(fd);
+		return;
+	}
+	reply->fd = fd;
+	reply->len = 0;
+
+	if (readall(fd, header, sizeof(header)) != 0 ||
+		memcmp(header, BSDIFFD_MAGIC, BSDIFFD_MAGIC_SIZE) != 0) {
+		error = "malformed request";
+		goto done;
+	}
+	for (i = 0; i < BSDIFFD_REQUEST_INTS; i++)
+		req[i] = bsformat_offtin(header + BSDIFFD_MAGIC_SIZE + 8 * i);
+	if (req[0] < BSFILTER_NONE || req[0] > BSFILTER_ARMTHUMB ||
+		req[1] < 0 || req[1] > BSDIFF_SPEED_MAX ||
+		req[6] <= 0 || req[6] > PATH_MAX || req[7] <= 0 || req[7] > PATH_MAX) {
+		error = "malformed request";
+		goto done;
+	}
+	if ((oldpath = calloc(1, req[6] + 1)) == NULL || (newpath = calloc(1, req[7] + 1)) == NULL ||
+		readall(fd, oldpath, req[6]) != 0 || readall(fd, newpath, req[7]) != 0) {
+		error = "malformed request";
+		goto done;
+	}
+
+	memset(&options, 0, sizeof(options));
+	options.filter = req[0];
+	options.speed = req[1];
+	options.digest = req[2] != 0;
+	options.precheck = req[3] != 0;
+	options.fill = req[4] != 0;
+	options.optimal = req[5] != 0;
+
+	if ((new = load(newpath, &st)) == NULL) {
+		error = "cannot read new file";
+		goto done;
+	}
+	if ((entry = cache_acquire(svc, oldpath, options.filter, &error, &hit)) == NULL)
+		goto done;
+
+	struct bsdiff_stream stream = { .opaque = reply, .malloc = malloc, .free = free, .write = reply_write };
+	if (bsdiff_index_diff(&entry->index, new, st.st_size, &stream, &options) != 0 ||
+		reply_flush(reply) != 0) {
+		error = "bsdiff failed";
+		goto done;
+	}
+
+done:
+	if (entry != NULL)
+		cache_release(svc, entry);
+	if (error == NULL) {
+		uint8_t zero[8];
+		bsformat_offtout(0, zero);
+		writeall(fd, zero, sizeof(zero));
+	} else {
+		reply_error(reply, error);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (error != NULL)
+		fprintf(stderr, "%s %s: %s\n", oldpath != NULL ? oldpath : "?",
+			newpath != NULL ? newpath : "?", error);
+	else
+		fprintf(stderr, "%s %s: ok, index %s, %.3f s\n", oldpath, newpath,
+			hit ? "cached" : "built",
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	close(fd);
+	free(new);
+	free(newpath);
+	free(oldpath);
+	free(reply);
+}
+
+static void* worker(void* arg)
+{
+	struct service* svc = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&svc->lock);
+		while (svc->count == 0)
+			pthread_cond_wait(&svc->queued, &svc->lock);
+		const int fd = svc->queue[svc->head];
+		svc->head = (svc->head + 1) % BSDIFFD_BACKLOG;
+		svc->count--;
+		pthread_cond_signal(&svc->taken);
+		pthread_mutex_unlock(&svc->lock);
+
+		serve(svc, fd);
+	}
+
+	return NULL;
+}
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+static int serve_main(const char* path, int jobs, int64_t budget)
+{
+	struct sockaddr_un addr;
+	struct service svc;
+	struct sigaction sa;
+	pthread_t thread;
+	mode_t mask;
+	int sock, fd, i;
+
+	memset(&svc, 0, sizeof(svc));
+	svc.budget = budget;
+	pthread_mutex_init(&svc.lock, NULL);
+	pthread_cond_init(&svc.built, NULL);
+	pthread_cond_init(&svc.queued, NULL);
+	pthread_cond_init(&svc.taken, NULL);
+
+	/* No SA_RESTART, so that accept() returns on SIGINT and SIGTERM */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "socket path too long");
+	strcpy(addr.sun_path, path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	unlink(path);
+	/* Owner only, from the start; no other thread exists yet to see the umask */
+	mask = umask(0177);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		umask(mask);
+		err(1, "%s", path);
+	}
+	umask(mask);
+	if (listen(sock, BSDIFFD_BACKLOG) != 0)
+		err(1, "%s", path);
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&thread, NULL, worker, &svc) != 0)
+			errx(1, "pthread_create");
+		pthread_detach(thread);
+	}
+
+	while (!stopping) {
+		if ((fd = accept(sock, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		pthread_mutex_lock(&svc.lock);
+		while (svc.count == BSDIFFD_BACKLOG)
+			pthread_cond_wait(&svc.taken, &svc.lock);
+		svc.queue[(svc.head + svc.count) % BSDIFFD_BACKLOG] = fd;
+		svc.count++;
+		pthread_cond_signal(&svc.queued);
+		pthread_mutex_unlock(&svc.lock);
+	}
+
+	close(sock);
+	unlink(path);
+	return 0;
+}
+
+/* Sends one request and writes the patch that comes back to patchfile */
+static int client_main(const char* path, const struct bsdiff_options* options,
+	const char* oldfile, const char* newfile, const char* patchfile)
+{
+	struct sockaddr_un addr;
+	char oldpath[PATH_MAX], newpath[PATH_MAX];
+	uint8_t header[BSDIFFD_MAGIC_SIZE + 8 * BSDIFFD_REQUEST_INTS];
+	uint8_t* buf;
+	int64_t len;
+	int sock;
+	FILE* pf;
+
+	/* The service may run in another directory */
+	if (realpath(oldfile, oldpath) == NULL)
+		err(1, "%s", oldfile);
+	if (realpath(newfile, newpath) == NULL)
+		err(1, "%s", newfile);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "socket path too long");
+	strcpy(addr.sun_path, path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+		err(1, "%s", path);
+
+	memcpy(header, BSDIFFD_MAGIC, BSDIFFD_MAGIC_SIZE);
+	bsformat_offtout(options->filter, header + BSDIFFD_MAGIC_SIZE);
+	bsformat_offtout(options->speed, header + BSDIFFD_MAGIC_SIZE + 8);
+	bsformat_offtout(options->digest, header + BSDIFFD_MAGIC_SIZE + 16);
+	bsformat_offtout(options->precheck, header + BSDIFFD_MAGIC_SIZE + 24);
+	bsformat_offtout(options->fill, header + BSDIFFD_MAGIC_SIZE + 32);
+	bsformat_offtout(options->optimal, header + BSDIFFD_MAGIC_SIZE + 40);
+	bsformat_offtout(strlen(oldpath), header + BSDIFFD_MAGIC_SIZE + 48);
+	bsformat_offtout(strlen(newpath), header + BSDIFFD_MAGIC_SIZE + 56);
+	if (writeall(sock, header, sizeof(header)) != 0 ||
+		writeall(sock, oldpath, strlen(oldpath)) != 0 ||
+		writeall(sock, newpath, strlen(newpath)) != 0)
+		err(1, "%s", path);
+
+	if ((pf = fopen(patchfile, "w")) == NULL)
+		err(1, "%s", patchfile);
+	if ((buf = malloc(BSDIFFD_FRAME_SIZE + 1)) == NULL)
+		err(1, NULL);
+
+	for (;;) {
+		if (readall(sock, header, 8) != 0)
+			errx(1, "%s: connection lost", path);
+		len = bsformat_offtin(header);
+		if (len == 0)
+			break;
+		if (len < -BSDIFFD_FRAME_SIZE || len > BSDIFFD_FRAME_SIZE)
+			errx(1, "%s: malformed reply", path);
+		if (readall(sock, buf, len < 0 ? -len : len) != 0)
+			errx(1, "%s: connection lost", path);
+		if (len < 0) {
+			buf[-len] = '\0';
+			fclose(pf);
+			unlink(patchfile);
+			errx(1, "%s", buf);
+		}
+		if (fwrite(buf, len, 1, pf) != 1)
+			err(1, "%s", patchfile);
+	}
+
+	if (fclose(pf))
+		err(1, "%s", patchfile);
+	close(sock);
+	free(buf);
+
+	return 0;
+}
+
+#define USAGE "usage: %s -l [-j jobs] [-m cache_mb] socket\n" \
+	"       %s [-c] [-d] [-f none|arm|thumb] [-o] [-r] [-s speed] socket oldfile newfile patchfile\n"
+
+int main(int argc,char *argv[])
+{
+	struct bsdiff_options options = { .filter = BSFILTER_NONE };
+	const char* name = argv[0];
+	int64_t budget = 0;
+	int listening = 0;
+	int jobs = 4;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "lj:m:cdf:ors:")) != -1) {
+		switch (ch) {
+		case 'l':
+			listening = 1;
+			break;
+		case 'j':
+			if ((jobs = atoi(optarg)) < 1)
+				errx(1, "invalid job count %s", optarg);
+			break;
+		case 'm':
+			if ((budget = atoll(optarg)) < 0)
+				errx(1, "invalid cache budget %s", optarg);
+			budget *= 1024 * 1024;
+			break;
+		case 'c':
+			options.precheck = 1;
+			break;
+		case 'd':
+			options.digest = 1;
+			break;
+		case 'f':
+			if ((options.filter = bsfilter_from_name(optarg)) < 0)
+				errx(1, "unknown filter %s", optarg);
+			break;
+		case 'o':
+			options.optimal = 1;
+			break;
+		case 'r':
+			options.fill = 1;
+			break;
+		case 's':
+			options.speed = atoi(optarg);
+			if (options.speed < 0 || options.speed > BSDIFF_SPEED_MAX)
+				errx(1, "speed must be 0 to %d", BSDIFF_SPEED_MAX);
+			break;
+		default:
+			errx(1,USAGE,name,name);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (listening && argc == 1)
+		return serve_main(argv[0], jobs, budget);
+	if (!listening && argc == 4)
+		return client_main(argv[0], &options, argv[1], argv[2], argv[3]);
+
+	errx(1,USAGE,name,name);
+}
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "bsestimate.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(BSESTIMATE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "bsformat.h"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+/* Control words are mostly small numbers and compress to about this many bytes */
+#define CTRL_COST 8
+
+/* A match extension gives up after this many bytes without improving */
+#define EXTEND_SLACK 256
+
+#define HASH_BASE 0x100000001b3ULL
+
+/* Predicted diff bytes and compressed output go through buffers of this many bytes */
+#define SINK_SIZE 4096
+
+struct seed
+{
+	uint64_t hash;
+	int64_t pos;	/* -1 when the slot is empty */
+};
+
+/*
+ * Receives the predicted patch. Without zlib only the byte histograms of the diff
+ * and extra data are kept, with zlib the patch is also deflated as it comes.
+ */
+struct sink
+{
+	int64_t extra[256];
+	int64_t diff[256];
+	int64_t raw_size;
+#if defined(BSESTIMATE_ZLIB)
+	struct bsdiff_stream* stream;
+	z_stream z;
+	int64_t compressed_size;
+	uint8_t* buf;	/* diff bytes, then compressed output */
+#endif
+};
+
+static uint64_t seed_hash(const uint8_t* buf)
+{
+	uint64_t h = 0;
+
+	for (int i = 0; i < BSESTIMATE_SEED; i++)
+		h = h * HASH_BASE + buf[i];
+
+	return h;
+}
+
+/* Samples seeds by content, so old and new pick the same ones */
+static int sampled(uint64_t h)
+{
+	return ((h * 0x9E3779B97F4A7C15ULL) >> 40) % BSESTIMATE_SAMPLE == 0;
+}
+
+static struct seed* table_slot(struct seed* table, int64_t mask, uint64_t h)
+{
+	int64_t i = (int64_t)((h * 0x9E3779B97F4A7C15ULL) >> 20) & mask;
+
+	while (table[i].pos >= 0 && table[i].hash != h)
+		i = (i + 1) & mask;
+
+	return &table[i];
+}
+
+/* Order-0 entropy of a histogram, in bits */
+static double entropy(const int64_t hist[256])
+{
+	int64_t n = 0;
+	double bits = 0;
+
+	for (int i = 0; i < 256; i++)
+		n += hist[i];
+	for (int i = 0; i < 256; i++)
+		if (hist[i] > 0)
+			bits += hist[i] * log2((double)n / hist[i]);
+
+	return bits;
+}
+
+#if defined(BSESTIMATE_ZLIB)
+
+static voidpf sink_alloc(voidpf opaque, uInt items, uInt size)
+{
+	return ((struct bsdiff_stream*)opaque)->malloc((size_t)items * size);
+}
+
+static void sink_free(voidpf opaque, voidpf address)
+{
+	((struct bsdiff_stream*)opaque)->free(address);
+}
+
+static int sink_open(struct sink* sink, struct bsdiff_stream* stream)
+{
+	sink->stream = stream;
+	if ((sink->buf = stream->malloc(2 * SINK_SIZE)) == NULL)
+		return -1;
+	memset(&sink->z, 0, sizeof(sink->z));
+	sink->z.zalloc = sink_alloc;
+	sink->z.zfree = sink_free;
+	sink->z.opaque = stream;
+	if (deflateInit(&sink->z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		stream->free(sink->buf);
+		return -1;
+	}
+	return 0;
+}
+
+static void sink_close(struct sink* sink)
+{
+	deflateEnd(&sink->z);
+	sink->stream->free(sink->buf);
+}
+
+/* Deflates len bytes, or finishes the stream and starts a new one when flush is Z_FINISH */
+static int sink_deflate(struct sink* sink, const uint8_t* buf, int64_t len, int flush)
+{
+	int ret;
+
+	do {
+		sink->z.next_in = (Bytef*)buf;
+		sink->z.avail_in = (uInt)MIN(len, SINK_SIZE);
+		buf += sink->z.avail_in;
+		len -= sink->z.avail_in;
+		do {
+			sink->z.next_out = sink->buf + SINK_SIZE;
+			sink->z.avail_out = SINK_SIZE;
+			ret = deflate(&sink->z, len > 0 ? Z_NO_FLUSH : flush);
+			if (ret == Z_STREAM_ERROR)
+				return -1;
+			sink->compressed_size += SINK_SIZE - sink->z.avail_out;
+		} while (sink->z.avail_out == 0);
+	} while (len > 0);
+
+	if (flush == Z_FINISH)
+		return ret == Z_STREAM_END && deflateReset(&sink->z) == Z_OK ? 0 : -1;
+	return 0;
+}
+
+#endif
+
+/* Adds one block of the predicted patch: len diff bytes of new at pos against old
+ * at pos + offset, then the extra bytes up to end, then a seek in old */
+static int sink_block(struct sink* sink, const uint8_t* old, const uint8_t* new,
+	int64_t pos, int64_t len, int64_t offset, int64_t end, int64_t seek)
+{
+	int64_t i;
+
+	for (i = pos; i < pos + len; i++)
+		sink->diff[(uint8_t)(new[i] - old[i + offset])]++;
+	for (i = pos + len; i < end; i++)
+		sink->extra[new[i]]++;
+	sink->raw_size += BSPATCH_CTRL_SIZE + end - pos;
+
+#if defined(BSESTIMATE_ZLIB)
+	uint8_t ctrl[BSPATCH_CTRL_SIZE];
+
+	bsformat_offtout(len, ctrl);
+	bsformat_offtout(end - pos - len, ctrl + 8);
+	bsformat_offtout(seek, ctrl + 16);
+	if (sink_deflate(sink, ctrl, sizeof(ctrl), Z_NO_FLUSH))
+		return -1;
+	for (i = pos; i < pos + len; i++) {
+		sink->buf[(i - pos) % SINK_SIZE] = new[i] - old[i + offset];
+		if ((i - pos) % SINK_SIZE == SINK_SIZE - 1 || i == pos + len - 1)
+			if (sink_deflate(sink, sink->buf, (i - pos) % SINK_SIZE + 1, Z_NO_FLUSH))
+				return -1;
+	}
+	if (sink_deflate(sink, new + pos + len, end - pos - len, Z_NO_FLUSH))
+		return -1;
+#else
+	(void)seek;
+#endif
+
+	return 0;
+}
+
+int bsestimate(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, struct bsestimate* estimate)
+{
+	int64_t capacity = 16, mask, i, covered = 0;
+	int64_t bpos = 0, blen = 0, boffset = 0;	/* diff run of the block not yet added */
+	int64_t full[256];
+	struct seed* table;
+	struct sink sink;
+	uint64_t h, top = 1;
+	int result = -1;
+
+	memset(estimate, 0, sizeof(*estimate));
+	memset(&sink, 0, sizeof(sink));
+	memset(full, 0, sizeof(full));
+
+	/* Weight of the byte leaving the rolling hash */
+	for (i = 1; i < BSESTIMATE_SEED; i++)
+		top *= HASH_BASE;
+
+	/* Keep the table at most half full */
+	while (capacity < 2 * (oldsize / BSESTIMATE_SAMPLE + 1))
+		capacity *= 2;
+	mask = capacity - 1;
+	if ((table = stream->malloc(capacity * sizeof(*table))) == NULL)
+		return -1;
+#if defined(BSESTIMATE_ZLIB)
+	if (sink_open(&sink, stream)) {
+		stream->free(table);
+		return -1;
+	}
+#endif
+	for (i = 0; i < capacity; i++)
+		table[i].pos = -1;
+
+	/* Index the sampled seeds of old, the first of equal seeds wins */
+	for (i = 0, h = 0; i + BSESTIMATE_SEED <= oldsize; i++) {
+		h = i == 0 ? seed_hash(old) :
+			(h - old[i - 1] * top) * HASH_BASE + old[i + BSESTIMATE_SEED - 1];
+		if (sampled(h)) {
+			struct seed* slot = table_slot(table, mask, h);
+			if (slot->pos < 0) {
+				slot->hash = h;
+				slot->pos = i;
+			}
+		}
+	}
+
+	for (i = 0; i < newsize; i++)
+		full[new[i]]++;
+
+	/* Look up the sampled seeds of new, extending each hit like bsdiff would */
+	for (i = 0, h = 0; i + BSESTIMATE_SEED <= newsize; i++) {
+		h = i == covered ? seed_hash(new + i) :
+			(h - new[i - 1] * top) * HASH_BASE + new[i + BSESTIMATE_SEED - 1];
+		if (!sampled(h))
+			continue;
+
+		const struct seed* slot = table_slot(table, mask, h);
+		if (slot->pos < 0 || memcmp(old + slot->pos, new + i, BSESTIMATE_SEED) != 0)
+			continue;
+
+		const int64_t offset = slot->pos - i;
+		int64_t j, s, score, lenf = 0, lenb = 0;
+
+		/* Forward, keeping the length where matches minus mismatches peaks */
+		for (j = 0, s = 0, score = 0; i + j < newsize && i + j + offset < oldsize; j++) {
+			if (new[i + j] == old[i + j + offset]) s++;
+			if (s * 2 - (j + 1) > score) { score = s * 2 - (j + 1); lenf = j + 1; }
+			if (j + 1 - lenf > EXTEND_SLACK) break;
+		}
+
+		/* Backward, as far as the previous match */
+		for (j = 1, s = 0, score = 0; i - j >= covered && i - j + offset >= 0; j++) {
+			if (new[i - j] == old[i - j + offset]) s++;
+			if (s * 2 - j > score) { score = s * 2 - j; lenb = j; }
+			if (j - lenb > EXTEND_SLACK) break;
+		}
+
+		/* The same alignment goes on in the same block, as bsdiff stays on lastoffset */
+		if (blen > 0 && offset == boffset) {
+			blen = i + lenf - bpos;
+		} else {
+			/* Before the first match, a block of extra data only if there is any */
+			if (blen > 0 || i - lenb > 0) {
+				if (sink_block(&sink, old, new, bpos, blen, boffset, i - lenb,
+					i - lenb + offset - (bpos + blen + boffset)))
+					goto out;
+				estimate->blocks++;
+			}
+			bpos = i - lenb;
+			blen = lenb + lenf;
+			boffset = offset;
+		}
+
+		estimate->matched += lenb + lenf;
+		covered = i + lenf;
+		i = covered - 1;
+	}
+	if (sink_block(&sink, old, new, bpos, blen, boffset, newsize, 0))
+		goto out;
+	estimate->blocks++;
+
+	estimate->raw_size = sink.raw_size;
+	estimate->full_size = (int64_t)ceil(entropy(full) / 8);
+#if defined(BSESTIMATE_ZLIB)
+	if (sink_deflate(&sink, NULL, 0, Z_FINISH))
+		goto out;
+	estimate->compressed_size = sink.compressed_size;
+	sink.compressed_size = 0;
+	if (sink_deflate(&sink, new, newsize, Z_FINISH))
+		goto out;
+	estimate->full_size = sink.compressed_size;
+#else
+	estimate->compressed_size = (int64_t)ceil((entropy(sink.extra) + entropy(sink.diff)) / 8) +
+		estimate->blocks * CTRL_COST;
+#endif
+	result = 0;
+
+out:
+#if defined(BSESTIMATE_ZLIB)
+	sink_close(&sink);
+#endif
+	stream->free(table);
+
+	return result;
+}
+
+#if defined(BSESTIMATE_EXECUTABLE)
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static uint8_t* load(const char* name, off_t* size)
+{
+	uint8_t* buf;
+	int fd;
+
+	if(((fd=open(name,O_RDONLY,0))<0) ||
+		((*size=lseek(fd,0,SEEK_END))==-1) ||
+		((buf=malloc(*size+1))==NULL) ||
+		(lseek(fd,0,SEEK_SET)!=0) ||
+		(read(fd,buf,*size)!=*size) ||
+		(close(fd)==-1)) err(1,"%s",name);
+
+	return buf;
+}
+
+int main(int argc,char *argv[])
+{
+	uint8_t *old,*new;
+	off_t oldsize,newsize;
+	struct bsdiff_stream stream = { .malloc = malloc, .free = free };
+	struct bsestimate est;
+
+	if(argc!=3) errx(1,"usage: %s oldfile newfile\n",argv[0]);
+
+	old = load(argv[1], &oldsize);
+	new = load(argv[2], &newsize);
+
+	if (bsestimate(old, oldsize, new, newsize, &stream, &est))
+		errx(1, "bsestimate");
+
+	printf("matched %lld of %lld bytes in %lld blocks\n",
+		(long long)est.matched, (long long)newsize, (long long)est.blocks);
+	printf("patch %lld bytes, compressed %lld, full image compressed %lld\n",
+		(long long)est.raw_size, (long long)est.compressed_size, (long long)est.full_size);
+
+	free(old);
+	free(new);
+
+	return 0;
+}
+
+#endif
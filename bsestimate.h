@@ -0,0 +1,65 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSESTIMATE_H
+# define BSESTIMATE_H
+
+# include <stdint.h>
+
+# include "bsdiff.h"
+
+/* Seeds are this many bytes long */
+# define BSESTIMATE_SEED 16
+
+/* One seed in this many is sampled from old and looked up from new */
+# ifndef BSESTIMATE_SAMPLE
+#  define BSESTIMATE_SAMPLE 32
+# endif
+
+struct bsestimate
+{
+	int64_t raw_size;	/* predicted size of the bsdiff patch */
+	int64_t compressed_size;	/* predicted size of the patch after compression */
+	int64_t full_size;	/* predicted size of the new image after compression */
+	int64_t matched;	/* bytes of new predicted to come from old */
+	int64_t blocks;		/* predicted number of control blocks */
+};
+
+/*
+ * Predicts the size of bsdiff(old, new) without running it.
+ *
+ * A hash table holds one in BSESTIMATE_SAMPLE of the BSESTIMATE_SEED-byte seeds of
+ * old, chosen by their content so that new picks the same seeds wherever they moved.
+ * Each sampled seed of new is looked up, and a hit is extended in both directions
+ * the way bsdiff extends its matches, allowing for changed bytes. The hits make up
+ * the blocks of a predicted patch.
+ *
+ * Built with -DBSESTIMATE_ZLIB and linked with zlib, the predicted patch and new are
+ * deflated at the default level as they are produced: compressed_size and full_size
+ * are their real deflated sizes. Otherwise they are order-0 entropy estimates, of the
+ * diff and extra bytes plus 8 bytes a block for the patch, which do not see the
+ * redundancy a real compressor finds: compare them with each other only.
+ *
+ * Error against bsdiff_ex() with no options, on source text, object files,
+ * executables and a 13 MB archive, which test_bsestimate checks on its inputs:
+ *  - raw_size is 0.5 to 1.1 times the real patch size. Every byte of new is in the
+ *    patch once, so the error is in blocks: bsestimate misses the matches shorter
+ *    than about BSESTIMATE_SEED + BSESTIMATE_SAMPLE bytes, which bsdiff takes, and
+ *    predicts 2 to 10 times fewer blocks on text.
+ *  - With zlib, compressed_size is 0.5 to 1.5 times the deflated real patch; low
+ *    on text for the same reason.
+ *  - Without zlib, compressed_size is 0.8 to 1.5 times the same order-0 estimate
+ *    taken of the real patch, and anything from 0.25 to 1.7 times what deflate or xz
+ *    make of it.
+ *
+ * Takes linear time and 32 to 64 / BSESTIMATE_SAMPLE bytes of memory per old byte,
+ * from stream->malloc, plus the deflate state (about 270 KB) with zlib;
+ * stream->write is not used.
+ *
+ * Returns 0 on success, -1 on allocation failure
+ */
+int bsestimate(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+	struct bsdiff_stream* stream, struct bsestimate* estimate);
+
+#endif
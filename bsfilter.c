@@ -0,0 +1,94 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "bsfilter.h"
+
+#include <string.h>
+
+int bsfilter_align(int filter)
+{
+	switch (filter) {
+		case BSFILTER_ARM:
+			return 4;
+		case BSFILTER_ARMTHUMB:
+			return 2;
+		default:
+			return 1;
+	}
+}
+
+static void arm_code(uint8_t* buf, int64_t len, int64_t pos, int encode)
+{
+	int64_t i = (4 - (pos & 3)) & 3;
+
+	for (; i + 4 <= len; i += 4) {
+		if (buf[i + 3] != 0xEB)
+			continue;
+
+		uint32_t src = ((uint32_t)buf[i + 2] << 16) | ((uint32_t)buf[i + 1] << 8) | buf[i];
+		uint32_t dest;
+
+		src <<= 2;
+		if (encode)
+			dest = (uint32_t)(pos + i + 8) + src;
+		else
+			dest = src - (uint32_t)(pos + i + 8);
+		dest >>= 2;
+
+		buf[i + 2] = dest >> 16;
+		buf[i + 1] = dest >> 8;
+		buf[i] = dest;
+	}
+}
+
+static void armthumb_code(uint8_t* buf, int64_t len, int64_t pos, int encode)
+{
+	int64_t i = pos & 1;
+
+	for (; i + 4 <= len; i += 2) {
+		if ((buf[i + 1] & 0xF8) != 0xF0 || (buf[i + 3] & 0xF8) != 0xF8)
+			continue;
+
+		uint32_t src = (((uint32_t)buf[i + 1] & 7) << 19) | ((uint32_t)buf[i] << 11)
+			| (((uint32_t)buf[i + 3] & 7) << 8) | buf[i + 2];
+		uint32_t dest;
+
+		src <<= 1;
+		if (encode)
+			dest = (uint32_t)(pos + i + 4) + src;
+		else
+			dest = src - (uint32_t)(pos + i + 4);
+		dest >>= 1;
+
+		buf[i + 1] = 0xF0 | ((dest >> 19) & 7);
+		buf[i] = dest >> 11;
+		buf[i + 3] = 0xF8 | ((dest >> 8) & 7);
+		buf[i + 2] = dest;
+	}
+}
+
+void bsfilter_code(int filter, uint8_t* buf, int64_t len, int64_t pos, int encode)
+{
+	switch (filter) {
+		case BSFILTER_ARM:
+			arm_code(buf, len, pos, encode);
+			break;
+		case BSFILTER_ARMTHUMB:
+			armthumb_code(buf, len, pos, encode);
+			break;
+		default:
+			break;
+	}
+}
+
+int bsfilter_from_name(const char* name)
+{
+	if (strcmp(name, "none") == 0)
+		return BSFILTER_NONE;
+	if (strcmp(name, "arm") == 0)
+		return BSFILTER_ARM;
+	if (strcmp(name, "thumb") == 0)
+		return BSFILTER_ARMTHUMB;
+	return -1;
+}
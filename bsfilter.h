@@ -0,0 +1,53 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSFILTER_H
+#define BSFILTER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Reversible branch filters (BCJ-style).
+ *
+ * Moving code around changes the relative offset encoded in every call and branch
+ * that crosses the move, which bsdiff sees as noise. The filters rewrite those
+ * offsets as absolute targets, so unchanged calls to moved code stay byte-identical.
+ *
+ * Only instruction sets where a candidate instruction can be recognized from bits
+ * the filter never rewrites, at aligned positions where candidates never overlap,
+ * are supported. That makes every candidate independent of the ones before it, so
+ * any range of an image can be filtered on its own, which bspatch relies on to
+ * filter old-image reads at random positions.
+ */
+enum bsfilter {
+	BSFILTER_NONE = 0,
+	BSFILTER_ARM,		/* ARM BL, 4-byte aligned */
+	BSFILTER_ARMTHUMB,	/* Thumb-2 BL, 2-byte aligned */
+};
+
+/* Every supported candidate instruction is 4 bytes long */
+#define BSFILTER_INSN_SIZE 4
+
+/* Alignment of candidate instructions, in bytes (1 for BSFILTER_NONE) */
+int bsfilter_align(int filter);
+
+/*
+ * Converts the candidates that lie entirely within buf, which holds image bytes
+ * [pos, pos + len). encode turns relative offsets into absolute targets, !encode
+ * undoes it.
+ */
+void bsfilter_code(int filter, uint8_t* buf, int64_t len, int64_t pos, int encode);
+
+/* Returns the filter called name ("none", "arm", "thumb"), or -1 */
+int bsfilter_from_name(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
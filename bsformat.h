@@ -0,0 +1,68 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSFORMAT_H
+#define BSFORMAT_H
+
+#include <stdint.h>
+
+#include "bssha256.h"
+
+/*
+ * Patch format shared by the bsdiff and bspatch sides. Blocks start with X, Y and Z,
+ * each 8 bytes of sign and magnitude, least significant byte first.
+ */
+
+/* Size of the X, Y, Z control words that start each patch block */
+#define BSPATCH_CTRL_SIZE 24
+
+/*
+ * A negative X selects an extended operation instead of a diff length. Decoders that
+ * predate an operation fail the sanity check on it rather than misapply the patch.
+ *
+ * BSPATCH_OP_DIGEST: Y = BSPATCH_DIGEST_BLOCK_SIZE bytes follow, Z = 0. They are the
+ * SHA-256 digests checked by bspatch_set_verify(), old then new. An old digest of
+ * all zeros was not recorded and is not checked, which is how bscompose() marks a
+ * patch whose old reads no longer match those hashed by the first patch. The block
+ * produces no output and does not move in old.
+ *
+ * BSPATCH_OP_PRECHECK: Y bytes follow, Z = 0: a range count N, N pairs of old offset
+ * and length, then the SHA-256 of the old bytes in those ranges, the integers coded
+ * like X, Y and Z. Checked by bspatch_precheck() and skipped by bspatch(). The block
+ * produces no output and does not move in old.
+ *
+ * BSPATCH_OP_FILL: nothing follows. Writes Y copies of the byte Z (0 to 255) to new,
+ * for erased flash and padding, and does not move in old.
+ *
+ * BSPATCH_OP_FILTER: nothing follows, Y = 0. Z is the branch filter (enum bsfilter,
+ * never BSFILTER_NONE) the diff was made with. It comes ahead of every block that
+ * produces output, so bspatch() can refuse a patch that bspatch_set_filter() was not
+ * set up for. Patches made without a filter have no such block.
+ */
+#define BSPATCH_OP_DIGEST (-1)
+#define BSPATCH_OP_PRECHECK (-2)
+#define BSPATCH_OP_FILL (-3)
+#define BSPATCH_OP_FILTER (-4)
+
+#define BSPATCH_DIGEST_SIZE BSSHA256_SIZE
+#define BSPATCH_DIGEST_BLOCK_SIZE (2 * BSPATCH_DIGEST_SIZE)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bsdiff_stream;
+
+/* Decodes and encodes one X, Y or Z word */
+int64_t bsformat_offtin(const uint8_t *buf);
+void bsformat_offtout(int64_t x,uint8_t *buf);
+
+/* Writes length bytes through stream->write() in pieces of up to INT_MAX, -1 on error */
+int64_t bsformat_write(struct bsdiff_stream* stream, const void* buffer, int64_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
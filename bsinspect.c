@@ -0,0 +1,225 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "bsinspect.h"
+#include "bspatch.h"
+
+#include <string.h>
+
+static int64_t div_up(int64_t a, int64_t b)
+{
+	return (a + b - 1) / b;
+}
+
+static int seek_bucket(int64_t z)
+{
+	uint64_t y = z < 0 ? -(uint64_t)z : (uint64_t)z;
+	int bucket = 0;
+
+	while (y != 0 && bucket < BSINSPECT_SEEK_BUCKETS - 1) {
+		y >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+int bsinspect(const uint8_t* patch, int64_t patch_size, const struct bsinspect_flash* flash,
+	struct bsinspect* stats)
+{
+	const int64_t half_len = flash->buf_size / 2 > 0 ? flash->buf_size / 2 : 1;
+	struct bspatch_block blk;
+	int64_t i, programmed;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&blk, 0, sizeof(blk));
+
+	while (blk.patch_offset < patch_size) {
+		if (blk.patch_offset + BSPATCH_CTRL_SIZE > patch_size ||
+			bspatch_block_decode(&blk, patch + blk.patch_offset) != BSPATCH_SUCCESS)
+			return -1;
+
+		const int64_t data_size = blk.op ? blk.op_size : blk.ctrl[0] + blk.ctrl[1];
+		if (blk.patch_offset + BSPATCH_CTRL_SIZE + data_size > patch_size)
+			return -1;
+
+		stats->blocks++;
+		if (blk.op == BSPATCH_OP_FILL) {
+			stats->fill_blocks++;
+			stats->fill_bytes += blk.ctrl[1];
+			if (blk.fill_byte == 0xff)
+				stats->erased_fill_bytes += blk.ctrl[1];
+		} else if (blk.op) {
+			stats->op_blocks++;
+			stats->op_bytes += blk.op_size;
+		} else {
+			const uint8_t* diff = patch + blk.patch_offset + BSPATCH_CTRL_SIZE;
+
+			if (blk.ctrl[0] == 0 && blk.ctrl[1] == 0)
+				stats->empty_blocks++;
+			stats->diff_bytes += blk.ctrl[0];
+			stats->extra_bytes += blk.ctrl[1];
+			for (i = 0; i < blk.ctrl[0]; i++)
+				if (diff[i] == 0)
+					stats->zero_diff_bytes++;
+			stats->old_reads += div_up(blk.ctrl[0], half_len);
+			stats->seeks[seek_bucket(blk.ctrl[2])]++;
+			if (blk.ctrl[2] < 0)
+				stats->backward_seeks++;
+		}
+
+		bspatch_block_next(&blk);
+	}
+	stats->new_size = blk.new_offset;
+
+	if (flash->patch_chunk > 0)
+		stats->patch_reads = div_up(patch_size, flash->patch_chunk);
+	programmed = stats->new_size - (flash->skip_erased ? stats->erased_fill_bytes : 0);
+	stats->page_programs = flash->page_size > 0 ? div_up(programmed, flash->page_size) : 0;
+
+	stats->read_us = (stats->old_reads + stats->patch_reads) * flash->read_latency_us;
+	if (flash->read_mb_s > 0)
+		stats->read_us += (stats->diff_bytes + (flash->patch_chunk > 0 ? patch_size : 0)) /
+			flash->read_mb_s;
+	stats->program_us = stats->page_programs * flash->page_program_us;
+	stats->apply_us = stats->read_us + stats->program_us;
+
+	return 0;
+}
+
+#if defined(BSINSPECT_EXECUTABLE)
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define USAGE "usage: %s [-e] [-j] [-b buf_size] [-c patch_chunk] [-l read_latency_us] " \
+	"[-r read_mb_s] [-p page_size] [-t page_program_us] patchfile\n"
+
+static void print_text(const struct bsinspect* s, int64_t patch_size)
+{
+	const int64_t data = s->diff_bytes + s->extra_bytes + s->fill_bytes;
+	int i;
+
+	printf("patch %lld bytes, new %lld bytes\n", (long long)patch_size, (long long)s->new_size);
+	printf("blocks %lld: %lld empty, %lld fill, %lld other operations\n",
+		(long long)s->blocks, (long long)s->empty_blocks, (long long)s->fill_blocks,
+		(long long)s->op_blocks);
+	printf("diff %lld bytes (%.1f%%), %lld of them zero\n", (long long)s->diff_bytes,
+		data ? 100.0 * s->diff_bytes / data : 0.0, (long long)s->zero_diff_bytes);
+	printf("extra %lld bytes (%.1f%%)\n", (long long)s->extra_bytes,
+		data ? 100.0 * s->extra_bytes / data : 0.0);
+	printf("fill %lld bytes (%.1f%%), %lld of them 0xFF\n", (long long)s->fill_bytes,
+		data ? 100.0 * s->fill_bytes / data : 0.0, (long long)s->erased_fill_bytes);
+	printf("seeks: %lld backward\n", (long long)s->backward_seeks);
+	for (i = 0; i < BSINSPECT_SEEK_BUCKETS; i++) {
+		if (s->seeks[i] == 0)
+			continue;
+		if (i == 0)
+			printf("  |Z| = 0: %lld\n", (long long)s->seeks[i]);
+		else
+			printf("  |Z| < 2^%d: %lld\n", i, (long long)s->seeks[i]);
+	}
+	printf("apply %.1f ms: read %.1f ms (%lld old, %lld patch reads), program %.1f ms (%lld pages)\n",
+		s->apply_us / 1000, s->read_us / 1000, (long long)s->old_reads, (long long)s->patch_reads,
+		s->program_us / 1000, (long long)s->page_programs);
+}
+
+static void print_json(const struct bsinspect* s, int64_t patch_size)
+{
+	int i, first = 1;
+
+	printf("{\"patch_size\":%lld,\"new_size\":%lld,", (long long)patch_size, (long long)s->new_size);
+	printf("\"blocks\":%lld,\"empty_blocks\":%lld,\"fill_blocks\":%lld,\"op_blocks\":%lld,",
+		(long long)s->blocks, (long long)s->empty_blocks, (long long)s->fill_blocks,
+		(long long)s->op_blocks);
+	printf("\"diff_bytes\":%lld,\"zero_diff_bytes\":%lld,\"extra_bytes\":%lld,",
+		(long long)s->diff_bytes, (long long)s->zero_diff_bytes, (long long)s->extra_bytes);
+	printf("\"fill_bytes\":%lld,\"erased_fill_bytes\":%lld,\"op_bytes\":%lld,",
+		(long long)s->fill_bytes, (long long)s->erased_fill_bytes, (long long)s->op_bytes);
+	printf("\"backward_seeks\":%lld,\"seeks\":{", (long long)s->backward_seeks);
+	for (i = 0; i < BSINSPECT_SEEK_BUCKETS; i++) {
+		if (s->seeks[i] == 0)
+			continue;
+		printf("%s\"%d\":%lld", first ? "" : ",", i, (long long)s->seeks[i]);
+		first = 0;
+	}
+	printf("},\"old_reads\":%lld,\"patch_reads\":%lld,\"page_programs\":%lld,",
+		(long long)s->old_reads, (long long)s->patch_reads, (long long)s->page_programs);
+	printf("\"read_us\":%.0f,\"program_us\":%.0f,\"apply_us\":%.0f}\n",
+		s->read_us, s->program_us, s->apply_us);
+}
+
+int main(int argc,char *argv[])
+{
+	int fd, ch, json = 0;
+	uint8_t *patch;
+	off_t patch_size;
+	struct bsinspect_flash flash = BSINSPECT_FLASH_DEFAULT;
+	struct bsinspect stats;
+
+	while ((ch = getopt(argc, argv, "b:c:ejl:p:r:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			if ((flash.buf_size = atoi(optarg)) < 2)
+				errx(1, "invalid buffer size %s", optarg);
+			break;
+		case 'c':
+			if ((flash.patch_chunk = atoi(optarg)) < 0)
+				errx(1, "invalid patch chunk %s", optarg);
+			break;
+		case 'e':
+			flash.skip_erased = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'l':
+			flash.read_latency_us = atof(optarg);
+			break;
+		case 'p':
+			if ((flash.page_size = atoi(optarg)) < 1)
+				errx(1, "invalid page size %s", optarg);
+			break;
+		case 'r':
+			flash.read_mb_s = atof(optarg);
+			break;
+		case 't':
+			flash.page_program_us = atof(optarg);
+			break;
+		default:
+			errx(1, USAGE, argv[0]);
+		}
+	}
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc!=2) errx(1, USAGE, argv[0]);
+
+	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
+		((patch_size=lseek(fd,0,SEEK_END))==-1) ||
+		((patch=malloc(patch_size+1))==NULL) ||
+		(lseek(fd,0,SEEK_SET)!=0) ||
+		(read(fd,patch,patch_size)!=patch_size) ||
+		(close(fd)==-1)) err(1,"%s",argv[1]);
+
+	if (bsinspect(patch, patch_size, &flash, &stats))
+		errx(1, "%s: malformed patch", argv[1]);
+
+	if (json)
+		print_json(&stats, patch_size);
+	else
+		print_text(&stats, patch_size);
+
+	free(patch);
+
+	return 0;
+}
+
+#endif
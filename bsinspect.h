@@ -0,0 +1,66 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSINSPECT_H
+# define BSINSPECT_H
+
+# include <stdint.h>
+
+/* Seek distances are counted by the bit length of |Z|, from 0 for Z = 0 up */
+# define BSINSPECT_SEEK_BUCKETS 64
+
+/* Flash the patch is applied on, for the apply time projection */
+struct bsinspect_flash
+{
+	int buf_size;		/* BSPATCH_BUF_SIZE of the device build */
+	int patch_chunk;	/* bytes per read of the patch from flash, 0 if it is not in flash */
+	double read_latency_us;	/* fixed cost of one read */
+	double read_mb_s;	/* read throughput after the latency */
+	int page_size;		/* bytes per page program */
+	double page_program_us;	/* time to program one page */
+	int skip_erased;	/* non-zero if fills of 0xFF are not programmed, see bspatch_stream_n.fill */
+};
+
+/* SPI NOR flash on an ESP32, and the default BSPATCH_BUF_SIZE */
+# define BSINSPECT_FLASH_DEFAULT { .buf_size = 256, .patch_chunk = 4096, .read_latency_us = 10, \
+	.read_mb_s = 16, .page_size = 256, .page_program_us = 700, .skip_erased = 0 }
+
+struct bsinspect
+{
+	int64_t blocks;		/* control blocks, extended operations included */
+	int64_t empty_blocks;	/* blocks with X = Y = 0, which only seek */
+	int64_t op_blocks;	/* extended operations other than fills */
+	int64_t fill_blocks;
+	int64_t diff_bytes;
+	int64_t zero_diff_bytes;	/* diff bytes of 0, where new repeats old */
+	int64_t extra_bytes;
+	int64_t fill_bytes;
+	int64_t erased_fill_bytes;	/* fill bytes of 0xFF */
+	int64_t op_bytes;	/* data of the other extended operations */
+	int64_t new_size;
+	int64_t backward_seeks;
+	int64_t seeks[BSINSPECT_SEEK_BUCKETS];
+
+	/* Apply time projection */
+	int64_t old_reads;
+	int64_t patch_reads;
+	int64_t page_programs;
+	double read_us;
+	double program_us;
+	double apply_us;
+};
+
+/*
+ * Walks the control blocks of an in-memory patch and fills in stats, projecting the
+ * time bspatch() takes to apply it on flash. The projection follows the staged path
+ * on the device: one old read per BSPATCH_BUF_SIZE / 2 diff bytes, the patch read in
+ * patch_chunk pieces, and every output page programmed once. It leaves out the CPU
+ * time, which is small next to the flash, and erasing the new partition beforehand.
+ *
+ * Returns 0, or -1 if the patch is malformed or truncated
+ */
+int bsinspect(const uint8_t* patch, int64_t patch_size, const struct bsinspect_flash* flash,
+	struct bsinspect* stats);
+
+#endif
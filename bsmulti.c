@@ -0,0 +1,243 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "bsmulti.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct multi_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct bsmulti_base* bases;
+	int* order;		/* base indices, largest first */
+	int nbases;
+	int next;		/* next entry of order to start */
+	int running;
+	int64_t reserved;	/* memory of the bases running */
+	int64_t budget;
+	const uint8_t* new;
+	int64_t newsize;
+	const struct bsdiff_options* options;
+};
+
+int64_t bsmulti_memory(const struct bsmulti_base* base, int64_t newsize,
+	const struct bsdiff_options* options)
+{
+	return bsdiff_memory(base->oldsize, newsize, options);
+}
+
+static void* multi_worker(void* arg)
+{
+	struct multi_pool* pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->nbases) {
+		struct bsmulti_base* base = &pool->bases[pool->order[pool->next]];
+		const int64_t need = bsmulti_memory(base, pool->newsize, pool->options);
+
+		/* Wait for memory, unless nothing else is running to free any */
+		if (pool->budget > 0 && pool->running > 0 && pool->reserved + need > pool->budget) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		pool->next++;
+		pool->running++;
+		pool->reserved += need;
+		pthread_mutex_unlock(&pool->lock);
+
+		base->result = bsdiff_ex(base->old, base->oldsize, pool->new, pool->newsize,
+			base->stream, pool->options);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->running--;
+		pool->reserved -= need;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int bsdiff_multi(struct bsmulti_base* bases, int nbases, const uint8_t* new, int64_t newsize,
+	const struct bsdiff_options* options, int jobs, int64_t memory_budget)
+{
+	struct multi_pool pool;
+	pthread_t* threads;
+	int i, j, started, result = 0;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.bases = bases;
+	pool.nbases = nbases;
+	pool.budget = memory_budget;
+	pool.new = new;
+	pool.newsize = newsize;
+	pool.options = options;
+
+	if (jobs < 1) jobs = 1;
+	if (jobs > nbases) jobs = nbases;
+
+	if ((pool.order = malloc((nbases + 1) * sizeof(*pool.order))) == NULL)
+		return -1;
+	if ((threads = malloc((jobs + 1) * sizeof(*threads))) == NULL) {
+		free(pool.order);
+		return -1;
+	}
+
+	/* Largest first, so a big base does not start last and hold up the end */
+	for (i = 0; i < nbases; i++) {
+		bases[i].result = -1;
+		for (j = i; j > 0 && bases[pool.order[j-1]].oldsize < bases[i].oldsize; j--)
+			pool.order[j] = pool.order[j-1];
+		pool.order[j] = i;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	for (started = 0; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, multi_worker, &pool) != 0)
+			break;
+	/* With no thread at all, the bases are diffed on this one */
+	if (started == 0)
+		multi_worker(&pool);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.order);
+
+	for (i = 0; i < nbases; i++)
+		if (bases[i].result != 0)
+			result = -1;
+
+	return result;
+}
+
+#if defined(BSMULTI_EXECUTABLE)
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static int __write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	if (fwrite(buffer, size, 1, (FILE*)stream->opaque) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+static uint8_t* load(const char* name, off_t* size)
+{
+	uint8_t* buf;
+	int fd;
+
+	/* Allocate size+1 bytes instead of size bytes to ensure
+		that we never try to malloc(0) and get a NULL pointer */
+	if(((fd=open(name,O_RDONLY,0))<0) ||
+		((*size=lseek(fd,0,SEEK_END))==-1) ||
+		((buf=malloc(*size+1))==NULL) ||
+		(lseek(fd,0,SEEK_SET)!=0) ||
+		(read(fd,buf,*size)!=*size) ||
+		(close(fd)==-1)) err(1,"%s",name);
+
+	return buf;
+}
+
+#define USAGE "usage: %s [-f none|arm|thumb] [-o] [-r] [-s speed] [-j jobs] [-m budget_mb] newfile oldfile patchfile [oldfile patchfile ...]\n"
+
+int main(int argc,char *argv[])
+{
+	uint8_t *new;
+	off_t newsize, oldsize;
+	struct bsdiff_options options = { .filter = BSFILTER_NONE };
+	struct bsmulti_base* bases;
+	struct bsdiff_stream* streams;
+	int64_t budget = 0;
+	int jobs = 1;
+	int nbases, i;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "f:ors:j:m:")) != -1) {
+		switch (ch) {
+		case 'f':
+			if ((options.filter = bsfilter_from_name(optarg)) < 0)
+				errx(1, "unknown filter %s", optarg);
+			break;
+		case 'o':
+			options.optimal = 1;
+			break;
+		case 'r':
+			options.fill = 1;
+			break;
+		case 's':
+			options.speed = atoi(optarg);
+			if (options.speed < 0 || options.speed > BSDIFF_SPEED_MAX)
+				errx(1, "speed must be 0 to %d", BSDIFF_SPEED_MAX);
+			break;
+		case 'j':
+			if ((jobs = atoi(optarg)) < 1)
+				errx(1, "invalid job count %s", optarg);
+			break;
+		case 'm':
+			if ((budget = atoll(optarg)) < 0)
+				errx(1, "invalid memory budget %s", optarg);
+			budget *= 1024 * 1024;
+			break;
+		default:
+			errx(1,USAGE,argv[0]);
+		}
+	}
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc<4 || argc%2!=0) errx(1,USAGE,argv[0]);
+
+	new = load(argv[1], &newsize);
+
+	nbases = (argc - 2) / 2;
+	if(((bases=calloc(nbases,sizeof(*bases)))==NULL) ||
+		((streams=calloc(nbases,sizeof(*streams)))==NULL)) err(1,NULL);
+	for (i = 0; i < nbases; i++) {
+		bases[i].old = load(argv[2 + 2*i], &oldsize);
+		bases[i].oldsize = oldsize;
+		streams[i].malloc = malloc;
+		streams[i].free = free;
+		streams[i].write = __write;
+		if ((streams[i].opaque = fopen(argv[3 + 2*i], "w")) == NULL)
+			err(1, "%s", argv[3 + 2*i]);
+		bases[i].stream = &streams[i];
+	}
+
+	if (bsdiff_multi(bases, nbases, new, newsize, &options, jobs, budget) != 0) {
+		for (i = 0; i < nbases; i++)
+			if (bases[i].result != 0)
+				warnx("%s: bsdiff failed", argv[2 + 2*i]);
+		errx(1, "bsdiff_multi");
+	}
+
+	for (i = 0; i < nbases; i++) {
+		if (fclose(streams[i].opaque))
+			err(1, "%s", argv[3 + 2*i]);
+		free((void*)bases[i].old);
+	}
+
+	free(streams);
+	free(bases);
+	free(new);
+
+	return 0;
+}
+
+#endif
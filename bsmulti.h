@@ -0,0 +1,44 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSMULTI_H
+# define BSMULTI_H
+
+# include <stdint.h>
+
+# include "bsdiff.h"
+
+/* One deployed version to diff against the new image */
+struct bsmulti_base
+{
+	/* Set by the caller */
+	const uint8_t* old;
+	int64_t oldsize;
+	struct bsdiff_stream* stream;	/* receives the patch for this base */
+
+	/* Set by bsdiff_multi(): 0 on success, -1 on failure */
+	int result;
+};
+
+/* Work memory bsdiff needs for one base, the bsdiff_memory() of its sizes */
+int64_t bsmulti_memory(const struct bsmulti_base* base, int64_t newsize,
+	const struct bsdiff_options* options);
+
+/*
+ * Diffs each of nbases old images against new, emitting one patch per base. The
+ * bases are handed to a pool of jobs threads, largest first. A base only starts
+ * when its bsmulti_memory() fits in memory_budget next to the bases already running,
+ * so the suffix arrays do not all exist at once; a base that exceeds the budget on
+ * its own runs alone. A budget of 0 means no limit.
+ *
+ * The streams of different bases are used from different threads, as is the
+ * allocator of each stream.
+ *
+ * Returns 0 if every patch was written, -1 if any base failed (see result) or the
+ * threads could not be started
+ */
+int bsdiff_multi(struct bsmulti_base* bases, int nbases, const uint8_t* new, int64_t newsize,
+	const struct bsdiff_options* options, int jobs, int64_t memory_budget);
+
+#endif
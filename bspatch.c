@@ -43,22 +43,390 @@
 
 #define min(A, B) ((A) < (B) ? (A) : (B))
 
-static int64_t offtin(uint8_t *buf)
+/* An optional callback of stream, or NULL if the stream was not set up by its init function */
+#define STREAM_OPTIONAL(stream, member) \
+	((stream)->magic == BSPATCH_STREAM_MAGIC ? (stream)->member : NULL)
+
+/* Bound for control words and positions, so that adding three of them cannot overflow */
+#define OFFSET_MAX (INT64_MAX / 4)
+
+static int ctrl_decode(int64_t ctrl[3], const uint8_t *buf)
+{
+	ctrl[0]=bsformat_offtin(&buf[0]);
+	ctrl[1]=bsformat_offtin(&buf[8]);
+	ctrl[2]=bsformat_offtin(&buf[16]);
+
+	if (ctrl[0] == BSPATCH_OP_DIGEST) {
+		return ctrl[1] == BSPATCH_DIGEST_BLOCK_SIZE && ctrl[2] == 0 ?
+			BSPATCH_SUCCESS : BSPATCH_ERROR;
+	}
+	if (ctrl[0] == BSPATCH_OP_PRECHECK) {
+		return ctrl[1] >= 8 + BSPATCH_DIGEST_SIZE && ctrl[1] <= OFFSET_MAX &&
+			(ctrl[1] - 8 - BSPATCH_DIGEST_SIZE) % 16 == 0 && ctrl[2] == 0 ?
+			BSPATCH_SUCCESS : BSPATCH_ERROR;
+	}
+	if (ctrl[0] == BSPATCH_OP_FILL) {
+		return ctrl[1] > 0 && ctrl[1] <= OFFSET_MAX && ctrl[2] >= 0 && ctrl[2] <= 255 ?
+			BSPATCH_SUCCESS : BSPATCH_ERROR;
+	}
+	if (ctrl[0] == BSPATCH_OP_FILTER) {
+		return ctrl[1] == 0 && ctrl[2] > BSFILTER_NONE && ctrl[2] <= 255 ?
+			BSPATCH_SUCCESS : BSPATCH_ERROR;
+	}
+
+	/* Sanity-check */
+	if (ctrl[0]<0 || ctrl[0]>OFFSET_MAX || ctrl[1]<0 || ctrl[1]>OFFSET_MAX ||
+	    ctrl[2]<-OFFSET_MAX || ctrl[2]>OFFSET_MAX) {
+		BSPATCH_DEBUG("Failed sanity check: %ld %ld\n", ctrl[0], ctrl[1]);
+		return BSPATCH_ERROR;
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+int bspatch_block_decode(struct bspatch_block* blk, const uint8_t* ctrl)
+{
+	RETURN_IF_NEGATIVE(ctrl_decode(blk->ctrl, ctrl));
+
+	blk->op = 0;
+	blk->op_size = 0;
+	if (blk->ctrl[0] == BSPATCH_OP_FILL) {
+		blk->op = BSPATCH_OP_FILL;
+		blk->fill_byte = blk->ctrl[2];
+		blk->ctrl[0] = 0;
+		blk->ctrl[2] = 0;
+	} else if (blk->ctrl[0] < 0) {
+		blk->op = blk->ctrl[0];
+		blk->op_size = blk->ctrl[1];
+		if (blk->op == BSPATCH_OP_FILTER) {
+			blk->filter = blk->ctrl[2];
+		}
+		memset(blk->ctrl, 0, sizeof(blk->ctrl));
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+/* Patch bytes that follow the control words of blk */
+static int64_t block_data_size(const struct bspatch_block* blk)
+{
+	return blk->op ? blk->op_size : blk->ctrl[0] + blk->ctrl[1];
+}
+
+void bspatch_block_next(struct bspatch_block* blk)
+{
+	blk->patch_offset += BSPATCH_CTRL_SIZE + block_data_size(blk);
+	blk->new_offset += blk->ctrl[0] + blk->ctrl[1];
+	blk->old_offset += blk->ctrl[0] + blk->ctrl[2];
+}
+
+int bspatch_set_verify(struct bspatch_ctx* ctx, struct bspatch_verify* verify)
+{
+	bssha256_init(&verify->old_hash);
+	bssha256_init(&verify->new_hash);
+	ctx->verify = verify;
+	return BSPATCH_SUCCESS;
+}
+
+/* An all-zero old digest in a digest block was not recorded, see bsformat.h */
+static int old_digest_recorded(const uint8_t* digest)
+{
+	int i;
+
+	for (i = 0; i < BSPATCH_DIGEST_SIZE; i++) {
+		if (digest[i] != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Takes the digests of a digest block, unless the caller supplied them */
+static void take_digests(struct bspatch_verify* verify)
+{
+	if (!(verify->expect & BSPATCH_VERIFY_OLD) && old_digest_recorded(verify->block)) {
+		memcpy(verify->old_digest, verify->block, BSPATCH_DIGEST_SIZE);
+		verify->expect |= BSPATCH_VERIFY_OLD;
+	}
+	if (!(verify->expect & BSPATCH_VERIFY_NEW)) {
+		memcpy(verify->new_digest, verify->block + BSPATCH_DIGEST_SIZE, BSPATCH_DIGEST_SIZE);
+	}
+	verify->expect |= BSPATCH_VERIFY_NEW;
+}
+
+/* Hashes old bytes a diff block adds to, once they have been consumed */
+static void hash_old(struct bspatch_ctx* ctx, const uint8_t* buf, int length)
+{
+	if (ctx->verify != NULL) {
+		bssha256_update(&ctx->verify->old_hash, buf, length);
+	}
+}
+
+/* Hashes length copies of byte that a fill() callback has written */
+static void hash_fill(struct bspatch_ctx* ctx, uint8_t byte, int length)
+{
+	uint8_t buf[64];
+
+	if (ctx->verify != NULL) {
+		memset(buf, byte, sizeof(buf));
+		for (int done = 0; done < length; done += sizeof(buf)) {
+			bssha256_update(&ctx->verify->new_hash, buf, min(length - done, (int)sizeof(buf)));
+		}
+	}
+}
+
+/* Writes output, hashing it once write() has taken it */
+static int write_out(struct bspatch_ctx* ctx, struct bspatch_stream_n* new,
+		     const uint8_t* buf, int length)
+{
+	RETURN_IF_NEGATIVE(new->write(new, buf, length));
+	if (ctx->verify != NULL) {
+		bssha256_update(&ctx->verify->new_hash, buf, length);
+	}
+	return 0;
+}
+
+/*
+ * Checks the filter block, or that there is none when the first block that produces
+ * output comes. Either way it must match bspatch_set_filter().
+ */
+static int check_filter(struct bspatch_ctx* ctx)
+{
+	if (ctx->ctrl[0] == BSPATCH_OP_FILTER) {
+		if (ctx->filter_checked || ctx->ctrl[2] != ctx->filter) {
+			BSPATCH_DEBUG("Filter mismatch\n");
+			return BSPATCH_FILTER_MISMATCH;
+		}
+		ctx->filter_checked = 1;
+	} else if ((ctx->ctrl[0] >= 0 || ctx->ctrl[0] == BSPATCH_OP_FILL) && !ctx->filter_checked) {
+		if (ctx->filter != BSFILTER_NONE) {
+			BSPATCH_DEBUG("Filter mismatch\n");
+			return BSPATCH_FILTER_MISMATCH;
+		}
+		ctx->filter_checked = 1;
+	}
+	return BSPATCH_SUCCESS;
+}
+
+int bspatch_set_filter(struct bspatch_ctx* ctx, int filter, int64_t oldsize)
+{
+	if (filter != BSFILTER_NONE && filter != BSFILTER_ARM && filter != BSFILTER_ARMTHUMB) {
+		return BSPATCH_ERROR;
+	}
+
+	ctx->filter = filter;
+	ctx->filter_oldsize = oldsize;
+	return BSPATCH_SUCCESS;
+}
+
+void bspatch_stream_i_init(struct bspatch_stream_i* stream)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->magic = BSPATCH_STREAM_MAGIC;
+}
+
+void bspatch_stream_n_init(struct bspatch_stream_n* stream)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->magic = BSPATCH_STREAM_MAGIC;
+}
+
+/* Reads through read64() if the stream has it, positions past INT_MAX need it */
+static int read_at(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length)
 {
-	int64_t y;
+	if (STREAM_OPTIONAL(stream, read64) != NULL) {
+		return stream->read64(stream, buffer, pos, length);
+	}
+	if (pos < INT_MIN || pos > INT_MAX) {
+		BSPATCH_DEBUG("Old position %ld needs read64\n", pos);
+		return BSPATCH_ERROR;
+	}
+	return stream->read(stream, buffer, (int)pos, length);
+}
+
+/* Reads old bytes, applying the branch filter the patch was made against */
+static int read_old(struct bspatch_ctx* ctx, struct bspatch_stream_i* old,
+		    uint8_t* buf, int64_t pos, int length)
+{
+	RETURN_IF_NEGATIVE(read_at(old, buf, pos, length));
+	if (ctx->filter == BSFILTER_NONE) {
+		return 0;
+	}
+
+	/* Candidates that cross either end of buf are filtered from a fresh copy. Only
+	 * copy back the ones the filter changed, as candidates that do not match can
+	 * overlap one that does */
+	const int align = bsfilter_align(ctx->filter);
+	const int64_t end = pos + length;
+	int64_t s = pos - (BSFILTER_INSN_SIZE - 1);
+	uint8_t insn[BSFILTER_INSN_SIZE];
+	uint8_t raw[BSFILTER_INSN_SIZE];
+
+	s = s < 0 ? 0 : (s + align - 1) / align * align;
+	for (; s < end; s += align) {
+		if ((s >= pos && s + BSFILTER_INSN_SIZE <= end) ||
+		    s + BSFILTER_INSN_SIZE > ctx->filter_oldsize) {
+			continue;
+		}
+		RETURN_IF_NEGATIVE(read_at(old, insn, s, BSFILTER_INSN_SIZE));
+		memcpy(raw, insn, sizeof(raw));
+		bsfilter_code(ctx->filter, insn, BSFILTER_INSN_SIZE, s, 1);
+		if (memcmp(raw, insn, sizeof(raw)) == 0) {
+			continue;
+		}
+
+		const int64_t from = s < pos ? pos : s;
+		const int64_t to = s + BSFILTER_INSN_SIZE > end ? end : s + BSFILTER_INSN_SIZE;
+		memcpy(buf + (from - pos), insn + (from - s), to - from);
+	}
 
-	y=buf[7]&0x7F;
-	y=y*256;y+=buf[6];
-	y=y*256;y+=buf[5];
-	y=y*256;y+=buf[4];
-	y=y*256;y+=buf[3];
-	y=y*256;y+=buf[2];
-	y=y*256;y+=buf[1];
-	y=y*256;y+=buf[0];
+	bsfilter_code(ctx->filter, buf, length, pos, 1);
 
-	if(buf[7]&0x80) y=-y;
+	return 0;
+}
 
-	return y;
+static void queue_out(struct bspatch_ctx* ctx, const uint8_t* buf, int length)
+{
+	if (length > 0) {
+		assert(ctx->out_count < BSPATCH_OUT_QUEUE);
+		ctx->out_buf[ctx->out_count] = buf;
+		ctx->out_len[ctx->out_count] = length;
+		ctx->out_count++;
+	}
+}
+
+/*
+ * Hands queued output to new->write(), in order. If write() would block, the
+ * remaining output stays queued for the next call.
+ */
+static int flush_out(struct bspatch_ctx* ctx, struct bspatch_stream_n* new)
+{
+	while (ctx->out_count > 0) {
+		RETURN_IF_NEGATIVE(write_out(ctx, new, ctx->out_buf[0], ctx->out_len[0]));
+		ctx->out_count--;
+		memmove(&ctx->out_buf[0], &ctx->out_buf[1], ctx->out_count * sizeof(ctx->out_buf[0]));
+		memmove(&ctx->out_len[0], &ctx->out_len[1], ctx->out_count * sizeof(ctx->out_len[0]));
+	}
+
+	return 0;
+}
+
+/*
+ * Writes new bytes, undoing the branch filter. buf is modified in place and must
+ * stay valid until the output is flushed. Bytes from the first candidate that is
+ * not complete yet are held back in ctx->filter_tail.
+ */
+static int write_new(struct bspatch_ctx* ctx, struct bspatch_stream_n* new,
+		     uint8_t* buf, int length)
+{
+	if (ctx->filter == BSFILTER_NONE) {
+		queue_out(ctx, buf, length);
+		return flush_out(ctx, new);
+	}
+
+	const int align = bsfilter_align(ctx->filter);
+	const int tail_len = ctx->filter_tail_len;
+	const int64_t start = ctx->newpos - tail_len;
+	const int64_t end = ctx->newpos + length;
+	uint8_t insn[BSFILTER_INSN_SIZE];
+	int64_t s;
+
+	/* Candidates that start in the held back bytes and are now complete */
+	for (s = start; s < ctx->newpos; s += align) {
+		if (s + BSFILTER_INSN_SIZE <= ctx->newpos) {
+			continue;	/* completed and unfiltered by an earlier call */
+		}
+		if (s + BSFILTER_INSN_SIZE > end) {
+			break;
+		}
+		const int held = ctx->newpos - s;
+		memcpy(insn, ctx->filter_tail + (s - start), held);
+		memcpy(insn + held, buf, BSFILTER_INSN_SIZE - held);
+		bsfilter_code(ctx->filter, insn, BSFILTER_INSN_SIZE, s, 0);
+		memcpy(ctx->filter_tail + (s - start), insn, held);
+		memcpy(buf, insn + held, BSFILTER_INSN_SIZE - held);
+	}
+
+	/* Candidates entirely within buf */
+	bsfilter_code(ctx->filter, buf, length, ctx->newpos, 0);
+
+	/* Everything before the first incomplete candidate is final */
+	int64_t hold = end - (BSFILTER_INSN_SIZE - 1);
+	hold = hold < start ? start : (hold + align - 1) / align * align;
+	hold = hold > end ? end : hold;
+
+	if (hold > start) {
+		const int from_tail = min(hold, ctx->newpos) - start;
+		if (from_tail > 0) {
+			memcpy(ctx->filter_out, ctx->filter_tail, from_tail);
+			queue_out(ctx, ctx->filter_out, from_tail);
+		}
+		if (hold > ctx->newpos) {
+			queue_out(ctx, buf, hold - ctx->newpos);
+		}
+	}
+
+	/* Keep [hold, end) for the next call */
+	int n = 0;
+	for (s = hold; s < end; s++) {
+		insn[n++] = s < ctx->newpos ? ctx->filter_tail[s - start] : buf[s - ctx->newpos];
+	}
+	memcpy(ctx->filter_tail, insn, n);
+	ctx->filter_tail_len = n;
+	ctx->newpos = end;
+
+	return flush_out(ctx, new);
+}
+
+int bspatch_finish(struct bspatch_ctx* ctx, struct bspatch_stream_n* new)
+{
+	int complete;
+
+	RETURN_IF_NEGATIVE(flush_out(ctx, new));
+
+	switch (ctx->state) {
+		case BSPATCH_STATE_RD_CTRL:
+			complete = ctx->buf_offset == 0 ||
+				(ctx->buf_offset == BSPATCH_CTRL_SIZE &&
+				 ctrl_decode(ctx->ctrl, ctx->buf) == BSPATCH_SUCCESS &&
+				 ctx->ctrl[0] == 0 && ctx->ctrl[1] == 0);
+			break;
+		case BSPATCH_STATE_RD_DIFF:
+			complete = ctx->diff_offset == ctx->ctrl[0] && ctx->ctrl[1] == 0;
+			break;
+		case BSPATCH_STATE_RD_EXTRA:
+		case BSPATCH_STATE_RD_OP:
+		case BSPATCH_STATE_RD_FILL:
+			complete = ctx->extra_offset == ctx->ctrl[1];
+			break;
+		default:
+			complete = 1;
+			break;
+	}
+	if (!complete) {
+		BSPATCH_DEBUG("Patch ends in the middle of a block\n");
+		return BSPATCH_ERROR;
+	}
+
+	/* Incomplete candidates at the end of the image were never filtered */
+	queue_out(ctx, ctx->filter_tail, ctx->filter_tail_len);
+	ctx->filter_tail_len = 0;
+	RETURN_IF_NEGATIVE(flush_out(ctx, new));
+
+	if (ctx->verify != NULL) {
+		struct bspatch_verify* verify = ctx->verify;
+		bssha256_final(&verify->old_hash, verify->old_computed);
+		bssha256_final(&verify->new_hash, verify->new_computed);
+		if (((verify->expect & BSPATCH_VERIFY_OLD) &&
+		     memcmp(verify->old_digest, verify->old_computed, BSPATCH_DIGEST_SIZE) != 0) ||
+		    ((verify->expect & BSPATCH_VERIFY_NEW) &&
+		     memcmp(verify->new_digest, verify->new_computed, BSPATCH_DIGEST_SIZE) != 0)) {
+			BSPATCH_DEBUG("Digest mismatch\n");
+			return BSPATCH_DIGEST_MISMATCH;
+		}
+	}
+
+	return BSPATCH_SUCCESS;
 }
 
 int bspatch(struct bspatch_ctx* ctx,
@@ -69,19 +437,26 @@ int bspatch(struct bspatch_ctx* ctx,
 {
 	const int64_t half_len = BSPATCH_BUF_SIZE / 2;
 
-	int patch_remaining = patch_size;
-	while (patch_remaining > 0) {
+	/* Output left over from a call that would have blocked goes first */
+	ctx->consumed = 0;
+	RETURN_IF_NEGATIVE(flush_out(ctx, new));
+
+	/* A fill block consumes no patch bytes past its control words */
+	while (ctx->consumed < patch_size || ctx->state == BSPATCH_STATE_RD_FILL ||
+	       (ctx->state == BSPATCH_STATE_RD_CTRL && ctx->buf_offset == BSPATCH_CTRL_SIZE)) {
+		const int patch_offset = ctx->consumed;
+		const int patch_remaining = patch_size - ctx->consumed;
 		BSPATCH_DEBUG("patch remaining: %d\n", patch_remaining);
-		int patch_offset = patch_size - patch_remaining;
 
 		switch (ctx->state) {
 			case BSPATCH_STATE_RESET:
 			{
-				/* Reset everything except oldpos, which needs to persist across
-				 * control blocks */
-				int oldpos = ctx->oldpos;
-				memset(ctx, 0, sizeof(*ctx));
-				ctx->oldpos = oldpos;
+				/* Reset the per-block state. oldpos and the filter stage need to
+				 * persist across control blocks */
+				memset(ctx->ctrl, 0, sizeof(ctx->ctrl));
+				ctx->buf_offset = 0;
+				ctx->diff_offset = 0;
+				ctx->extra_offset = 0;
 				ctx->state = BSPATCH_STATE_RD_CTRL;
 				break;
 			}
@@ -100,21 +475,27 @@ int bspatch(struct bspatch_ctx* ctx,
 				 *    2. Read Y bytes from patch and write them to new.
 				 *    3. Seek forward Z bytes in old (might be negative).
 				 */
-				int ctrl_remaining = 24 - ctx->buf_offset;
+				int ctrl_remaining = BSPATCH_CTRL_SIZE - ctx->buf_offset;
 				assert(ctrl_remaining >= 0);
 				if (ctrl_remaining == 0) {
-					ctx->ctrl[0]=offtin(&ctx->buf[0]);
-					ctx->ctrl[1]=offtin(&ctx->buf[8]);
-					ctx->ctrl[2]=offtin(&ctx->buf[16]);
-
-					/* Sanity-check */
-					if (ctx->ctrl[0]<0 || ctx->ctrl[0]>INT_MAX || ctx->ctrl[1]<0 || ctx->ctrl[1]>INT_MAX) {
-						BSPATCH_DEBUG("Failed sanity check: %ld %ld\n", ctx->ctrl[0], ctx->ctrl[1]);
+					if (ctrl_decode(ctx->ctrl, ctx->buf) != BSPATCH_SUCCESS) {
 						return BSPATCH_ERROR;
 					}
 					BSPATCH_DEBUG("ctrl[0] = %ld\n", ctx->ctrl[0]);
 					BSPATCH_DEBUG("ctrl[1] = %ld\n", ctx->ctrl[1]);
 					BSPATCH_DEBUG("ctrl[2] = %ld\n", ctx->ctrl[2]);
+					RETURN_IF_NEGATIVE(check_filter(ctx));
+
+					if (ctx->ctrl[0] == BSPATCH_OP_FILL) {
+						BSPATCH_DEBUG("New state: BSPATCH_STATE_RD_FILL\n");
+						ctx->state = BSPATCH_STATE_RD_FILL;
+						break;
+					}
+					if (ctx->ctrl[0] < 0) {
+						BSPATCH_DEBUG("New state: BSPATCH_STATE_RD_OP\n");
+						ctx->state = BSPATCH_STATE_RD_OP;
+						break;
+					}
 
 					/* Go to next state */
 					BSPATCH_DEBUG("New state: BSPATCH_STATE_RD_DIFF\n");
@@ -122,19 +503,19 @@ int bspatch(struct bspatch_ctx* ctx,
 					break;
 				}
 
-				int ctrl_to_read = min(24, ctrl_remaining);
+				int ctrl_to_read = min(BSPATCH_CTRL_SIZE, ctrl_remaining);
 				ctrl_to_read = min(ctrl_to_read, patch_remaining);
 				BSPATCH_DEBUG("ctrl read %d\n", ctrl_to_read);
 				memcpy(ctx->buf + ctx->buf_offset, patch + patch_offset, ctrl_to_read);
 				ctx->buf_offset += ctrl_to_read;
-				patch_remaining -= ctrl_to_read;
+				ctx->consumed += ctrl_to_read;
 
 				break;
 			}
 
 			case BSPATCH_STATE_RD_DIFF:
 			{
-				int diff_remaining = ctx->ctrl[0] - ctx->diff_offset;
+				const int64_t diff_remaining = ctx->ctrl[0] - ctx->diff_offset;
 				assert(diff_remaining >= 0);
 				if (diff_remaining == 0) {
 					/* Adjust pointers */
@@ -145,45 +526,157 @@ int bspatch(struct bspatch_ctx* ctx,
 					break;
 				}
 
+				if (STREAM_OPTIONAL(new, acquire) != NULL && ctx->filter == BSFILTER_NONE &&
+				    patch_remaining >= BSPATCH_BULK_MIN) {
+					/* Add old data straight into the caller's output memory */
+					uint8_t* span;
+					int diff_towrite = min(diff_remaining, patch_remaining);
+					diff_towrite = new->acquire(new, (void**)&span, diff_towrite);
+					RETURN_IF_NEGATIVE(diff_towrite);
+					if (diff_towrite == 0) {
+						return BSPATCH_ERROR;
+					}
+					BSPATCH_DEBUG("diff bulk %d\n", diff_towrite);
+					RETURN_IF_NEGATIVE(read_at(old, span, ctx->oldpos + ctx->diff_offset, diff_towrite));
+					hash_old(ctx, span, diff_towrite);
+					for(int k=0;k<diff_towrite;k++) {
+						span[k] += patch[patch_offset + k];
+					}
+					ctx->diff_offset += diff_towrite;
+					ctx->consumed += diff_towrite;
+					queue_out(ctx, span, diff_towrite);
+					RETURN_IF_NEGATIVE(flush_out(ctx, new));
+					break;
+				}
+
 				/* Read diff string and add old data on the fly */
 				int diff_towrite = min(diff_remaining, half_len);
 				diff_towrite = min(diff_towrite, patch_remaining);
 				BSPATCH_DEBUG("diff read %d\n", diff_towrite);
 				memcpy(&ctx->buf[half_len], patch + patch_offset, diff_towrite);
-				RETURN_IF_NEGATIVE(old->read(old, ctx->buf, ctx->oldpos + ctx->diff_offset, diff_towrite));
+				RETURN_IF_NEGATIVE(read_old(ctx, old, ctx->buf, ctx->oldpos + ctx->diff_offset, diff_towrite));
+				hash_old(ctx, ctx->buf, diff_towrite);
 				ctx->diff_offset += diff_towrite;
-				patch_remaining -= diff_towrite;
+				ctx->consumed += diff_towrite;
 
 				for(int k=0;k<diff_towrite;k++) {
 					ctx->buf[k + half_len] += ctx->buf[k];
 				}
 
 				BSPATCH_DEBUG("diff write %d\n", diff_towrite);
-				RETURN_IF_NEGATIVE(new->write(new, &ctx->buf[half_len], diff_towrite));
+				RETURN_IF_NEGATIVE(write_new(ctx, new, &ctx->buf[half_len], diff_towrite));
 				break;
 			}
 
 			case BSPATCH_STATE_RD_EXTRA:
 			{
-				int extra_remaining = ctx->ctrl[1] - ctx->extra_offset;
+				const int64_t extra_remaining = ctx->ctrl[1] - ctx->extra_offset;
 				assert(extra_remaining >= 0);
 				if (extra_remaining == 0) {
 					/* Adjust pointers */
 					ctx->oldpos+=ctx->ctrl[2];
+					if (ctx->oldpos < -OFFSET_MAX || ctx->oldpos > OFFSET_MAX) {
+						BSPATCH_DEBUG("Old position out of range\n");
+						return BSPATCH_ERROR;
+					}
 					/* Go to next state */
 					BSPATCH_DEBUG("New state: BSPATCH_STATE_RESET\n");
 					ctx->state = BSPATCH_STATE_RESET;
 					break;
 				}
 
+				if (ctx->filter == BSFILTER_NONE && patch_remaining >= BSPATCH_BULK_MIN) {
+					/* Write extra string without staging it. The patch bytes are
+					 * only consumed once write() has taken them */
+					int extra_towrite = min(extra_remaining, patch_remaining);
+					BSPATCH_DEBUG("extra bulk %d\n", extra_towrite);
+					RETURN_IF_NEGATIVE(write_out(ctx, new, patch + patch_offset, extra_towrite));
+					ctx->extra_offset += extra_towrite;
+					ctx->consumed += extra_towrite;
+					break;
+				}
+
 				/* Read extra string and copy over to new on the fly*/
 				int extra_towrite = min(extra_remaining, BSPATCH_BUF_SIZE);
 				extra_towrite = min(extra_towrite, patch_remaining);
 				BSPATCH_DEBUG("extra read %d\n", extra_towrite);
 				memcpy(ctx->buf, patch + patch_offset, extra_towrite);
-				RETURN_IF_NEGATIVE(new->write(new, ctx->buf, extra_towrite));
 				ctx->extra_offset += extra_towrite;
-				patch_remaining -= extra_towrite;
+				ctx->consumed += extra_towrite;
+				RETURN_IF_NEGATIVE(write_new(ctx, new, ctx->buf, extra_towrite));
+				break;
+			}
+
+			case BSPATCH_STATE_RD_OP:
+			{
+				const int64_t op_remaining = ctx->ctrl[1] - ctx->extra_offset;
+				assert(op_remaining >= 0);
+				if (op_remaining == 0) {
+					BSPATCH_DEBUG("New state: BSPATCH_STATE_RESET\n");
+					ctx->state = BSPATCH_STATE_RESET;
+					break;
+				}
+
+				/* Digests are kept for bspatch_set_verify(), anything else is skipped */
+				const int op_toread = min(op_remaining, patch_remaining);
+				const int digest = ctx->ctrl[0] == BSPATCH_OP_DIGEST && ctx->verify != NULL;
+				if (digest) {
+					memcpy(ctx->verify->block + ctx->extra_offset, patch + patch_offset, op_toread);
+				}
+				ctx->extra_offset += op_toread;
+				ctx->consumed += op_toread;
+				if (digest && ctx->extra_offset == ctx->ctrl[1]) {
+					take_digests(ctx->verify);
+				}
+				break;
+			}
+
+			case BSPATCH_STATE_RD_FILL:
+			{
+				const int64_t fill_remaining = ctx->ctrl[1] - ctx->extra_offset;
+				const uint8_t byte = ctx->ctrl[2];
+				assert(fill_remaining >= 0);
+				if (fill_remaining == 0) {
+					BSPATCH_DEBUG("New state: BSPATCH_STATE_RESET\n");
+					ctx->state = BSPATCH_STATE_RESET;
+					break;
+				}
+
+				int fill_towrite = min(fill_remaining, INT_MAX);
+				if (STREAM_OPTIONAL(new, fill) != NULL && ctx->filter == BSFILTER_NONE) {
+					/* The writer may know better than to write the bytes at all */
+					fill_towrite = new->fill(new, byte, fill_towrite);
+					RETURN_IF_NEGATIVE(fill_towrite);
+					if (fill_towrite == 0) {
+						return BSPATCH_ERROR;
+					}
+					BSPATCH_DEBUG("fill %d of %02x\n", fill_towrite, byte);
+					hash_fill(ctx, byte, fill_towrite);
+					ctx->extra_offset += fill_towrite;
+					break;
+				}
+
+				if (STREAM_OPTIONAL(new, acquire) != NULL && ctx->filter == BSFILTER_NONE) {
+					/* Fill the caller's output memory in place */
+					uint8_t* span;
+					fill_towrite = new->acquire(new, (void**)&span, fill_towrite);
+					RETURN_IF_NEGATIVE(fill_towrite);
+					if (fill_towrite == 0) {
+						return BSPATCH_ERROR;
+					}
+					BSPATCH_DEBUG("fill bulk %d of %02x\n", fill_towrite, byte);
+					memset(span, byte, fill_towrite);
+					ctx->extra_offset += fill_towrite;
+					queue_out(ctx, span, fill_towrite);
+					RETURN_IF_NEGATIVE(flush_out(ctx, new));
+					break;
+				}
+
+				fill_towrite = min(fill_towrite, BSPATCH_BUF_SIZE);
+				BSPATCH_DEBUG("fill %d of %02x\n", fill_towrite, byte);
+				memset(ctx->buf, byte, fill_towrite);
+				ctx->extra_offset += fill_towrite;
+				RETURN_IF_NEGATIVE(write_new(ctx, new, ctx->buf, fill_towrite));
 				break;
 			}
 
@@ -195,6 +688,383 @@ int bspatch(struct bspatch_ctx* ctx,
 	return BSPATCH_SUCCESS;
 }
 
+int bspatch_precheck(const uint8_t* patch, int64_t patch_size, const struct bspatch_stream_i* old)
+{
+	struct bspatch_block blk;
+	struct bssha256 sha;
+	uint8_t buf[256], digest[BSPATCH_DIGEST_SIZE];
+	int64_t count, i;
+
+	memset(&blk, 0, sizeof(blk));
+	if (patch_size < BSPATCH_CTRL_SIZE ||
+	    bspatch_block_decode(&blk, patch) != BSPATCH_SUCCESS ||
+	    blk.op != BSPATCH_OP_PRECHECK || patch_size < BSPATCH_CTRL_SIZE + blk.op_size) {
+		BSPATCH_DEBUG("No precheck block\n");
+		return BSPATCH_ERROR;
+	}
+
+	patch += BSPATCH_CTRL_SIZE;
+	count = bsformat_offtin(patch);
+	if (count != (blk.op_size - 8 - BSPATCH_DIGEST_SIZE) / 16) {
+		return BSPATCH_ERROR;
+	}
+
+	bssha256_init(&sha);
+	for (i = 0; i < count; i++) {
+		int64_t pos = bsformat_offtin(patch + 8 + 16 * i);
+		int64_t length = bsformat_offtin(patch + 16 + 16 * i);
+		if (pos < 0 || length < 0 || pos > OFFSET_MAX || length > OFFSET_MAX) {
+			return BSPATCH_ERROR;
+		}
+		while (length > 0) {
+			const int n = min(length, (int64_t)sizeof(buf));
+			RETURN_IF_NEGATIVE(read_at(old, buf, pos, n));
+			bssha256_update(&sha, buf, n);
+			pos += n;
+			length -= n;
+		}
+	}
+	bssha256_final(&sha, digest);
+
+	if (memcmp(digest, patch + 8 + 16 * count, BSPATCH_DIGEST_SIZE) != 0) {
+		BSPATCH_DEBUG("Precheck digest mismatch\n");
+		return BSPATCH_DIGEST_MISMATCH;
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+int64_t bspatch_index(const uint8_t* patch, int64_t patch_size,
+		      struct bspatch_block* blocks, int64_t max_blocks)
+{
+	struct bspatch_block blk;
+	int64_t count = 0;
+
+	memset(&blk, 0, sizeof(blk));
+	while (blk.patch_offset < patch_size) {
+		if (blk.patch_offset + BSPATCH_CTRL_SIZE > patch_size ||
+		    bspatch_block_decode(&blk, patch + blk.patch_offset) != BSPATCH_SUCCESS ||
+		    blk.patch_offset + BSPATCH_CTRL_SIZE + block_data_size(&blk) > patch_size) {
+			BSPATCH_DEBUG("Malformed block at %ld\n", blk.patch_offset);
+			return BSPATCH_ERROR;
+		}
+
+		if (blk.ctrl[0] + blk.ctrl[1] > 0) {
+			if (blocks != NULL && count < max_blocks) {
+				blocks[count] = blk;
+			}
+			count++;
+		}
+
+		bspatch_block_next(&blk);
+	}
+
+	return count;
+}
+
+int bspatch_patch_filter(const uint8_t* patch, int64_t patch_size)
+{
+	struct bspatch_block blk;
+
+	memset(&blk, 0, sizeof(blk));
+	while (blk.patch_offset < patch_size) {
+		if (blk.patch_offset + BSPATCH_CTRL_SIZE > patch_size ||
+		    bspatch_block_decode(&blk, patch + blk.patch_offset) != BSPATCH_SUCCESS) {
+			return BSPATCH_ERROR;
+		}
+		if (blk.op == BSPATCH_OP_FILTER) {
+			return blk.filter;
+		}
+		if (blk.op == 0 || blk.op == BSPATCH_OP_FILL) {
+			break;
+		}
+		bspatch_block_next(&blk);
+	}
+
+	return BSFILTER_NONE;
+}
+
+/* Keeps blk as a checkpoint if it falls on the stride, thinning them out when full */
+static void chain_checkpoint(struct bspatch_chain_stage* stage)
+{
+	int i;
+
+	if (stage->blk_index % stage->stride != 0 ||
+	    stage->blk_index / stage->stride != stage->ncheckpoints) {
+		return;
+	}
+	if (stage->ncheckpoints == BSPATCH_CHAIN_CHECKPOINTS) {
+		/* Keep every other one and double the stride */
+		for (i = 0; 2 * i < stage->ncheckpoints; i++) {
+			stage->checkpoints[i] = stage->checkpoints[2 * i];
+		}
+		stage->ncheckpoints = i;
+		stage->stride *= 2;
+		if (stage->blk_index % stage->stride != 0) {
+			return;
+		}
+	}
+	stage->checkpoints[stage->ncheckpoints].patch_offset = stage->blk.patch_offset;
+	stage->checkpoints[stage->ncheckpoints].old_offset = stage->blk.old_offset;
+	stage->checkpoints[stage->ncheckpoints].new_offset = stage->blk.new_offset;
+	stage->ncheckpoints++;
+}
+
+/* Reads the control words of the block at next->patch_offset into next */
+static int chain_load(struct bspatch_chain_stage* stage, struct bspatch_block* next)
+{
+	uint8_t ctrl[BSPATCH_CTRL_SIZE];
+
+	if (next->patch_offset + BSPATCH_CTRL_SIZE > stage->patch_size) {
+		BSPATCH_DEBUG("chain read past end of stage output\n");
+		return BSPATCH_ERROR;
+	}
+	RETURN_IF_NEGATIVE(read_at(&stage->patch, ctrl, next->patch_offset, BSPATCH_CTRL_SIZE));
+	RETURN_IF_NEGATIVE(bspatch_block_decode(next, ctrl));
+	if (next->op == BSPATCH_OP_FILTER) {
+		/* Stage output is read unfiltered */
+		BSPATCH_DEBUG("chain stage patch is filtered\n");
+		return BSPATCH_FILTER_MISMATCH;
+	}
+	return BSPATCH_SUCCESS;
+}
+
+/* Load the control block that produces new byte pos, walking forward from the current one */
+static int chain_seek(struct bspatch_chain_stage* stage, int64_t pos)
+{
+	struct bspatch_block* blk = &stage->blk;
+	struct bspatch_block next;
+	int i;
+
+	if (blk->patch_offset < 0 || pos < blk->new_offset ||
+	    pos >= blk->new_offset + blk->ctrl[0] + blk->ctrl[1]) {
+		/* Blocks only link forward, so start from the last checkpoint before pos
+		 * when going back, or when it saves walking forward */
+		for (i = stage->ncheckpoints - 1; i >= 0 && stage->checkpoints[i].new_offset > pos; i--)
+			;
+		if (i >= 0 && (pos < blk->new_offset || (int64_t)i * stage->stride > stage->blk_index)) {
+			memset(&next, 0, sizeof(next));
+			next.patch_offset = stage->checkpoints[i].patch_offset;
+			next.old_offset = stage->checkpoints[i].old_offset;
+			next.new_offset = stage->checkpoints[i].new_offset;
+			RETURN_IF_NEGATIVE(chain_load(stage, &next));
+			*blk = next;
+			stage->blk_index = (int64_t)i * stage->stride;
+		} else if (i < 0 && (pos < blk->new_offset || blk->patch_offset < 0)) {
+			memset(blk, 0, sizeof(*blk));
+			blk->patch_offset = -1;
+			stage->blk_index = -1;
+		}
+	}
+
+	while (blk->patch_offset < 0 || pos >= blk->new_offset + blk->ctrl[0] + blk->ctrl[1]) {
+		/* Only move on once the next block has been read, so a read that would
+		 * block can simply be retried */
+		next = *blk;
+		if (next.patch_offset < 0) {
+			next.patch_offset = 0;
+		} else {
+			bspatch_block_next(&next);
+		}
+		RETURN_IF_NEGATIVE(chain_load(stage, &next));
+		*blk = next;
+		stage->blk_index++;
+		chain_checkpoint(stage);
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+static int chain_read64(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length)
+{
+	struct bspatch_chain_stage* stage = (struct bspatch_chain_stage*)stream->opaque;
+	uint8_t* out = buffer;
+	uint8_t diff[64];
+
+	while (length > 0) {
+		RETURN_IF_NEGATIVE(chain_seek(stage, pos));
+
+		const struct bspatch_block* blk = &stage->blk;
+		const int64_t rel = pos - blk->new_offset;
+		const int64_t data_offset = blk->patch_offset + BSPATCH_CTRL_SIZE + rel;
+		int n;
+
+		if (rel < blk->ctrl[0]) {
+			/* Diff bytes: resolve against the previous stage, then add */
+			n = min(length, blk->ctrl[0] - rel);
+			RETURN_IF_NEGATIVE(read_at(stage->old, out, blk->old_offset + rel, n));
+			for (int done = 0; done < n; done += sizeof(diff)) {
+				int step = min(n - done, (int)sizeof(diff));
+				RETURN_IF_NEGATIVE(read_at(&stage->patch, diff, data_offset + done, step));
+				for(int k=0;k<step;k++) {
+					out[done + k] += diff[k];
+				}
+			}
+		} else if (blk->op == BSPATCH_OP_FILL) {
+			n = min(length, blk->ctrl[1] - rel);
+			memset(out, blk->fill_byte, n);
+		} else {
+			/* Extra bytes come straight from the patch */
+			n = min(length, blk->ctrl[0] + blk->ctrl[1] - rel);
+			RETURN_IF_NEGATIVE(read_at(&stage->patch, out, data_offset, n));
+		}
+
+		out += n;
+		pos += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+static int chain_read(const struct bspatch_stream_i* stream, void* buffer, int pos, int length)
+{
+	return chain_read64(stream, buffer, pos, length);
+}
+
+int bspatch_chain_init(struct bspatch_chain_stage* stages, int nstages,
+		       const struct bspatch_stream_i* old)
+{
+	for (int i = 0; i < nstages; i++) {
+		if (stages[i].patch.read == NULL && STREAM_OPTIONAL(&stages[i].patch, read64) == NULL) {
+			return BSPATCH_ERROR;
+		}
+		stages[i].old = i == 0 ? old : &stages[i - 1].output;
+		bspatch_stream_i_init(&stages[i].output);
+		stages[i].output.opaque = &stages[i];
+		stages[i].output.read = chain_read;
+		stages[i].output.read64 = chain_read64;
+		memset(&stages[i].blk, 0, sizeof(stages[i].blk));
+		stages[i].blk.patch_offset = -1;
+		stages[i].blk_index = -1;
+		stages[i].ncheckpoints = 0;
+		stages[i].stride = 1;
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+/*
+ * The pipeline counters are plain ints in bspatch.h, which has to build as C++ too,
+ * and are only touched through the compiler's atomic builtins
+ */
+static int atomic_load_int(int* p)
+{
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void atomic_add_int(int* p, int n)
+{
+	__atomic_fetch_add(p, n, __ATOMIC_SEQ_CST);
+}
+
+/* Waits until the buffer at head is no longer in flight */
+static int pipeline_ready(struct bspatch_pipeline* pipe)
+{
+	while (atomic_load_int(&pipe->in_flight) == pipe->nbuffers) {
+		RETURN_IF_NEGATIVE(pipe->wait(pipe));
+	}
+
+	return atomic_load_int(&pipe->error);
+}
+
+static int pipeline_submit(struct bspatch_pipeline* pipe)
+{
+	uint8_t* buffer = pipe->buffers + (size_t)pipe->head * pipe->buffer_size;
+
+	/* The write may complete before submit() returns */
+	atomic_add_int(&pipe->in_flight, 1);
+	const int ret = pipe->submit(pipe, buffer, pipe->fill);
+	if (ret < 0) {
+		atomic_add_int(&pipe->in_flight, -1);
+		return ret;
+	}
+	pipe->head = (pipe->head + 1) % pipe->nbuffers;
+	pipe->fill = 0;
+
+	return BSPATCH_SUCCESS;
+}
+
+static int pipeline_write(const struct bspatch_stream_n* stream, const void* buffer, int length)
+{
+	struct bspatch_pipeline* pipe = stream->opaque;
+	const uint8_t* src = buffer;
+
+	while (length > 0) {
+		RETURN_IF_NEGATIVE(pipeline_ready(pipe));
+		uint8_t* dst = pipe->buffers + (size_t)pipe->head * pipe->buffer_size + pipe->fill;
+		const int n = min(length, pipe->buffer_size - pipe->fill);
+		/* Spans handed out by pipeline_acquire() are already in place */
+		if (src != dst) {
+			memcpy(dst, src, n);
+		}
+		pipe->fill += n;
+		src += n;
+		length -= n;
+		if (pipe->fill == pipe->buffer_size) {
+			RETURN_IF_NEGATIVE(pipeline_submit(pipe));
+		}
+	}
+
+	return BSPATCH_SUCCESS;
+}
+
+static int pipeline_acquire(const struct bspatch_stream_n* stream, void** span, int length)
+{
+	struct bspatch_pipeline* pipe = stream->opaque;
+
+	RETURN_IF_NEGATIVE(pipeline_ready(pipe));
+	*span = pipe->buffers + (size_t)pipe->head * pipe->buffer_size + pipe->fill;
+
+	return min(length, pipe->buffer_size - pipe->fill);
+}
+
+int bspatch_pipeline_init(struct bspatch_pipeline* pipe, uint8_t* buffers, int buffer_size,
+			  int nbuffers, struct bspatch_stream_n* new)
+{
+	if (nbuffers < 2 || buffer_size <= 0 || pipe->submit == NULL || pipe->wait == NULL) {
+		return BSPATCH_ERROR;
+	}
+
+	pipe->buffers = buffers;
+	pipe->buffer_size = buffer_size;
+	pipe->nbuffers = nbuffers;
+	pipe->head = 0;
+	pipe->fill = 0;
+	pipe->in_flight = 0;
+	pipe->error = BSPATCH_SUCCESS;
+
+	bspatch_stream_n_init(new);
+	new->opaque = pipe;
+	new->write = pipeline_write;
+	new->acquire = pipeline_acquire;
+
+	return BSPATCH_SUCCESS;
+}
+
+void bspatch_pipeline_complete(struct bspatch_pipeline* pipe, int result)
+{
+	if (result < 0) {
+		int expected = BSPATCH_SUCCESS;
+		__atomic_compare_exchange_n(&pipe->error, &expected, result, 0, __ATOMIC_SEQ_CST,
+					    __ATOMIC_SEQ_CST);
+	}
+	atomic_add_int(&pipe->in_flight, -1);
+}
+
+int bspatch_pipeline_flush(struct bspatch_pipeline* pipe)
+{
+	if (pipe->fill > 0) {
+		RETURN_IF_NEGATIVE(pipeline_ready(pipe));
+		RETURN_IF_NEGATIVE(pipeline_submit(pipe));
+	}
+	while (atomic_load_int(&pipe->in_flight) > 0) {
+		RETURN_IF_NEGATIVE(pipe->wait(pipe));
+	}
+
+	return atomic_load_int(&pipe->error);
+}
+
 #if defined(BSPATCH_EXECUTABLE)
 
 #include <stdlib.h>
@@ -206,21 +1076,46 @@ int bspatch(struct bspatch_ctx* ctx,
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 struct NewCtx {
 	uint8_t* new;
-	int pos_write;
+	int64_t pos_write;
+	int64_t newsize;
 };
 
 struct OldCtx {
 	uint8_t* old;
-	int oldsize;
+	int64_t oldsize;
 };
 
+/* read() and write() move at most about 2 GB per call on Linux */
+static ssize_t readall(int fd, void* buffer, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		const ssize_t n = read(fd, (uint8_t*)buffer + done, size - done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return done;
+}
 
-static int old_read(const struct bspatch_stream_i* stream, void* buffer, int pos, int length) {
+static ssize_t writeall(int fd, const void* buffer, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		const ssize_t n = write(fd, (const uint8_t*)buffer + done, size - done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return done;
+}
+
+static int old_read64(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length) {
 	struct OldCtx* old_ctx = (struct OldCtx*)stream->opaque;
-	if (pos >= old_ctx->oldsize) {
+	if (pos < 0 || pos >= old_ctx->oldsize) {
 		return -1;
 	} else if (pos + length > old_ctx->oldsize) {
 		return -2;
@@ -229,14 +1124,238 @@ static int old_read(const struct bspatch_stream_i* stream, void* buffer, int pos
 	return 0;
 }
 
+static int old_read(const struct bspatch_stream_i* stream, void* buffer, int pos, int length) {
+	return old_read64(stream, buffer, pos, length);
+}
+
 static int new_write(const struct bspatch_stream_n* stream, const void *buffer, int length) {
 	struct NewCtx* new;
 	new = (struct NewCtx*)stream->opaque;
-	memcpy(new->new + new->pos_write, buffer, length);
+	if (new->pos_write + length > new->newsize) {
+		return -1;
+	}
+	/* Spans handed out by new_acquire() are already in place */
+	if (buffer != new->new + new->pos_write) {
+		memcpy(new->new + new->pos_write, buffer, length);
+	}
 	new->pos_write += length;
 	return 0;
 }
 
+static int new_acquire(const struct bspatch_stream_n* stream, void** span, int length) {
+	struct NewCtx* new;
+	new = (struct NewCtx*)stream->opaque;
+	*span = new->new + new->pos_write;
+	return min(length, new->newsize - new->pos_write);
+}
+
+/* Output pipeline driver: a worker thread writes the submitted buffers in order */
+struct WriterCtx {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct bspatch_pipeline pipe;
+	int fd;
+	const void** queue;
+	int* queue_len;
+	int queue_head;
+	int queue_count;
+	int completions;
+	int stop;
+	int64_t written;
+};
+
+static int writer_submit(struct bspatch_pipeline* pipe, const void* buffer, int length) {
+	struct WriterCtx* w = pipe->opaque;
+
+	pthread_mutex_lock(&w->lock);
+	const int tail = (w->queue_head + w->queue_count) % pipe->nbuffers;
+	w->queue[tail] = buffer;
+	w->queue_len[tail] = length;
+	w->queue_count++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+static int writer_wait(struct bspatch_pipeline* pipe) {
+	struct WriterCtx* w = pipe->opaque;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->completions == 0)
+		pthread_cond_wait(&w->cond, &w->lock);
+	w->completions--;
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+static void* writer_thread(void* arg) {
+	struct WriterCtx* w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->queue_count == 0 && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->queue_count == 0)
+			break;
+		const void* buffer = w->queue[w->queue_head];
+		const int length = w->queue_len[w->queue_head];
+		pthread_mutex_unlock(&w->lock);
+
+		const int result = write(w->fd, buffer, length) == length ? 0 : BSPATCH_ERROR;
+
+		pthread_mutex_lock(&w->lock);
+		w->written += length;
+		w->queue_head = (w->queue_head + 1) % w->pipe.nbuffers;
+		w->queue_count--;
+		bspatch_pipeline_complete(&w->pipe, result);
+		w->completions++;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/* A contiguous run of indexed blocks, applied by one thread */
+struct ParallelCtx {
+	pthread_t thread;
+	const struct bspatch_block* blocks;
+	int64_t count;
+	const uint8_t* patch;
+	const uint8_t* old;
+	int64_t oldsize;
+	uint8_t* new;
+	int64_t newsize;
+	int result;
+};
+
+static void* parallel_apply(void* arg) {
+	struct ParallelCtx* job = arg;
+
+	for (int64_t i = 0; i < job->count; i++) {
+		const struct bspatch_block* blk = &job->blocks[i];
+		const uint8_t* diff = job->patch + blk->patch_offset + BSPATCH_CTRL_SIZE;
+		uint8_t* out = job->new + blk->new_offset;
+
+		if (blk->old_offset < 0 || blk->old_offset + blk->ctrl[0] > job->oldsize ||
+			blk->new_offset + blk->ctrl[0] + blk->ctrl[1] > job->newsize) {
+			job->result = BSPATCH_ERROR;
+			break;
+		}
+		if (blk->op == BSPATCH_OP_FILL) {
+			memset(out, blk->fill_byte, blk->ctrl[1]);
+			continue;
+		}
+		for (int64_t k = 0; k < blk->ctrl[0]; k++) {
+			out[k] = job->old[blk->old_offset + k] + diff[k];
+		}
+		memcpy(out + blk->ctrl[0], diff + blk->ctrl[0], blk->ctrl[1]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Checks the output of the threads against the digest block of the patch, if it has
+ * one: old is hashed over the ranges the blocks add to, in patch order, and new whole.
+ */
+static int parallel_verify(const uint8_t* patch, int64_t patchsize, const struct bspatch_block* blocks,
+		int64_t count, const uint8_t* old, const uint8_t* new, int64_t newsize) {
+	struct bspatch_block blk;
+	struct bssha256 sha;
+	uint8_t digest[BSPATCH_DIGEST_SIZE];
+	const uint8_t* expected = NULL;
+
+	/* The patch was walked by bspatch_index() already */
+	memset(&blk, 0, sizeof(blk));
+	while (blk.patch_offset < patchsize) {
+		bspatch_block_decode(&blk, patch + blk.patch_offset);
+		if (blk.op == BSPATCH_OP_DIGEST)
+			expected = patch + blk.patch_offset + BSPATCH_CTRL_SIZE;
+		bspatch_block_next(&blk);
+	}
+	if (expected == NULL)
+		return BSPATCH_SUCCESS;
+
+	if (old_digest_recorded(expected)) {
+		bssha256_init(&sha);
+		for (int64_t i = 0; i < count; i++)
+			bssha256_update(&sha, old + blocks[i].old_offset, blocks[i].ctrl[0]);
+		bssha256_final(&sha, digest);
+		if (memcmp(digest, expected, BSPATCH_DIGEST_SIZE) != 0)
+			return BSPATCH_DIGEST_MISMATCH;
+	}
+
+	bssha256_init(&sha);
+	bssha256_update(&sha, new, newsize);
+	bssha256_final(&sha, digest);
+	if (memcmp(digest, expected + BSPATCH_DIGEST_SIZE, BSPATCH_DIGEST_SIZE) != 0)
+		return BSPATCH_DIGEST_MISMATCH;
+
+	return BSPATCH_SUCCESS;
+}
+
+/*
+ * Applies an in-memory patch with jobs threads. Every block knows its offsets from
+ * the index, so each thread writes its own range of the memory-mapped output.
+ */
+static int bspatch_parallel(const uint8_t* patch, int64_t patchsize, const uint8_t* old, int64_t oldsize,
+		const char* newfile, int64_t newsize, mode_t mode, int jobs) {
+	struct bspatch_block* blocks;
+	struct ParallelCtx* ctx;
+	uint8_t* new = NULL;
+	int64_t count, first = 0;
+	int fd, result = BSPATCH_SUCCESS;
+
+	if ((count = bspatch_index(patch, patchsize, NULL, 0)) < 0)
+		return BSPATCH_ERROR;
+	if (((blocks = calloc(count + 1, sizeof(*blocks))) == NULL) ||
+		((ctx = calloc(jobs, sizeof(*ctx))) == NULL)) err(1, NULL);
+	bspatch_index(patch, patchsize, blocks, count);
+
+	/* Threads write the output as it is in the patch, which a filter would have changed */
+	if (bspatch_patch_filter(patch, patchsize) != BSFILTER_NONE)
+		errx(1, "-j applies a single unfiltered patch");
+
+	if (count > 0 && blocks[count-1].new_offset + blocks[count-1].ctrl[0] + blocks[count-1].ctrl[1] != newsize)
+		errx(1, "patch does not produce %ld bytes", (long)newsize);
+
+	if (((fd = open(newfile, O_CREAT|O_TRUNC|O_RDWR, mode)) < 0) ||
+		(ftruncate(fd, newsize) != 0) ||
+		(newsize > 0 && (new = mmap(NULL, newsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED))
+		err(1, "%s", newfile);
+
+	/* Split the output evenly, each job takes the blocks that start in its share */
+	for (int t = 0; t < jobs; t++) {
+		int64_t last = first;
+		while (last < count && blocks[last].new_offset < (newsize / jobs) * (t + 1))
+			last++;
+		if (t == jobs - 1)
+			last = count;
+		ctx[t] = (struct ParallelCtx) { .blocks = blocks + first, .count = last - first, .patch = patch,
+			.old = old, .oldsize = oldsize, .new = new, .newsize = newsize };
+		if (pthread_create(&ctx[t].thread, NULL, parallel_apply, &ctx[t]) != 0)
+			errx(1, "pthread_create");
+		first = last;
+	}
+	for (int t = 0; t < jobs; t++) {
+		pthread_join(ctx[t].thread, NULL);
+		if (ctx[t].result != BSPATCH_SUCCESS)
+			result = ctx[t].result;
+	}
+	if (result == BSPATCH_SUCCESS)
+		result = parallel_verify(patch, patchsize, blocks, count, old, new, newsize);
+
+	if ((newsize > 0 && munmap(new, newsize) != 0) || close(fd) == -1)
+		err(1, "%s", newfile);
+
+	free(ctx);
+	free(blocks);
+
+	return result;
+}
+
 int main(int argc,char * argv[])
 {
 	int fd;
@@ -244,60 +1363,191 @@ int main(int argc,char * argv[])
 	int64_t oldsize, newsize, patchsize;
 	struct bspatch_stream_i oldstream;
 	struct bspatch_stream_n newstream;
+	struct bspatch_chain_stage *stages;
+	struct OldCtx *stage_ctx;
+	int nstages;
 	struct stat sb;
+	int filter = BSFILTER_NONE;
+	int jobs = 1;
+	int nbuffers = 0;
+	int ch;
 
-	if(argc!=5) errx(1,"usage: %s oldfile newfile newsize patchfile\n",argv[0]);
+	while ((ch = getopt(argc, argv, "f:j:p:")) != -1) {
+		switch (ch) {
+		case 'f':
+			if ((filter = bsfilter_from_name(optarg)) < 0)
+				errx(1, "unknown filter %s", optarg);
+			break;
+		case 'j':
+			if ((jobs = atoi(optarg)) < 1)
+				errx(1, "invalid job count %s", optarg);
+			break;
+		case 'p':
+			if ((nbuffers = atoi(optarg)) < 2)
+				errx(1, "invalid buffer count %s", optarg);
+			break;
+		default:
+			errx(1,"usage: %s [-f none|arm|thumb] [-j jobs] [-p buffers] oldfile newfile newsize patchfile [patchfile ...]\n",argv[0]);
+		}
+	}
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc<5) errx(1,"usage: %s [-f none|arm|thumb] [-j jobs] [-p buffers] oldfile newfile newsize patchfile [patchfile ...]\n",argv[0]);
+	if(jobs>1 && (argc>5 || filter!=BSFILTER_NONE || nbuffers))
+		errx(1,"-j applies a single unfiltered patch");
+
+	char *end;
+	newsize = strtoll(argv[3], &end, 10);
+	if (*argv[3] == '\0' || *end != '\0' || newsize < 0)
+		errx(1, "invalid newsize %s", argv[3]);
 
-	newsize = atoi(argv[3]);
+	/* Patches before the last one are applied as intermediate chain stages */
+	nstages = argc - 5;
+	if(((stages=calloc(nstages+1,sizeof(*stages)))==NULL) ||
+		((stage_ctx=calloc(nstages+1,sizeof(*stage_ctx)))==NULL)) err(1,NULL);
+	for(int i=0;i<nstages;i++) {
+		if(((fd=open(argv[4+i],O_RDONLY,0))<0) ||
+			((patchsize=lseek(fd,0,SEEK_END))==-1) ||
+			((patch=malloc(patchsize+1))==NULL) ||
+			(lseek(fd,0,SEEK_SET)!=0) ||
+			(readall(fd,patch,patchsize)!=patchsize) ||
+			(close(fd)==-1)) err(1,"%s",argv[4+i]);
+		stage_ctx[i].old = patch;
+		stage_ctx[i].oldsize = patchsize;
+		bspatch_stream_i_init(&stages[i].patch);
+		stages[i].patch.opaque = &stage_ctx[i];
+		stages[i].patch.read = old_read;
+		stages[i].patch.read64 = old_read64;
+		stages[i].patch_size = patchsize;
+	}
 
 	/* Read patch file */
-	if(((fd=open(argv[4],O_RDONLY,0))<0) ||
+	if(((fd=open(argv[argc-1],O_RDONLY,0))<0) ||
 		((patchsize=lseek(fd,0,SEEK_END))==-1) ||
 		((patch=malloc(patchsize+1))==NULL) ||
 		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,patch,patchsize)!=patchsize) ||
+		(readall(fd,patch,patchsize)!=patchsize) ||
 		(fstat(fd, &sb)) ||
-		(close(fd)==-1)) err(1,"%s",argv[4]);
+		(close(fd)==-1)) err(1,"%s",argv[argc-1]);
 
 	/* Read old file */
 	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
 		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
 		((old=malloc(oldsize+1))==NULL) ||
 		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,old,oldsize)!=oldsize) ||
+		(readall(fd,old,oldsize)!=oldsize) ||
 		(fstat(fd, &sb)) ||
 		(close(fd)==-1)) err(1,"%s",argv[1]);
 
-	/* Allocate buffer for new file */
-	if((new=malloc(newsize+1))==NULL) err(1,NULL);
-
+	/* Check the old file first if the patch lists the ranges it reads */
 	struct OldCtx old_ctx = { .old = old, .oldsize = oldsize };
-
+	bspatch_stream_i_init(&oldstream);
 	oldstream.read = old_read;
-	newstream.write = new_write;
+	oldstream.read64 = old_read64;
 	oldstream.opaque = &old_ctx;
-	struct NewCtx ctx = { .pos_write = 0, .new = new };
+	struct bspatch_block first = {};
+	if (nstages == 0 && patchsize >= BSPATCH_CTRL_SIZE &&
+		bspatch_block_decode(&first, patch) == BSPATCH_SUCCESS && first.op == BSPATCH_OP_PRECHECK) {
+		if (bspatch_precheck(patch, patchsize, &oldstream) != BSPATCH_SUCCESS)
+			errx(1, "%s does not match the patch", argv[1]);
+	}
+
+	if (jobs > 1) {
+		int result = bspatch_parallel(patch, patchsize, old, oldsize, argv[2], newsize, sb.st_mode, jobs);
+		if (result == BSPATCH_DIGEST_MISMATCH) {
+			unlink(argv[2]);
+			errx(1, "digest mismatch: wrong old file or corrupt patch");
+		}
+		if (result != BSPATCH_SUCCESS)
+			errx(1, "bspatch");
+		free(stage_ctx);
+		free(stages);
+		free(patch);
+		free(old);
+		return 0;
+	}
+
+	/* Allocate buffer for new file, or the output pipeline buffers */
+	if((new=malloc((nbuffers ? (int64_t)nbuffers * 65536 : newsize)+1))==NULL) err(1,NULL);
+
+	bspatch_stream_n_init(&newstream);
+	newstream.write = new_write;
+	newstream.acquire = new_acquire;
+	struct NewCtx ctx = { .pos_write = 0, .new = new, .newsize = newsize };
 	newstream.opaque = &ctx;
 
+	/* The new file is written by a worker thread while the patch is decoded */
+	struct WriterCtx writer = { .pipe = { .opaque = &writer, .submit = writer_submit, .wait = writer_wait } };
+	if (nbuffers) {
+		if(((writer.queue=calloc(nbuffers,sizeof(*writer.queue)))==NULL) ||
+			((writer.queue_len=calloc(nbuffers,sizeof(*writer.queue_len)))==NULL)) err(1,NULL);
+		if((writer.fd=open(argv[2],O_CREAT|O_TRUNC|O_WRONLY,sb.st_mode))<0)
+			err(1,"%s",argv[2]);
+		if (bspatch_pipeline_init(&writer.pipe, new, 65536, nbuffers, &newstream) != BSPATCH_SUCCESS)
+			errx(1, "bspatch_pipeline_init");
+		pthread_mutex_init(&writer.lock, NULL);
+		pthread_cond_init(&writer.cond, NULL);
+		if (pthread_create(&writer.thread, NULL, writer_thread, &writer) != 0)
+			errx(1, "pthread_create");
+	}
+
+	if (bspatch_chain_init(stages, nstages, &oldstream) != BSPATCH_SUCCESS)
+		errx(1, "bspatch_chain_init");
+	struct bspatch_stream_i* chainstream = nstages ? &stages[nstages-1].output : &oldstream;
+
+	/* Patches with a digest block are checked as they are applied */
+	struct bspatch_verify verify = {};
 	struct bspatch_ctx bspatch_ctx = {};
-	int patch_remaining = patchsize;
+	if (bspatch_set_filter(&bspatch_ctx, filter, oldsize) != BSPATCH_SUCCESS)
+		errx(1, "bspatch_set_filter");
+	bspatch_set_verify(&bspatch_ctx, &verify);
+	int64_t patch_remaining = patchsize;
 	while (patch_remaining) {
-		int patch_offset = patchsize - patch_remaining;
-		int patch_chunk_sz = min(patch_remaining, 512);
+		int64_t patch_offset = patchsize - patch_remaining;
+		int patch_chunk_sz = min(patch_remaining, 65536);
 		BSPATCH_DEBUG("--------------\n");
-		int patch_result = bspatch(&bspatch_ctx, &oldstream, &newstream, patch + patch_offset, patch_chunk_sz);
+		int patch_result = bspatch(&bspatch_ctx, chainstream, &newstream, patch + patch_offset, patch_chunk_sz);
+		if (patch_result == BSPATCH_FILTER_MISMATCH)
+			errx(1, "filter mismatch: apply with the -f the patch was made with");
 		if (patch_result < 0) {
 			errx(patch_result, "bspatch");
 			break;
 		}
 		patch_remaining -= patch_chunk_sz;
 	}
+	int finish_result = bspatch_finish(&bspatch_ctx, &newstream);
+	if (finish_result == BSPATCH_DIGEST_MISMATCH)
+		errx(1, "digest mismatch: wrong old file or corrupt patch");
+	if (finish_result != BSPATCH_SUCCESS)
+		errx(1, "bspatch");
 
-	/* Write the new file */
-	if(((fd=open(argv[2],O_CREAT|O_TRUNC|O_WRONLY,sb.st_mode))<0) ||
-		(write(fd,new,newsize)!=newsize) || (close(fd)==-1))
-		err(1,"%s",argv[2]);
+	if (nbuffers) {
+		if (bspatch_pipeline_flush(&writer.pipe) != BSPATCH_SUCCESS)
+			err(1, "%s", argv[2]);
+		pthread_mutex_lock(&writer.lock);
+		writer.stop = 1;
+		pthread_cond_broadcast(&writer.cond);
+		pthread_mutex_unlock(&writer.lock);
+		pthread_join(writer.thread, NULL);
+		if (writer.written != newsize)
+			errx(1, "patch produced %ld bytes instead of %ld", (long)writer.written, (long)newsize);
+		if (close(writer.fd) == -1)
+			err(1, "%s", argv[2]);
+		free(writer.queue_len);
+		free(writer.queue);
+	} else {
+		/* Write the new file */
+		if(((fd=open(argv[2],O_CREAT|O_TRUNC|O_WRONLY,sb.st_mode))<0) ||
+			(writeall(fd,new,newsize)!=newsize) || (close(fd)==-1))
+			err(1,"%s",argv[2]);
+	}
 
+	for(int i=0;i<nstages;i++) free(stage_ctx[i].old);
+	free(stage_ctx);
+	free(stages);
+	free(patch);
 	free(new);
 	free(old);
 
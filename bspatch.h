@@ -30,31 +30,125 @@
 
 #include <stdint.h>
 
+#include "bsfilter.h"
+#include "bsformat.h"
+#include "bssha256.h"
+
 #ifndef BSPATCH_BUF_SIZE
 #define BSPATCH_BUF_SIZE 256
 #endif
 
+/*
+ * Patch chunks of at least this many bytes are applied straight from the caller's
+ * patch buffer instead of being staged through ctx->buf.
+ */
+#ifndef BSPATCH_BULK_MIN
+#define BSPATCH_BULK_MIN BSPATCH_BUF_SIZE
+#endif
+
 #ifndef BSPATCH_DEBUG
 #define BSPATCH_DEBUG(...) //printf(__VA_ARGS__)
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Stamped into a stream by its init function. The optional callbacks of a stream are
+ * only used when it carries this value, so a caller written against an older revision
+ * of the struct, which leaves them as whatever is on its stack, gets the plain paths.
+ */
+#define BSPATCH_STREAM_MAGIC 0x62737031
+
+/*
+ * Streams must be set up with bspatch_stream_i_init() or bspatch_stream_n_init()
+ * before their members are filled in, or initialized with BSPATCH_STREAM_INIT among
+ * the designators:
+ *
+ *	struct bspatch_stream_n out = { BSPATCH_STREAM_INIT, .opaque = w, .write = flash_write };
+ */
+#define BSPATCH_STREAM_INIT .magic = BSPATCH_STREAM_MAGIC
+
 struct bspatch_stream_i
 {
 	void* opaque;
 	int (*read)(const struct bspatch_stream_i* stream, void* buffer, int pos, int length);
+	/* BSPATCH_STREAM_MAGIC, or read64 is ignored */
+	uint32_t magic;
+	/*
+	 * Optional, may be NULL. Same as read() with a 64-bit position, and used instead
+	 * of it when set. Needed for old images of 2 GB and more: without it, reads past
+	 * INT_MAX fail.
+	 */
+	int (*read64)(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length);
 };
 
 struct bspatch_stream_n
 {
 	void* opaque;
 	int (*write)(const struct bspatch_stream_n* stream, const void *buffer, int length);
+	/* BSPATCH_STREAM_MAGIC, or the optional callbacks below are ignored */
+	uint32_t magic;
+	/*
+	 * Optional, may be NULL. Acquire a span of up to length bytes of output memory
+	 * and store its address in *span. Returns the number of bytes available (<= length),
+	 * or <0 on error. bspatch fills the span with the next diff output and then passes
+	 * it back to write(), so write() must accept a buffer that is already in place.
+	 */
+	int (*acquire)(const struct bspatch_stream_n* stream, void** span, int length);
+	/*
+	 * Optional, may be NULL. Write length copies of byte, for the fill blocks of a
+	 * patch. Returns the number of bytes written (<= length, at least 1), or <0 on
+	 * error. A flash writer can skip the program cycle for 0xFF over a sector it knows
+	 * is erased. Without it, fills are written through write() like any other output.
+	 * Not used with a branch filter.
+	 */
+	int (*fill)(const struct bspatch_stream_n* stream, uint8_t byte, int length);
 };
 
+/* Zero stream and stamp it with BSPATCH_STREAM_MAGIC, ready for its callbacks */
+void bspatch_stream_i_init(struct bspatch_stream_i* stream);
+void bspatch_stream_n_init(struct bspatch_stream_n* stream);
+
 enum bspatch_state {
 	BSPATCH_STATE_RESET,
 	BSPATCH_STATE_RD_CTRL,
 	BSPATCH_STATE_RD_DIFF,
 	BSPATCH_STATE_RD_EXTRA,
+	BSPATCH_STATE_RD_OP,
+	BSPATCH_STATE_RD_FILL,
+};
+
+/* Output queued behind a write() that would block: the filter stage emits up to two pieces */
+#define BSPATCH_OUT_QUEUE 2
+
+/* Flags of bspatch_verify.expect */
+#define BSPATCH_VERIFY_OLD 1
+#define BSPATCH_VERIFY_NEW 2
+
+/*
+ * Digests of the old bytes a patch reads and of the new image it writes, computed on
+ * the fly, see bspatch_set_verify().
+ */
+struct bspatch_verify
+{
+	/*
+	 * Expected digests, flagged in expect. Set by the caller, or taken from a digest
+	 * block in the patch for those the caller left out.
+	 */
+	uint8_t old_digest[BSPATCH_DIGEST_SIZE];
+	uint8_t new_digest[BSPATCH_DIGEST_SIZE];
+	uint8_t expect;
+
+	/* Set by bspatch_finish(): the digests of what was actually read and written */
+	uint8_t old_computed[BSPATCH_DIGEST_SIZE];
+	uint8_t new_computed[BSPATCH_DIGEST_SIZE];
+
+	/* Internal */
+	struct bssha256 old_hash;
+	struct bssha256 new_hash;
+	uint8_t block[BSPATCH_DIGEST_BLOCK_SIZE];
 };
 
 struct bspatch_ctx
@@ -63,14 +157,43 @@ struct bspatch_ctx
 	int64_t ctrl[3];
 	uint8_t buf[BSPATCH_BUF_SIZE];
 	uint32_t buf_offset;
-	uint32_t diff_offset;
-	uint32_t extra_offset;
-	int oldpos;
+	int64_t diff_offset;
+	int64_t extra_offset;
+	int64_t oldpos;
+
+	/* Branch filter stage, see bspatch_set_filter() */
+	uint8_t filter;
+	uint8_t filter_tail_len;
+	uint8_t filter_tail[BSFILTER_INSN_SIZE];
+	int64_t filter_oldsize;
+	uint8_t filter_checked;	/* against the filter block, once output starts */
+	int64_t newpos;
+	uint8_t filter_out[BSFILTER_INSN_SIZE];
+
+	/* Output that has been produced but not yet taken by newstream->write() */
+	const uint8_t* out_buf[BSPATCH_OUT_QUEUE];
+	int out_len[BSPATCH_OUT_QUEUE];
+	uint8_t out_count;
+
+	/* Patch bytes consumed by the last call to bspatch() */
+	int consumed;
 
+	/* Digests computed on the fly, see bspatch_set_verify() */
+	struct bspatch_verify* verify;
 };
 
 #define BSPATCH_SUCCESS (0)
 #define BSPATCH_ERROR (-1)
+/*
+ * Returned by a read(), write() or acquire() callback that cannot complete right now
+ * (mirrors -EAGAIN). Nothing must have been read or written. bspatch() then returns
+ * it too, after saving its position in ctx.
+ */
+#define BSPATCH_WOULD_BLOCK (-11)
+/* A digest does not match, see bspatch_set_verify() and bspatch_precheck() */
+#define BSPATCH_DIGEST_MISMATCH (-12)
+/* The patch was made with another branch filter than the one set, see bspatch_set_filter() */
+#define BSPATCH_FILTER_MISMATCH (-13)
 /*
  * Processes patch_size bytes of patch, reading from old stream and writing to new stream
  * in the process.
@@ -79,14 +202,252 @@ struct bspatch_ctx
  * In other words, you don't need to pass in the full patch contents, just pass in however
  * many patch bytes you have (even if just 1 byte).
  *
+ * When a chunk holds at least BSPATCH_BULK_MIN bytes, extra data is written directly
+ * from the patch buffer and, if newstream->acquire is set, diff data is added into the
+ * acquired output span. Smaller chunks are staged through ctx->buf.
+ *
+ * Callbacks may return BSPATCH_WOULD_BLOCK to suspend patching, for example while a
+ * flash erase is running. bspatch() then returns BSPATCH_WOULD_BLOCK and
+ * ctx->consumed holds how many of the patch bytes were consumed. Output that was
+ * already produced is kept in ctx (it may point into ctx->buf or an acquired span)
+ * and is written first by the next call, so resume by calling bspatch() again with
+ * the patch bytes from patch + ctx->consumed on (zero bytes is fine) once the I/O
+ * can make progress. Reads may be repeated after a would-block, and acquire() may be
+ * asked for the same output again.
+ *
  * Returns BSPATCH_SUCCESS on success, all patch bytes processed successfully
+ * Returns BSPATCH_WOULD_BLOCK if a callback would block, see above
+ * Returns BSPATCH_FILTER_MISMATCH if the patch needs another bspatch_set_filter()
  * Returns BSPATCH_ERROR on error in patching logic
  * Returns any <0 return code from stream read() and write() functions (which imply error)
  */
 int bspatch(struct bspatch_ctx* ctx,
 	    struct bspatch_stream_i *old,
-	    struct bspatch_stream_n *new,
+	    struct bspatch_stream_n *newstream,
 	    const uint8_t* patch,
 	    int patch_size);
 
+/*
+ * Enables the branch filter (enum bsfilter) the patch was made with. Must be called
+ * on a zeroed ctx, before the first call to bspatch(). Old reads are filtered on the
+ * fly, which needs the size of the old image, and output is unfiltered before it is
+ * written. Up to BSFILTER_INSN_SIZE - 1 output bytes are held back until the next
+ * call, so bspatch_finish() must be called at the end of the patch. Filtered patches
+ * always use the staged path through ctx->buf.
+ *
+ * The filter block of the patch must name the same filter, and a patch without one
+ * must be applied with BSFILTER_NONE, or bspatch() returns BSPATCH_FILTER_MISMATCH.
+ *
+ * Returns BSPATCH_SUCCESS, or BSPATCH_ERROR for an unknown filter
+ */
+int bspatch_set_filter(struct bspatch_ctx* ctx, int filter, int64_t oldsize);
+
+/*
+ * Checks the output and the old bytes it came from without reading either back.
+ * Must be called on a zeroed ctx, before the first call to bspatch(). Every byte
+ * handed to newstream->write() is hashed into the new digest, and the old bytes each diff
+ * block adds to are hashed, in patch order and after the branch filter, into the old
+ * digest. bspatch_finish() compares them with the expected digests in verify, which
+ * must stay valid until then.
+ *
+ * Only the digests flagged in verify->expect are checked. A digest block in the
+ * patch (see bsdiff_options.digest) supplies those the caller did not, the old one
+ * only if it was recorded, so check verify->expect after bspatch_finish() to insist
+ * on a digest. The old digest does
+ * not cover old bytes the patch never reads.
+ *
+ * Returns BSPATCH_SUCCESS
+ */
+int bspatch_set_verify(struct bspatch_ctx* ctx, struct bspatch_verify* verify);
+
+/*
+ * Checks that old holds the image the patch was made against, before anything is
+ * written, by hashing only the old ranges the patch reads. Those are listed in the
+ * precheck block a patch starts with when made with bsdiff_options.precheck, so the
+ * check takes time in proportion to the data the patch reuses rather than to the
+ * size of old. patch must hold at least the whole precheck block, which is
+ * BSPATCH_CTRL_SIZE plus its Y bytes long. Then apply the patch from the start as
+ * usual; bspatch() skips the block.
+ *
+ * Returns BSPATCH_SUCCESS, BSPATCH_DIGEST_MISMATCH, BSPATCH_ERROR if the patch does
+ * not start with a complete precheck block, or any <0 return code from old->read()
+ * (BSPATCH_WOULD_BLOCK included: call again to start over)
+ */
+int bspatch_precheck(const uint8_t* patch, int64_t patch_size, const struct bspatch_stream_i* old);
+
+/*
+ * Call once all patch bytes have been passed to bspatch(). Flushes any output that
+ * is still held back, then checks the digests if bspatch_set_verify() was called.
+ *
+ * Returns BSPATCH_SUCCESS, BSPATCH_ERROR if the patch stopped in the middle of a
+ * block, BSPATCH_DIGEST_MISMATCH, or any <0 return code from newstream->write()
+ */
+int bspatch_finish(struct bspatch_ctx* ctx, struct bspatch_stream_n* newstream);
+
+/*
+ * A decoded control block, along with where it sits in the patch and in the old
+ * and new images. Start from a zeroed block, decode the control words found at
+ * patch_offset, then call bspatch_block_next() to move on to the following block.
+ *
+ * An extended operation is flagged in op, with ctrl cleared, so that it reads as
+ * an empty block. A fill reads as a block of ctrl[1] extra bytes that are not in the
+ * patch, all fill_byte. A filter block keeps the filter it names in filter.
+ */
+struct bspatch_block
+{
+	int64_t ctrl[3];
+	int op;			/* 0, or BSPATCH_OP_* */
+	int64_t op_size;	/* bytes of operation data after the control words */
+	uint8_t fill_byte;	/* BSPATCH_OP_FILL */
+	uint8_t filter;		/* BSPATCH_OP_FILTER */
+	int64_t patch_offset;
+	int64_t old_offset;
+	int64_t new_offset;
+};
+
+/*
+ * Decodes BSPATCH_CTRL_SIZE bytes of control words into blk->ctrl.
+ *
+ * Returns BSPATCH_SUCCESS, or BSPATCH_ERROR if the block fails the sanity check
+ */
+int bspatch_block_decode(struct bspatch_block* blk, const uint8_t* ctrl);
+
+/*
+ * Advances the offsets of blk past the block, to where the next block starts
+ */
+void bspatch_block_next(struct bspatch_block* blk);
+
+/*
+ * Builds an index of the non-empty blocks of an in-memory patch with a quick scan of
+ * its control words. Each block's new_offset and old_offset are known up front, so
+ * blocks can be applied independently of each other. Pass blocks = NULL to only
+ * count them.
+ *
+ * Returns the number of blocks (at most max_blocks are stored), or BSPATCH_ERROR if
+ * the patch is malformed or truncated
+ */
+int64_t bspatch_index(const uint8_t* patch, int64_t patch_size,
+		      struct bspatch_block* blocks, int64_t max_blocks);
+
+/*
+ * Finds the filter block of an in-memory patch, which comes ahead of the first block
+ * that produces output.
+ *
+ * Returns the branch filter (enum bsfilter) the patch was made with, BSFILTER_NONE if
+ * it has no filter block, or BSPATCH_ERROR if the patch is malformed or truncated
+ */
+int bspatch_patch_filter(const uint8_t* patch, int64_t patch_size);
+
+/*
+ * One intermediate patch of a patch chain (v1->v2 of v1->v2->v3).
+ *
+ * The output of an intermediate stage is never materialized. Reads from it are
+ * resolved on demand: diff bytes are read from the previous stage (or the base
+ * image) and added to the diff bytes in the patch, extra bytes come from the patch.
+ * Blocks only link forward, so a read that seeks backwards walks the control blocks
+ * again from the nearest of up to BSPATCH_CHAIN_CHECKPOINTS blocks kept along the
+ * way. They are spread evenly over the blocks walked so far, so memory use is
+ * constant (24 bytes per checkpoint) and a seek in either direction walks at most
+ * about 2 / BSPATCH_CHAIN_CHECKPOINTS of the control blocks seen so far.
+ */
+#ifndef BSPATCH_CHAIN_CHECKPOINTS
+#define BSPATCH_CHAIN_CHECKPOINTS 64
+#endif
+
+/* Where a block starts, its control words are read again to resume from it */
+struct bspatch_chain_checkpoint
+{
+	int64_t patch_offset;
+	int64_t old_offset;
+	int64_t new_offset;
+};
+
+struct bspatch_chain_stage
+{
+	/* Set by the caller: random-access reader over this stage's patch */
+	struct bspatch_stream_i patch;
+	int64_t patch_size;
+
+	/* Set by bspatch_chain_init(): reader over this stage's output */
+	struct bspatch_stream_i output;
+
+	/* Internal */
+	const struct bspatch_stream_i* old;
+	struct bspatch_block blk;
+	int64_t blk_index;	/* of blk in the patch, -1 before the first */
+	struct bspatch_chain_checkpoint checkpoints[BSPATCH_CHAIN_CHECKPOINTS];	/* every stride-th block */
+	int ncheckpoints;
+	int64_t stride;
+};
+
+/*
+ * Links nstages intermediate patches into a chain on top of the old stream.
+ *
+ * Apply the final patch of the chain with bspatch(), passing
+ * &stages[nstages - 1].output as the old stream. The final patch can be streamed
+ * in chunks as usual, and the result is written to new exactly once.
+ *
+ * Returns BSPATCH_SUCCESS, or BSPATCH_ERROR if a stage has no patch reader
+ */
+int bspatch_chain_init(struct bspatch_chain_stage* stages, int nstages,
+		       const struct bspatch_stream_i* old);
+
+/*
+ * Pipelined output: bspatch() decodes into one buffer while the buffers before it are
+ * still being written by an asynchronous driver (a DMA flash driver on the device, a
+ * worker thread on the host). Decoding only waits once every buffer is in flight, so
+ * applying a patch takes about max(decode, write) instead of their sum.
+ */
+struct bspatch_pipeline
+{
+	/* Set by the caller */
+	void* opaque;
+	/*
+	 * Starts writing length bytes of buffer and returns without waiting. The driver
+	 * calls bspatch_pipeline_complete() once the write is done, from any thread or
+	 * interrupt. Writes must complete in the order they were submitted.
+	 */
+	int (*submit)(struct bspatch_pipeline* pipe, const void* buffer, int length);
+	/*
+	 * Blocks until bspatch_pipeline_complete() was called, a counting semaphore given
+	 * by every completion does. May return early, it is called again as long as the
+	 * pipeline still waits. Must not return BSPATCH_WOULD_BLOCK.
+	 */
+	int (*wait)(struct bspatch_pipeline* pipe);
+
+	/* Internal */
+	uint8_t* buffers;
+	int buffer_size;
+	int nbuffers;
+	int head;
+	int fill;
+	int in_flight;	/* updated atomically, from the driver too */
+	int error;	/* first driver error, set atomically */
+};
+
+/*
+ * Sets up pipe with nbuffers buffers of buffer_size bytes each, carved out of
+ * buffers, and points newstream at it. Pass newstream to bspatch() and
+ * bspatch_finish() as usual, then call bspatch_pipeline_flush().
+ *
+ * Returns BSPATCH_SUCCESS, or BSPATCH_ERROR with fewer than two buffers or
+ * without submit/wait callbacks
+ */
+int bspatch_pipeline_init(struct bspatch_pipeline* pipe, uint8_t* buffers, int buffer_size,
+			  int nbuffers, struct bspatch_stream_n* newstream);
+
+/* Called by the driver when the oldest submitted write is done, result < 0 on failure */
+void bspatch_pipeline_complete(struct bspatch_pipeline* pipe, int result);
+
+/*
+ * Submits the partly filled buffer and waits for all writes to complete.
+ *
+ * Returns BSPATCH_SUCCESS, or the first error reported by the driver
+ */
+int bspatch_pipeline_flush(struct bspatch_pipeline* pipe);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,37 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BSSHA256_H
+#define BSSHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* SHA-256 (FIPS 180-4), small enough to hash patch output on the device */
+
+#define BSSHA256_SIZE 32
+
+struct bssha256
+{
+	uint32_t state[8];
+	uint64_t count;		/* bytes hashed so far */
+	uint8_t block[64];
+};
+
+void bssha256_init(struct bssha256* sha);
+
+void bssha256_update(struct bssha256* sha, const void* data, size_t length);
+
+/* Writes the digest of everything hashed since bssha256_init() */
+void bssha256_final(struct bssha256* sha, uint8_t digest[BSSHA256_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,8 +1,19 @@
 /* bsdiff test
  */
+#include <bscompose.h>
+#ifdef BSDEFLATE_ZLIB
+#include <bsdeflate.h>
+#endif
 #include <bsdiff.h>
+#include <bsestimate.h>
+#include <bsformat.h>
+#include <bsinspect.h>
+#include <bsmulti.h>
 #include <bspatch.h>
+#include <bssha256.h>
 #include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <sdkconfig.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -13,6 +24,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <unity.h>
+#if defined(BSESTIMATE_ZLIB) || defined(BSDEFLATE_ZLIB)
+#include <zlib.h>
+#endif
 
 #define min(A, B) ((A) < (B) ? (A) : (B))
 
@@ -24,6 +38,24 @@ static int _w(struct bsdiff_stream* stream, const void* buffer, int size)
     return 0;
 }
 
+struct MemCtx {
+    uint8_t* buf;
+    int size;
+};
+
+static int _mw(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+    struct MemCtx* mem = (struct MemCtx*)stream->opaque;
+    uint8_t* grown = realloc(mem->buf, mem->size + size);
+    if (grown == NULL) {
+        return -1;
+    }
+    memcpy(grown + mem->size, buffer, size);
+    mem->buf = grown;
+    mem->size += size;
+    return 0;
+}
+
 static int bsdiff_f(char* oldf, char* newf, char* patchf)
 {
     int fd;
@@ -70,6 +102,7 @@ static int bsdiff_f(char* oldf, char* newf, char* patchf)
 struct NewCtx {
     uint8_t* new;
     int pos_write;
+    int newsize;
 };
 
 struct OldCtx {
@@ -94,12 +127,25 @@ static int _nw(const struct bspatch_stream_n* stream, const void* buffer, int le
 {
     struct NewCtx* new;
     new = (struct NewCtx*)stream->opaque;
-    memcpy(new->new + new->pos_write, buffer, length);
+    if (new->pos_write + length > new->newsize) {
+        return -1;
+    }
+    if (buffer != new->new + new->pos_write) {
+        memcpy(new->new + new->pos_write, buffer, length);
+    }
     new->pos_write += length;
     return 0;
 }
 
-static int bspatch_f(char* oldf, char* newf, size_t newfs, char* patchf)
+static int _na(const struct bspatch_stream_n* stream, void** span, int length)
+{
+    struct NewCtx* new;
+    new = (struct NewCtx*)stream->opaque;
+    *span = new->new + new->pos_write;
+    return min(length, new->newsize - new->pos_write);
+}
+
+static int bspatch_f_chunked(char* oldf, char* newf, size_t newfs, char* patchf, int chunk_sz, bool use_acquire)
 {
     int fd;
     uint8_t *old, *new, *patch;
@@ -134,17 +180,24 @@ static int bspatch_f(char* oldf, char* newf, size_t newfs, char* patchf)
 
     struct OldCtx old_ctx = { .old = old, .oldsize = oldsize };
 
+    /* without acquire, fill the stream in like a caller that predates its optional callbacks */
+    memset(&newstream, 0xa5, sizeof(newstream));
+    if (use_acquire) {
+        bspatch_stream_n_init(&newstream);
+        newstream.acquire = _na;
+    }
+    memset(&oldstream, 0xa5, sizeof(oldstream));
     oldstream.read = _or;
     newstream.write = _nw;
     oldstream.opaque = &old_ctx;
-    struct NewCtx ctx = { .pos_write = 0, .new = new };
+    struct NewCtx ctx = { .pos_write = 0, .new = new, .newsize = newfs };
     newstream.opaque = &ctx;
 
     struct bspatch_ctx bspatch_ctx = {};
     int patch_remaining = patchsize;
     while (patch_remaining) {
 	    int patch_offset = patchsize - patch_remaining;
-	    int patch_chunk_sz = min(patch_remaining, 512);
+	    int patch_chunk_sz = min(patch_remaining, chunk_sz);
 	    BSPATCH_DEBUG("--------------\n");
 	    int patch_result = bspatch(&bspatch_ctx, &oldstream, &newstream, patch + patch_offset, patch_chunk_sz);
 	    if (patch_result < 0) {
@@ -152,6 +205,9 @@ static int bspatch_f(char* oldf, char* newf, size_t newfs, char* patchf)
 	    }
 	    patch_remaining -= patch_chunk_sz;
     }
+    if (bspatch_finish(&bspatch_ctx, &newstream) != BSPATCH_SUCCESS) {
+        return -1;
+    }
 
     if (((fd = open(newf, O_CREAT | O_TRUNC | O_WRONLY, sb.st_mode)) < 0) || (write(fd, new, newfs) != newfs)
         || (close(fd) == -1)) {
@@ -164,6 +220,27 @@ static int bspatch_f(char* oldf, char* newf, size_t newfs, char* patchf)
     return 0;
 }
 
+static int bspatch_f(char* oldf, char* newf, size_t newfs, char* patchf)
+{
+    return bspatch_f_chunked(oldf, newf, newfs, patchf, 512, false);
+}
+
+static uint8_t* load_f(char* filename, int* size)
+{
+    int fd;
+    off_t fsize;
+    uint8_t* buf;
+
+    if (((fd = open(filename, O_RDONLY, 0)) < 0) || ((fsize = lseek(fd, 0, SEEK_END)) == -1)
+        || ((buf = malloc(fsize + 1)) == NULL) || (lseek(fd, 0, SEEK_SET) != 0) || (read(fd, buf, fsize) != fsize)
+        || (close(fd) == -1)) {
+        return NULL;
+    }
+
+    *size = fsize;
+    return buf;
+}
+
 static int cmp(char* filename1, char* filename2)
 {
     FILE* file1 = fopen(filename1, "rb");
@@ -217,6 +294,1398 @@ void test_bsdiff_same_file(void)
     TEST_ASSERT_EQUAL(0, cmp_result);
 }
 
+void test_bsdiff_bulk_chunks(void)
+{
+    /* create the patch from two sources that share their license header */
+    const int newsize = bsdiff_f("../bsdiff.c", "../bspatch.c", "build/test_patch.bin");
+    TEST_ASSERT_GREATER_THAN(1, newsize);
+    /* apply the patch in one large chunk, writing diff output into acquired spans */
+    int bspatch_result = bspatch_f_chunked("../bsdiff.c", "build/bspatch.c", newsize, "build/test_patch.bin", 65536, true);
+    TEST_ASSERT_EQUAL(0, bspatch_result);
+    TEST_ASSERT_EQUAL(0, cmp("../bspatch.c", "build/bspatch.c"));
+    /* same again without acquire(), only extra data takes the bulk path */
+    bspatch_result = bspatch_f_chunked("../bsdiff.c", "build/bspatch.c", newsize, "build/test_patch.bin", 65536, false);
+    TEST_ASSERT_EQUAL(0, bspatch_result);
+    TEST_ASSERT_EQUAL(0, cmp("../bspatch.c", "build/bspatch.c"));
+}
+
+/* Counts the control words read from an intermediate patch */
+static int ctrl_reads;
+
+static int _or_ctrl(const struct bspatch_stream_i* stream, void* buffer, int pos, int length)
+{
+    if (length == BSPATCH_CTRL_SIZE) {
+        ctrl_reads++;
+    }
+    return _or(stream, buffer, pos, length);
+}
+
+void test_bspatch_chain(void)
+{
+    /* v1 -> v2 -> v3, where all three share some data */
+    TEST_ASSERT_GREATER_THAN(1, bsdiff_f("main/test_bsdiff.c", "../bspatch.c", "build/chain_12.bin"));
+    TEST_ASSERT_GREATER_THAN(1, bsdiff_f("../bspatch.c", "../bsdiff.c", "build/chain_23.bin"));
+
+    int v1size, v3size, p12size, p23size;
+    uint8_t* v1 = load_f("main/test_bsdiff.c", &v1size);
+    uint8_t* v3 = load_f("../bsdiff.c", &v3size);
+    uint8_t* p12 = load_f("build/chain_12.bin", &p12size);
+    uint8_t* p23 = load_f("build/chain_23.bin", &p23size);
+    uint8_t* out = malloc(v3size);
+    TEST_ASSERT_NOT_NULL(v1);
+    TEST_ASSERT_NOT_NULL(v3);
+    TEST_ASSERT_NOT_NULL(p12);
+    TEST_ASSERT_NOT_NULL(p23);
+
+    struct OldCtx v1_ctx = { .old = v1, .oldsize = v1size };
+    struct OldCtx p12_ctx = { .old = p12, .oldsize = p12size };
+    struct NewCtx new_ctx = { .new = out, .pos_write = 0, .newsize = v3size };
+    struct bspatch_stream_i oldstream = { .opaque = &v1_ctx, .read = _or };
+    struct bspatch_stream_n newstream = { .opaque = &new_ctx, .write = _nw };
+    struct bspatch_chain_stage stage = { .patch = { .opaque = &p12_ctx, .read = _or_ctrl }, .patch_size = p12size };
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_chain_init(&stage, 1, &oldstream));
+
+    /* stream v2 -> v3 while v2 is resolved from v1 and the first patch */
+    struct bspatch_ctx ctx = {};
+    ctrl_reads = 0;
+    for (int off = 0; off < p23size; off += 100) {
+        TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch(&ctx, &stage.output, &newstream, p23 + off, min(100, p23size - off)));
+    }
+    TEST_ASSERT_EQUAL(v3size, new_ctx.pos_write);
+    TEST_ASSERT_EQUAL_MEMORY(v3, out, v3size);
+    /* backward seeks resume from a checkpoint rather than rereading from block 0 */
+    const int64_t blocks = bspatch_index(p12, p12size, NULL, 0);
+    TEST_ASSERT_GREATER_THAN(0, blocks);
+    TEST_ASSERT_LESS_THAN(blocks * 32, ctrl_reads);
+
+    free(out);
+    free(p23);
+    free(p12);
+    free(v3);
+    free(v1);
+}
+
+static int bspatch_verified(const uint8_t* old, int oldsize, uint8_t* new, int newsize, const uint8_t* patch,
+    int patchsize, struct bspatch_verify* verify, int chunk_sz)
+{
+    struct OldCtx old_ctx = { .old = (uint8_t*)old, .oldsize = oldsize };
+    struct NewCtx new_ctx = { .new = new, .pos_write = 0, .newsize = newsize };
+    struct bspatch_stream_i oldstream = { .opaque = &old_ctx, .read = _or };
+    struct bspatch_stream_n newstream = { BSPATCH_STREAM_INIT, .opaque = &new_ctx, .write = _nw, .acquire = _na };
+    struct bspatch_ctx ctx = {};
+
+    if (verify != NULL) {
+        bspatch_set_verify(&ctx, verify);
+    }
+    for (int off = 0; off < patchsize; off += chunk_sz) {
+        const int ret = bspatch(&ctx, &oldstream, &newstream, patch + off, min(chunk_sz, patchsize - off));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return bspatch_finish(&ctx, &newstream);
+}
+
+void test_bscompose(void)
+{
+    TEST_ASSERT_GREATER_THAN(1, bsdiff_f("main/test_bsdiff.c", "../bspatch.c", "build/chain_12.bin"));
+    const int newsize = bsdiff_f("../bspatch.c", "../bsdiff.c", "build/chain_23.bin");
+    TEST_ASSERT_GREATER_THAN(1, newsize);
+
+    int p12size, p23size;
+    uint8_t* p12 = load_f("build/chain_12.bin", &p12size);
+    uint8_t* p23 = load_f("build/chain_23.bin", &p23size);
+    TEST_ASSERT_NOT_NULL(p12);
+    TEST_ASSERT_NOT_NULL(p23);
+
+    /* v1 -> v3 from the two patches alone */
+    FILE* pf = fopen("build/chain_13.bin", "w");
+    TEST_ASSERT_NOT_NULL(pf);
+    struct bsdiff_stream stream = { .opaque = pf, .malloc = malloc, .free = free, .write = _w };
+    TEST_ASSERT_EQUAL(0, bscompose(p12, p12size, p23, p23size, &stream));
+    TEST_ASSERT_EQUAL(0, fclose(pf));
+
+    TEST_ASSERT_EQUAL(0, bspatch_f("main/test_bsdiff.c", "build/bsdiff.c", newsize, "build/chain_13.bin"));
+    TEST_ASSERT_EQUAL(0, cmp("../bsdiff.c", "build/bsdiff.c"));
+
+    /* a truncated patch is rejected before anything is written */
+    TEST_ASSERT_EQUAL(-1, bscompose(p12, p12size - 1, p23, p23size, &stream));
+
+    free(p23);
+    free(p12);
+
+    /* verified patches compose into a verified patch */
+    int v1size, v2size, v3size;
+    uint8_t* v1 = load_f("main/test_bsdiff.c", &v1size);
+    uint8_t* v2 = load_f("../bspatch.c", &v2size);
+    uint8_t* v3 = load_f("../bsdiff.c", &v3size);
+    TEST_ASSERT_NOT_NULL(v1);
+    TEST_ASSERT_NOT_NULL(v2);
+    TEST_ASSERT_NOT_NULL(v3);
+    struct MemCtx a = { 0 }, b = { 0 }, ab = { 0 };
+    struct bsdiff_options options = { .digest = 1, .precheck = 1 };
+    struct bsdiff_stream mstream = { .opaque = &a, .malloc = malloc, .free = free, .write = _mw };
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(v1, v1size, v2, v2size, &mstream, &options));
+    mstream.opaque = &b;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(v2, v2size, v3, v3size, &mstream, &options));
+    mstream.opaque = &ab;
+    TEST_ASSERT_EQUAL(0, bscompose(a.buf, a.size, b.buf, b.size, &mstream));
+
+    /* patch_a's precheck block comes first and still checks v1 */
+    struct bspatch_block blk = {};
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_block_decode(&blk, a.buf));
+    TEST_ASSERT_EQUAL(BSPATCH_OP_PRECHECK, blk.op);
+    TEST_ASSERT_EQUAL_MEMORY(a.buf, ab.buf, BSPATCH_CTRL_SIZE + blk.op_size);
+    struct OldCtx old_ctx = { .old = v1, .oldsize = v1size };
+    struct bspatch_stream_i oldstream = { .opaque = &old_ctx, .read = _or };
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_precheck(ab.buf, ab.size, &oldstream));
+
+    /* it ends with patch_b's new digest, the old digest is not recorded */
+    const uint8_t* tail = ab.buf + ab.size - BSPATCH_DIGEST_BLOCK_SIZE;
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_block_decode(&blk, tail - BSPATCH_CTRL_SIZE));
+    TEST_ASSERT_EQUAL(BSPATCH_OP_DIGEST, blk.op);
+    TEST_ASSERT_EQUAL_MEMORY(b.buf + b.size - BSPATCH_DIGEST_SIZE, tail + BSPATCH_DIGEST_SIZE, BSPATCH_DIGEST_SIZE);
+    const uint8_t unrecorded[BSPATCH_DIGEST_SIZE] = { 0 };
+    TEST_ASSERT_EQUAL_MEMORY(unrecorded, tail, BSPATCH_DIGEST_SIZE);
+
+    uint8_t* out = malloc(v3size);
+    struct bspatch_verify verify = {};
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_verified(v1, v1size, out, v3size, ab.buf, ab.size, &verify, 100));
+    TEST_ASSERT_EQUAL_MEMORY(v3, out, v3size);
+    TEST_ASSERT_EQUAL(BSPATCH_VERIFY_NEW, verify.expect);
+
+    /* the new digest is checked */
+    ab.buf[ab.size - 1] ^= 1;
+    memset(&verify, 0, sizeof(verify));
+    TEST_ASSERT_EQUAL(BSPATCH_DIGEST_MISMATCH,
+        bspatch_verified(v1, v1size, out, v3size, ab.buf, ab.size, &verify, 100));
+
+    free(out);
+    free(ab.buf);
+    free(b.buf);
+    free(a.buf);
+    free(v3);
+    free(v2);
+    free(v1);
+}
+
+/* Fake Thumb code: calls from the second half into functions in the first half */
+static int thumb_image(uint8_t* buf, int shift)
+{
+    int len = 0;
+    srand(1234);
+    for (int i = 0; i < 2048; i++) {
+        if (i == 1024) {
+            /* code inserted in the new version pushes the callers further away */
+            for (int k = 0; k < shift; k += 2) {
+                buf[len++] = 0x00;
+                buf[len++] = 0xbf;
+            }
+        }
+        if (i > 1024 && i % 4 == 0) {
+            const uint32_t target = (rand() % 64) * 16;
+            const uint32_t off = (target - (len + 4)) >> 1;
+            buf[len++] = off >> 11;
+            buf[len++] = 0xF0 | ((off >> 19) & 7);
+            buf[len++] = off;
+            buf[len++] = 0xF8 | ((off >> 8) & 7);
+        } else {
+            buf[len++] = rand() % 0x70;
+            buf[len++] = rand() % 0x70;
+        }
+    }
+    return len;
+}
+
+static int nonzero(const uint8_t* buf, int size)
+{
+    int count = 0;
+    for (int i = 0; i < size; i++) {
+        count += buf[i] != 0;
+    }
+    return count;
+}
+
+static int bspatch_filtered(const uint8_t* old, int oldsize, uint8_t* new, int newsize, const uint8_t* patch,
+    int patchsize, int filter, int chunk_sz)
+{
+    struct OldCtx old_ctx = { .old = (uint8_t*)old, .oldsize = oldsize };
+    struct NewCtx new_ctx = { .new = new, .pos_write = 0, .newsize = newsize };
+    struct bspatch_stream_i oldstream = { .opaque = &old_ctx, .read = _or };
+    struct bspatch_stream_n newstream = { .opaque = &new_ctx, .write = _nw };
+    struct bspatch_ctx ctx = {};
+
+    if (bspatch_set_filter(&ctx, filter, oldsize) != BSPATCH_SUCCESS) {
+        return -1;
+    }
+    for (int off = 0; off < patchsize; off += chunk_sz) {
+        const int ret = bspatch(&ctx, &oldstream, &newstream, patch + off, min(chunk_sz, patchsize - off));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (bspatch_finish(&ctx, &newstream) != BSPATCH_SUCCESS) {
+        return -1;
+    }
+    return new_ctx.pos_write == newsize ? 0 : -1;
+}
+
+void test_bsdiff_branch_filter(void)
+{
+    static uint8_t old[8192], new[8192], out[8192];
+    const int oldsize = thumb_image(old, 0);
+    const int newsize = thumb_image(new, 96);
+
+    struct MemCtx plain = { 0 }, filtered = { 0 };
+    struct bsdiff_stream stream = { .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .filter = BSFILTER_ARMTHUMB };
+
+    stream.opaque = &plain;
+    TEST_ASSERT_EQUAL(0, bsdiff(old, oldsize, new, newsize, &stream));
+    stream.opaque = &filtered;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+
+    /* moved calls no longer show up as diff noise, which is what compresses away */
+    TEST_ASSERT_EQUAL(plain.size + BSPATCH_CTRL_SIZE, filtered.size);
+    TEST_ASSERT_LESS_THAN(nonzero(plain.buf, plain.size) / 4, nonzero(filtered.buf, filtered.size));
+
+    /* odd chunk sizes split instructions across old reads and new writes */
+    const int chunks[] = { 1, 7, 4096 };
+    for (int i = 0; i < 3; i++) {
+        memset(out, 0, sizeof(out));
+        TEST_ASSERT_EQUAL(
+            0, bspatch_filtered(old, oldsize, out, newsize, filtered.buf, filtered.size, BSFILTER_ARMTHUMB, chunks[i]));
+        TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+    }
+
+    /* the ARM filter round trips on the same data too */
+    free(filtered.buf);
+    filtered.buf = NULL;
+    filtered.size = 0;
+    options.filter = BSFILTER_ARM;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+    TEST_ASSERT_EQUAL(0, bspatch_filtered(old, oldsize, out, newsize, filtered.buf, filtered.size, BSFILTER_ARM, 7));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+
+    /* the filter block refuses any other filter, and a plain patch refuses one */
+    memset(out, 0, sizeof(out));
+    TEST_ASSERT_EQUAL(BSPATCH_FILTER_MISMATCH,
+        bspatch_filtered(old, oldsize, out, newsize, filtered.buf, filtered.size, BSFILTER_NONE, 4096));
+    TEST_ASSERT_EQUAL(BSPATCH_FILTER_MISMATCH,
+        bspatch_filtered(old, oldsize, out, newsize, filtered.buf, filtered.size, BSFILTER_ARMTHUMB, 1));
+    TEST_ASSERT_EQUAL(BSPATCH_FILTER_MISMATCH,
+        bspatch_filtered(old, oldsize, out, newsize, plain.buf, plain.size, BSFILTER_ARM, 4096));
+    TEST_ASSERT_EQUAL(0, nonzero(out, newsize));
+
+    /* composing needs both patches in the same filtered space */
+    struct MemCtx composed = { 0 };
+    TEST_ASSERT_EQUAL(BSFILTER_ARM, bspatch_patch_filter(filtered.buf, filtered.size));
+    TEST_ASSERT_EQUAL(BSFILTER_NONE, bspatch_patch_filter(plain.buf, plain.size));
+    stream.opaque = &composed;
+    TEST_ASSERT_EQUAL(-1, bscompose(filtered.buf, filtered.size, plain.buf, plain.size, &stream));
+    TEST_ASSERT_EQUAL(0, bscompose(filtered.buf, filtered.size, filtered.buf, filtered.size, &stream));
+    TEST_ASSERT_EQUAL(BSFILTER_ARM, bspatch_patch_filter(composed.buf, composed.size));
+    free(composed.buf);
+
+    free(filtered.buf);
+    free(plain.buf);
+}
+
+void test_bspatch_index(void)
+{
+    const int newsize = bsdiff_f("../bsdiff.c", "../bspatch.c", "build/test_patch.bin");
+    TEST_ASSERT_GREATER_THAN(1, newsize);
+
+    int patchsize;
+    uint8_t* patch = load_f("build/test_patch.bin", &patchsize);
+    TEST_ASSERT_NOT_NULL(patch);
+
+    const int64_t count = bspatch_index(patch, patchsize, NULL, 0);
+    TEST_ASSERT_GREATER_THAN(0, count);
+    struct bspatch_block* blocks = calloc(count, sizeof(*blocks));
+    TEST_ASSERT_EQUAL(count, bspatch_index(patch, patchsize, blocks, count));
+
+    /* blocks tile the new image back to back */
+    int64_t new_offset = 0;
+    for (int64_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL(new_offset, blocks[i].new_offset);
+        new_offset += blocks[i].ctrl[0] + blocks[i].ctrl[1];
+    }
+    TEST_ASSERT_EQUAL(newsize, new_offset);
+
+    /* a truncated patch is rejected */
+    TEST_ASSERT_EQUAL(BSPATCH_ERROR, bspatch_index(patch, patchsize - 1, NULL, 0));
+
+    free(blocks);
+    free(patch);
+}
+
+static int stall;
+
+/* Callbacks that would block on every fourth call, retried reads get through */
+static int _or_stall(const struct bspatch_stream_i* stream, void* buffer, int pos, int length)
+{
+    if (stall++ % 4 == 0) {
+        return BSPATCH_WOULD_BLOCK;
+    }
+    return _or(stream, buffer, pos, length);
+}
+
+static int _nw_stall(const struct bspatch_stream_n* stream, const void* buffer, int length)
+{
+    if (stall++ % 4 == 0) {
+        return BSPATCH_WOULD_BLOCK;
+    }
+    return _nw(stream, buffer, length);
+}
+
+static int bspatch_stalling(const uint8_t* old, int oldsize, uint8_t* new, int newsize, const uint8_t* patch,
+    int patchsize, int filter, bool use_acquire)
+{
+    struct OldCtx old_ctx = { .old = (uint8_t*)old, .oldsize = oldsize };
+    struct NewCtx new_ctx = { .new = new, .pos_write = 0, .newsize = newsize };
+    struct bspatch_stream_i oldstream = { .opaque = &old_ctx, .read = _or_stall };
+    struct bspatch_stream_n newstream = { BSPATCH_STREAM_INIT, .opaque = &new_ctx, .write = _nw_stall, .acquire = use_acquire ? _na : NULL };
+    struct bspatch_ctx ctx = {};
+    int ret, off = 0;
+
+    if (bspatch_set_filter(&ctx, filter, oldsize) != BSPATCH_SUCCESS) {
+        return -1;
+    }
+    /* resume from wherever the last call stopped, until the whole patch went through */
+    do {
+        ret = bspatch(&ctx, &oldstream, &newstream, patch + off, patchsize - off);
+        off += ctx.consumed;
+    } while (ret == BSPATCH_WOULD_BLOCK);
+    if (ret != BSPATCH_SUCCESS || off != patchsize) {
+        return -1;
+    }
+    while ((ret = bspatch_finish(&ctx, &newstream)) == BSPATCH_WOULD_BLOCK) { }
+    if (ret != BSPATCH_SUCCESS) {
+        return -1;
+    }
+    return new_ctx.pos_write == newsize ? 0 : -1;
+}
+
+void test_bspatch_would_block(void)
+{
+    static uint8_t old[8192], new[8192], out[8192];
+    const int oldsize = thumb_image(old, 0);
+    const int newsize = thumb_image(new, 96);
+
+    struct MemCtx plain = { 0 }, filtered = { 0 };
+    struct bsdiff_stream stream = { .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .filter = BSFILTER_ARMTHUMB };
+
+    stream.opaque = &plain;
+    TEST_ASSERT_EQUAL(0, bsdiff(old, oldsize, new, newsize, &stream));
+    stream.opaque = &filtered;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+
+    /* staged, bulk and filtered paths all pick up where they stopped */
+    stall = 0;
+    TEST_ASSERT_EQUAL(0, bspatch_stalling(old, oldsize, out, newsize, plain.buf, plain.size, BSFILTER_NONE, false));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+    memset(out, 0, sizeof(out));
+    TEST_ASSERT_EQUAL(0, bspatch_stalling(old, oldsize, out, newsize, plain.buf, plain.size, BSFILTER_NONE, true));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+    memset(out, 0, sizeof(out));
+    TEST_ASSERT_EQUAL(
+        0, bspatch_stalling(old, oldsize, out, newsize, filtered.buf, filtered.size, BSFILTER_ARMTHUMB, false));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+
+    free(filtered.buf);
+    free(plain.buf);
+}
+
+/* Pipeline driver that only completes writes when bspatch has to wait for a buffer */
+struct DeferredCtx {
+    struct bspatch_pipeline pipe;
+    const void* queue[4];
+    int queue_len[4];
+    int queued;
+    int max_queued;
+    struct MemCtx out;
+};
+
+static int _deferred_submit(struct bspatch_pipeline* pipe, const void* buffer, int length)
+{
+    struct DeferredCtx* d = (struct DeferredCtx*)pipe->opaque;
+    d->queue[d->queued] = buffer;
+    d->queue_len[d->queued] = length;
+    d->queued++;
+    d->max_queued = d->queued > d->max_queued ? d->queued : d->max_queued;
+    return 0;
+}
+
+static int _deferred_wait(struct bspatch_pipeline* pipe)
+{
+    struct DeferredCtx* d = (struct DeferredCtx*)pipe->opaque;
+    struct bsdiff_stream stream = { .opaque = &d->out };
+    const int result = _mw(&stream, d->queue[0], d->queue_len[0]);
+    d->queued--;
+    memmove(&d->queue[0], &d->queue[1], d->queued * sizeof(d->queue[0]));
+    memmove(&d->queue_len[0], &d->queue_len[1], d->queued * sizeof(d->queue_len[0]));
+    bspatch_pipeline_complete(pipe, result);
+    return 0;
+}
+
+void test_bspatch_pipeline(void)
+{
+    const int newsize = bsdiff_f("../bsdiff.c", "../bspatch.c", "build/test_patch.bin");
+    TEST_ASSERT_GREATER_THAN(1, newsize);
+
+    int oldsize, patchsize, expectsize;
+    uint8_t* old = load_f("../bsdiff.c", &oldsize);
+    uint8_t* patch = load_f("build/test_patch.bin", &patchsize);
+    uint8_t* expect = load_f("../bspatch.c", &expectsize);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(patch);
+    TEST_ASSERT_NOT_NULL(expect);
+
+    static uint8_t buffers[3][1000];
+    struct DeferredCtx d = { .pipe = { .opaque = &d, .submit = _deferred_submit, .wait = _deferred_wait } };
+    struct OldCtx old_ctx = { .old = old, .oldsize = oldsize };
+    struct bspatch_stream_i oldstream = { .opaque = &old_ctx, .read = _or };
+    struct bspatch_stream_n newstream;
+    struct bspatch_ctx ctx = {};
+
+    TEST_ASSERT_EQUAL(BSPATCH_ERROR, bspatch_pipeline_init(&d.pipe, buffers[0], sizeof(buffers[0]), 1, &newstream));
+    TEST_ASSERT_EQUAL(
+        BSPATCH_SUCCESS, bspatch_pipeline_init(&d.pipe, buffers[0], sizeof(buffers[0]), 3, &newstream));
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch(&ctx, &oldstream, &newstream, patch, patchsize));
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_finish(&ctx, &newstream));
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_pipeline_flush(&d.pipe));
+
+    /* decoding went on until every buffer was in flight */
+    TEST_ASSERT_EQUAL(3, d.max_queued);
+    TEST_ASSERT_EQUAL(0, d.queued);
+    TEST_ASSERT_EQUAL(expectsize, d.out.size);
+    TEST_ASSERT_EQUAL_MEMORY(expect, d.out.buf, expectsize);
+
+    free(d.out.buf);
+    free(expect);
+    free(patch);
+    free(old);
+}
+
+/* A sparse old image of several GB, generated from the position */
+static uint8_t _big_byte(int64_t pos)
+{
+    return (uint8_t)(pos * 7 + (pos >> 32));
+}
+
+static int _or_big(const struct bspatch_stream_i* stream, void* buffer, int64_t pos, int length)
+{
+    if (pos < 0 || pos + length > *(int64_t*)stream->opaque) {
+        return -1;
+    }
+    for (int i = 0; i < length; i++) {
+        ((uint8_t*)buffer)[i] = _big_byte(pos + i);
+    }
+    return 0;
+}
+
+static void _offtout(int64_t x, uint8_t* buf)
+{
+    uint64_t y = x < 0 ? -x : x;
+    for (int i = 0; i < 8; i++, y >>= 8) {
+        buf[i] = y & 0xff;
+    }
+    if (x < 0) {
+        buf[7] |= 0x80;
+    }
+}
+
+void test_bspatch_verify(void)
+{
+    int oldsize, newsize;
+    uint8_t* old = load_f("../bsdiff.c", &oldsize);
+    uint8_t* new = load_f("../bspatch.c", &newsize);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(new);
+    uint8_t* out = malloc(newsize);
+    uint8_t* bad = malloc(oldsize);
+
+    struct MemCtx plain = { 0 }, digested = { 0 };
+    struct bsdiff_stream stream = { .opaque = &plain, .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .digest = 1 };
+    TEST_ASSERT_EQUAL(0, bsdiff(old, oldsize, new, newsize, &stream));
+    stream.opaque = &digested;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+
+    /* the digest block is appended after the unchanged blocks */
+    TEST_ASSERT_EQUAL(plain.size + BSPATCH_CTRL_SIZE + BSPATCH_DIGEST_BLOCK_SIZE, digested.size);
+    TEST_ASSERT_EQUAL_MEMORY(plain.buf, digested.buf, plain.size);
+
+    uint8_t expected[BSSHA256_SIZE];
+    struct bssha256 sha;
+    bssha256_init(&sha);
+    bssha256_update(&sha, new, newsize);
+    bssha256_final(&sha, expected);
+
+    /* staged and bulk paths alike hash exactly what was written */
+    const int chunks[] = { 7, 100, 65536 };
+    for (int i = 0; i < 3; i++) {
+        struct bspatch_verify verify = {};
+        memset(out, 0, newsize);
+        TEST_ASSERT_EQUAL(BSPATCH_SUCCESS,
+            bspatch_verified(old, oldsize, out, newsize, digested.buf, digested.size, &verify, chunks[i]));
+        TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+        TEST_ASSERT_EQUAL(BSPATCH_VERIFY_OLD | BSPATCH_VERIFY_NEW, verify.expect);
+        TEST_ASSERT_EQUAL_MEMORY(expected, verify.new_computed, BSSHA256_SIZE);
+    }
+
+    /* without verification the digest block is skipped */
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS,
+        bspatch_verified(old, oldsize, out, newsize, digested.buf, digested.size, NULL, 100));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+
+    /* an old image that differs where the patch reads it fails the check */
+    memcpy(bad, old, oldsize);
+    for (int i = 0; i < oldsize; i += 512) {
+        bad[i] ^= 1;
+    }
+    struct bspatch_verify verify = {};
+    TEST_ASSERT_EQUAL(BSPATCH_DIGEST_MISMATCH,
+        bspatch_verified(bad, oldsize, out, newsize, digested.buf, digested.size, &verify, 100));
+
+    /* digests supplied by the caller take precedence, and work without a digest block */
+    memset(&verify, 0, sizeof(verify));
+    memcpy(verify.new_digest, expected, BSSHA256_SIZE);
+    verify.new_digest[0] ^= 1;
+    verify.expect = BSPATCH_VERIFY_NEW;
+    TEST_ASSERT_EQUAL(BSPATCH_DIGEST_MISMATCH,
+        bspatch_verified(old, oldsize, out, newsize, digested.buf, digested.size, &verify, 100));
+    memset(&verify, 0, sizeof(verify));
+    memcpy(verify.new_digest, expected, BSSHA256_SIZE);
+    verify.expect = BSPATCH_VERIFY_NEW;
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS,
+        bspatch_verified(old, oldsize, out, newsize, plain.buf, plain.size, &verify, 100));
+    TEST_ASSERT_EQUAL(BSPATCH_VERIFY_NEW, verify.expect);
+
+    /* the index skips the digest block like an empty block */
+    TEST_ASSERT_EQUAL(bspatch_index(plain.buf, plain.size, NULL, 0),
+        bspatch_index(digested.buf, digested.size, NULL, 0));
+
+    free(digested.buf);
+    free(plain.buf);
+    free(bad);
+    free(out);
+    free(new);
+    free(old);
+}
+
+void test_bspatch_precheck(void)
+{
+    int oldsize, newsize;
+    uint8_t* old = load_f("../bsdiff.c", &oldsize);
+    uint8_t* new = load_f("../bspatch.c", &newsize);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(new);
+
+    /* old with a long stretch that new does not reuse */
+    const int bigsize = oldsize + 65536;
+    uint8_t* big = malloc(bigsize);
+    uint8_t* out = malloc(newsize);
+    memcpy(big, old, oldsize);
+    srand(3);
+    for (int i = oldsize; i < bigsize; i++) {
+        big[i] = rand();
+    }
+
+    struct MemCtx plain = { 0 }, checked = { 0 };
+    struct bsdiff_stream stream = { .opaque = &plain, .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .precheck = 1, .digest = 1 };
+    TEST_ASSERT_EQUAL(0, bsdiff(big, bigsize, new, newsize, &stream));
+    stream.opaque = &checked;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(big, bigsize, new, newsize, &stream, &options));
+
+    struct OldCtx old_ctx = { .old = big, .oldsize = bigsize };
+    struct bspatch_stream_i oldstream = { .opaque = &old_ctx, .read = _or };
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_precheck(checked.buf, checked.size, &oldstream));
+
+    /* the ranges only cover what the patch reads */
+    struct bspatch_block blk = {};
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_block_decode(&blk, checked.buf));
+    TEST_ASSERT_EQUAL(BSPATCH_OP_PRECHECK, blk.op);
+    int64_t covered = 0;
+    const int64_t count = (blk.op_size - 8 - BSPATCH_DIGEST_SIZE) / 16;
+    for (int64_t i = 0; i < count; i++) {
+        uint8_t* range = checked.buf + BSPATCH_CTRL_SIZE + 8 + 16 * i;
+        covered += range[8] | range[9] << 8 | range[10] << 16;
+    }
+    TEST_ASSERT_GREATER_THAN(0, covered);
+    TEST_ASSERT_LESS_OR_EQUAL(oldsize, covered);
+
+    /* bytes the patch never reads may change, bytes it reads may not */
+    big[bigsize - 1] ^= 1;
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_precheck(checked.buf, checked.size, &oldstream));
+    big[bigsize - 1] ^= 1;
+    uint8_t* first = checked.buf + BSPATCH_CTRL_SIZE + 8;
+    const int64_t first_pos = first[0] | first[1] << 8 | first[2] << 16;
+    big[first_pos] ^= 1;
+    TEST_ASSERT_EQUAL(BSPATCH_DIGEST_MISMATCH, bspatch_precheck(checked.buf, checked.size, &oldstream));
+    big[first_pos] ^= 1;
+
+    /* a truncated block or a patch without one is not checked */
+    TEST_ASSERT_EQUAL(BSPATCH_ERROR, bspatch_precheck(checked.buf, BSPATCH_CTRL_SIZE + blk.op_size - 1, &oldstream));
+    TEST_ASSERT_EQUAL(BSPATCH_ERROR, bspatch_precheck(plain.buf, plain.size, &oldstream));
+
+    /* bspatch skips the block, the rest of the patch is unchanged */
+    TEST_ASSERT_EQUAL_MEMORY(plain.buf, checked.buf + BSPATCH_CTRL_SIZE + blk.op_size, plain.size);
+    struct bspatch_verify verify = {};
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS,
+        bspatch_verified(big, bigsize, out, newsize, checked.buf, checked.size, &verify, 7));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+    TEST_ASSERT_EQUAL(bspatch_index(plain.buf, plain.size, NULL, 0),
+        bspatch_index(checked.buf, checked.size, NULL, 0));
+
+    free(checked.buf);
+    free(plain.buf);
+    free(out);
+    free(big);
+    free(new);
+    free(old);
+}
+
+/* Fills of erased flash are skipped, new->new starts out erased */
+static int64_t fill_skipped;
+
+static int _nf(const struct bspatch_stream_n* stream, uint8_t byte, int length)
+{
+    struct NewCtx* new = (struct NewCtx*)stream->opaque;
+    if (new->pos_write + length > new->newsize) {
+        return -1;
+    }
+    if (byte == 0xff) {
+        fill_skipped += length;
+    } else {
+        memset(new->new + new->pos_write, byte, length);
+    }
+    new->pos_write += length;
+    return length;
+}
+
+/* Source text with runs of padding after every stretch of it */
+static int padded_image(uint8_t* buf, const uint8_t* text, int textsize, int pad)
+{
+    int size = 0;
+    for (int i = 0; i < textsize; i += 4096) {
+        const int n = min(4096, textsize - i);
+        memcpy(buf + size, text + i, n);
+        size += n;
+        memset(buf + size, 0xff, pad);
+        size += pad;
+        memset(buf + size, 0x00, pad / 4);
+        size += pad / 4;
+    }
+    return size;
+}
+
+void test_bsdiff_fill(void)
+{
+    int oldtextsize, newtextsize;
+    uint8_t* oldtext = load_f("../bsdiff.c", &oldtextsize);
+    uint8_t* newtext = load_f("../bspatch.c", &newtextsize);
+    TEST_ASSERT_NOT_NULL(oldtext);
+    TEST_ASSERT_NOT_NULL(newtext);
+    uint8_t* old = malloc(oldtextsize * 2);
+    uint8_t* new = malloc(newtextsize * 3);
+    const int oldsize = padded_image(old, oldtext, oldtextsize, 1000);
+    const int newsize = padded_image(new, newtext, newtextsize, 3000);
+    uint8_t* out = malloc(newsize);
+
+    struct MemCtx plain = { 0 }, filled = { 0 };
+    struct bsdiff_stream stream = { .opaque = &plain, .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .fill = 1, .digest = 1, .precheck = 1 };
+    TEST_ASSERT_EQUAL(0, bsdiff(old, oldsize, new, newsize, &stream));
+    stream.opaque = &filled;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+    TEST_ASSERT_LESS_THAN(plain.size, filled.size);
+
+    /* the index sees fills as blocks of extra bytes that are not in the patch */
+    const int64_t count = bspatch_index(filled.buf, filled.size, NULL, 0);
+    struct bspatch_block* blocks = malloc(count * sizeof(*blocks));
+    TEST_ASSERT_EQUAL(count, bspatch_index(filled.buf, filled.size, blocks, count));
+    int64_t fills = 0;
+    for (int64_t i = 0; i < count; i++) {
+        if (blocks[i].op == BSPATCH_OP_FILL) {
+            TEST_ASSERT_GREATER_OR_EQUAL(BSDIFF_FILL_MIN, blocks[i].ctrl[1]);
+            fills++;
+        }
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(2 * (newtextsize / 4096), fills);
+    TEST_ASSERT_EQUAL(newsize, blocks[count - 1].new_offset + blocks[count - 1].ctrl[1]);
+
+    /* fills that end a chunk are written without more patch bytes */
+    const int chunks[] = { 1, 24, 65536 };
+    for (int i = 0; i < 3; i++) {
+        struct bspatch_verify verify = {};
+        memset(out, 0, newsize);
+        TEST_ASSERT_EQUAL(BSPATCH_SUCCESS,
+            bspatch_verified(old, oldsize, out, newsize, filled.buf, filled.size, &verify, chunks[i]));
+        TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+    }
+
+    /* a writer with fill() skips what is already erased */
+    struct OldCtx old_ctx = { .old = old, .oldsize = oldsize };
+    struct NewCtx new_ctx = { .new = out, .pos_write = 0, .newsize = newsize };
+    struct bspatch_stream_i oldstream = { .opaque = &old_ctx, .read = _or };
+    struct bspatch_stream_n newstream = { BSPATCH_STREAM_INIT, .opaque = &new_ctx, .write = _nw, .fill = _nf };
+    struct bspatch_verify verify = {};
+    struct bspatch_ctx ctx = {};
+    memset(out, 0xff, newsize);
+    fill_skipped = 0;
+    bspatch_set_verify(&ctx, &verify);
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch(&ctx, &oldstream, &newstream, filled.buf, filled.size));
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_finish(&ctx, &newstream));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+    TEST_ASSERT_GREATER_OR_EQUAL(3000 * (newtextsize / 4096), fill_skipped);
+
+    free(blocks);
+    free(filled.buf);
+    free(plain.buf);
+    free(out);
+    free(new);
+    free(old);
+    free(newtext);
+    free(oldtext);
+}
+
+void test_bsinspect(void)
+{
+    int oldtextsize, newtextsize;
+    uint8_t* oldtext = load_f("../bsdiff.c", &oldtextsize);
+    uint8_t* newtext = load_f("../bspatch.c", &newtextsize);
+    TEST_ASSERT_NOT_NULL(oldtext);
+    TEST_ASSERT_NOT_NULL(newtext);
+    uint8_t* old = malloc(oldtextsize * 2);
+    uint8_t* new = malloc(newtextsize * 3);
+    const int oldsize = padded_image(old, oldtext, oldtextsize, 1000);
+    const int newsize = padded_image(new, newtext, newtextsize, 3000);
+
+    struct MemCtx patch = { 0 };
+    struct bsdiff_stream stream = { .opaque = &patch, .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .fill = 1, .digest = 1 };
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+
+    struct bsinspect_flash flash = BSINSPECT_FLASH_DEFAULT;
+    struct bsinspect stats;
+    TEST_ASSERT_EQUAL(0, bsinspect(patch.buf, patch.size, &flash, &stats));
+
+    /* every new byte is a diff, extra or fill byte */
+    TEST_ASSERT_EQUAL(newsize, stats.new_size);
+    TEST_ASSERT_EQUAL(newsize, stats.diff_bytes + stats.extra_bytes + stats.fill_bytes);
+    TEST_ASSERT_EQUAL(1, stats.op_blocks);
+    TEST_ASSERT_EQUAL(BSPATCH_DIGEST_BLOCK_SIZE, stats.op_bytes);
+    TEST_ASSERT_EQUAL(bspatch_index(patch.buf, patch.size, NULL, 0),
+        stats.blocks - stats.empty_blocks - stats.op_blocks);
+    TEST_ASSERT_LESS_OR_EQUAL(stats.diff_bytes, stats.zero_diff_bytes);
+    TEST_ASSERT_LESS_OR_EQUAL(stats.fill_bytes, stats.erased_fill_bytes);
+    int64_t seeks = 0;
+    for (int i = 0; i < BSINSPECT_SEEK_BUCKETS; i++) {
+        seeks += stats.seeks[i];
+    }
+    TEST_ASSERT_EQUAL(stats.blocks - stats.fill_blocks - stats.op_blocks, seeks);
+
+    /* the projection scales with the flash, and skipping erased fills programs fewer pages */
+    const double read_us = stats.read_us, program_us = stats.program_us;
+    TEST_ASSERT_EQUAL((newsize + 255) / 256, stats.page_programs);
+    flash.page_program_us *= 2;
+    TEST_ASSERT_EQUAL(0, bsinspect(patch.buf, patch.size, &flash, &stats));
+    TEST_ASSERT_TRUE(stats.read_us == read_us && stats.program_us == 2 * program_us);
+    flash.skip_erased = 1;
+    TEST_ASSERT_EQUAL(0, bsinspect(patch.buf, patch.size, &flash, &stats));
+    TEST_ASSERT_LESS_THAN((newsize + 255) / 256, stats.page_programs);
+
+    /* a truncated patch is rejected */
+    TEST_ASSERT_EQUAL(-1, bsinspect(patch.buf, patch.size - 1, &flash, &stats));
+
+    free(patch.buf);
+    free(new);
+    free(old);
+    free(newtext);
+    free(oldtext);
+}
+
+void test_bspatch_64bit_offsets(void)
+{
+    int64_t oldsize = 6LL << 30;
+    const int64_t seek = 5LL << 30;
+    uint8_t patch[2 * BSPATCH_CTRL_SIZE + 16 + 16 + 4];
+    uint8_t expect[36], out[36];
+
+    /* 16 bytes from the start of old, then 16 bytes past 5 GB and 4 literals */
+    uint8_t* p = patch;
+    _offtout(16, p);
+    _offtout(0, p + 8);
+    _offtout(seek, p + 16);
+    p += BSPATCH_CTRL_SIZE;
+    memset(p, 1, 16);
+    p += 16;
+    _offtout(16, p);
+    _offtout(4, p + 8);
+    _offtout(0, p + 16);
+    p += BSPATCH_CTRL_SIZE;
+    memset(p, 2, 16);
+    memcpy(p + 16, "done", 4);
+
+    for (int i = 0; i < 16; i++) {
+        expect[i] = _big_byte(i) + 1;
+        expect[16 + i] = _big_byte(16 + seek + i) + 2;
+    }
+    memcpy(expect + 32, "done", 4);
+
+    struct NewCtx new_ctx = { .new = out, .pos_write = 0, .newsize = sizeof(out) };
+    struct bspatch_stream_i oldstream = { BSPATCH_STREAM_INIT, .opaque = &oldsize, .read64 = _or_big };
+    struct bspatch_stream_n newstream = { .opaque = &new_ctx, .write = _nw };
+    struct bspatch_ctx ctx = {};
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch(&ctx, &oldstream, &newstream, patch, sizeof(patch)));
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bspatch_finish(&ctx, &newstream));
+    TEST_ASSERT_EQUAL(sizeof(out), new_ctx.pos_write);
+    TEST_ASSERT_EQUAL_MEMORY(expect, out, sizeof(out));
+
+    /* a stream with only the int read() cannot get there */
+    struct OldCtx old_ctx = { .old = expect, .oldsize = sizeof(expect) };
+    struct bspatch_stream_i smallstream = { .opaque = &old_ctx, .read = _or };
+    struct bspatch_ctx ctx2 = {};
+    new_ctx.pos_write = 0;
+    TEST_ASSERT_EQUAL(BSPATCH_ERROR, bspatch(&ctx2, &smallstream, &newstream, patch, sizeof(patch)));
+}
+
+void test_bsdiff_speed_levels(void)
+{
+    int oldsize, srcsize;
+    uint8_t* old = load_f("../bsdiff.c", &oldsize);
+    uint8_t* src = load_f("../bspatch.c", &srcsize);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(src);
+
+    /* new data with a long unmatched run in the middle */
+    const int noise = 4096;
+    const int newsize = srcsize + noise;
+    uint8_t* new = malloc(newsize);
+    uint8_t* out = malloc(newsize);
+    memcpy(new, src, srcsize / 2);
+    srand(1);
+    for (int i = 0; i < noise; i++) {
+        new[srcsize / 2 + i] = rand();
+    }
+    memcpy(new + srcsize / 2 + noise, src + srcsize / 2, srcsize - srcsize / 2);
+
+    struct MemCtx exact = { 0 };
+    struct bsdiff_stream stream = { .opaque = &exact, .malloc = malloc, .free = free, .write = _mw };
+    TEST_ASSERT_EQUAL(0, bsdiff(old, oldsize, new, newsize, &stream));
+
+    for (int speed = 0; speed <= BSDIFF_SPEED_MAX; speed++) {
+        struct MemCtx fast = { 0 };
+        struct bsdiff_options options = { .speed = speed };
+        stream.opaque = &fast;
+        TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+        if (speed == 0) {
+            TEST_ASSERT_EQUAL(exact.size, fast.size);
+            TEST_ASSERT_EQUAL_MEMORY(exact.buf, fast.buf, exact.size);
+        }
+        TEST_ASSERT_LESS_THAN(exact.size + exact.size / 20, fast.size);
+
+        memset(out, 0, newsize);
+        TEST_ASSERT_EQUAL(0, bspatch_filtered(old, oldsize, out, newsize, fast.buf, fast.size, BSFILTER_NONE, 4096));
+        TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+        free(fast.buf);
+    }
+
+    free(exact.buf);
+    free(out);
+    free(new);
+    free(src);
+    free(old);
+}
+
+void test_bsdiff_optimal(void)
+{
+    int oldsize, newsize;
+    uint8_t* old = load_f("../bsdiff.c", &oldsize);
+    uint8_t* new = load_f("../bspatch.c", &newsize);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(new);
+    uint8_t* out = malloc(newsize);
+
+    struct MemCtx greedy = { 0 }, optimal = { 0 }, checked = { 0 };
+    struct bsdiff_stream stream = { .opaque = &greedy, .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .optimal = 1 };
+    TEST_ASSERT_EQUAL(0, bsdiff(old, oldsize, new, newsize, &stream));
+    stream.opaque = &optimal;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+    TEST_ASSERT_LESS_THAN(greedy.size, optimal.size);
+
+    memset(out, 0, newsize);
+    TEST_ASSERT_EQUAL(0, bspatch_filtered(old, oldsize, out, newsize, optimal.buf, optimal.size, BSFILTER_NONE, 4096));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+
+    /* a kept context lends its sort scratch to the LCP build, with the same result */
+    struct bsdiff_ctx ctx = { 0 };
+    struct MemCtx reused = { 0 };
+    stream.opaque = &reused;
+    TEST_ASSERT_EQUAL(0, bsdiff_ctx_diff(&ctx, old, oldsize, new, newsize, &stream, &options));
+    TEST_ASSERT_EQUAL(optimal.size, reused.size);
+    TEST_ASSERT_EQUAL_MEMORY(optimal.buf, reused.buf, optimal.size);
+    bsdiff_ctx_free(&ctx);
+    free(reused.buf);
+
+    /* the other block options apply to the optimal parse too */
+    struct bspatch_verify verify = {};
+    options.digest = options.precheck = options.fill = 1;
+    stream.opaque = &checked;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, &options));
+    memset(out, 0, newsize);
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS,
+        bspatch_verified(old, oldsize, out, newsize, checked.buf, checked.size, &verify, 24));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+
+    /* nothing in common */
+    free(checked.buf);
+    checked = (struct MemCtx){ 0 };
+    verify = (struct bspatch_verify){};
+    TEST_ASSERT_EQUAL(0, bsdiff_ex((const uint8_t*)"", 0, new, newsize, &stream, &options));
+    memset(out, 0, newsize);
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS,
+        bspatch_verified((const uint8_t*)"", 0, out, newsize, checked.buf, checked.size, &verify, 4096));
+    TEST_ASSERT_EQUAL_MEMORY(new, out, newsize);
+
+    free(checked.buf);
+    free(optimal.buf);
+    free(greedy.buf);
+    free(out);
+    free(new);
+    free(old);
+}
+
+/* Allocator that tracks the peak of live bytes across threads */
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t live_bytes, peak_bytes;
+
+static void* _tracking_malloc(size_t size)
+{
+    int64_t* p = malloc(size + sizeof(int64_t));
+    if (p == NULL) {
+        return NULL;
+    }
+    *p = size;
+    pthread_mutex_lock(&live_lock);
+    live_bytes += size;
+    peak_bytes = live_bytes > peak_bytes ? live_bytes : peak_bytes;
+    pthread_mutex_unlock(&live_lock);
+    return p + 1;
+}
+
+static void _tracking_free(void* ptr)
+{
+    int64_t* p = (int64_t*)ptr - 1;
+    pthread_mutex_lock(&live_lock);
+    live_bytes -= *p;
+    pthread_mutex_unlock(&live_lock);
+    free(p);
+}
+
+void test_bsdiff_optimal_periodic(void)
+{
+    /* every alignment of a periodic image matches almost everywhere */
+    const int size = 256 * 1024;
+    uint8_t* old = malloc(size);
+    uint8_t* new = malloc(size);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(new);
+    for (int i = 0; i < size; i++) {
+        old[i] = "abcdef"[i % 6];
+        new[i] = i % 997 == 500 ? 'x' : "abcdef"[(i + 3) % 6];
+    }
+
+    struct MemCtx greedy = { 0 }, optimal = { 0 };
+    struct bsdiff_stream stream = { .opaque = &greedy, .malloc = malloc, .free = free, .write = _mw };
+    struct bsdiff_options options = { .optimal = 1 };
+    TEST_ASSERT_EQUAL(0, bsdiff(old, size, new, size, &stream));
+
+    /* the suffix array and its scratch take 16 bytes per byte, the parse stays linear */
+    stream = (struct bsdiff_stream) {
+        .opaque = &optimal, .malloc = _tracking_malloc, .free = _tracking_free, .write = _mw
+    };
+    peak_bytes = 0;
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, size, new, size, &stream, &options));
+    TEST_ASSERT_EQUAL(0, live_bytes);
+    TEST_ASSERT_LESS_OR_EQUAL(24 * (int64_t)(size + 1), peak_bytes);
+    TEST_ASSERT_LESS_OR_EQUAL(bsdiff_memory(size, size, &options), peak_bytes);
+
+    /* and still finds the one alignment that covers it all */
+    TEST_ASSERT_LESS_OR_EQUAL(greedy.size, optimal.size);
+
+    free(optimal.buf);
+    free(greedy.buf);
+    free(new);
+    free(old);
+}
+
+void test_bsdiff_multi(void)
+{
+    char* files[] = { "../bsdiff.c", "../bspatch.c", "../bscompose.c", "main/test_bsdiff.c" };
+    const int nbases = 4;
+    int newsize, sizes[4];
+    uint8_t* olds[4];
+    uint8_t* new = load_f("../bsmulti.c", &newsize);
+    TEST_ASSERT_NOT_NULL(new);
+
+    struct MemCtx expect[4] = { 0 }, got[4] = { 0 };
+    struct bsdiff_stream streams[4];
+    struct bsmulti_base bases[4];
+    int64_t largest = 0;
+
+    for (int i = 0; i < nbases; i++) {
+        olds[i] = load_f(files[i], &sizes[i]);
+        TEST_ASSERT_NOT_NULL(olds[i]);
+        struct bsdiff_stream stream = { .opaque = &expect[i], .malloc = malloc, .free = free, .write = _mw };
+        TEST_ASSERT_EQUAL(0, bsdiff(olds[i], sizes[i], new, newsize, &stream));
+        streams[i] = (struct bsdiff_stream) {
+            .opaque = &got[i], .malloc = _tracking_malloc, .free = _tracking_free, .write = _mw
+        };
+        bases[i] = (struct bsmulti_base) { .old = olds[i], .oldsize = sizes[i], .stream = &streams[i] };
+        const int64_t need = bsmulti_memory(&bases[i], newsize, NULL);
+        largest = need > largest ? need : largest;
+    }
+
+    /* a budget that fits one base at a time keeps the peak to the largest one */
+    peak_bytes = 0;
+    TEST_ASSERT_EQUAL(0, bsdiff_multi(bases, nbases, new, newsize, NULL, 3, largest));
+    TEST_ASSERT_LESS_OR_EQUAL(largest, peak_bytes);
+
+    for (int i = 0; i < nbases; i++) {
+        TEST_ASSERT_EQUAL(0, bases[i].result);
+        TEST_ASSERT_EQUAL(expect[i].size, got[i].size);
+        TEST_ASSERT_EQUAL_MEMORY(expect[i].buf, got[i].buf, expect[i].size);
+        free(got[i].buf);
+        got[i] = (struct MemCtx) { 0 };
+    }
+
+    /* without a budget the same patches come out of all threads at once */
+    TEST_ASSERT_EQUAL(0, bsdiff_multi(bases, nbases, new, newsize, NULL, 4, 0));
+    for (int i = 0; i < nbases; i++) {
+        TEST_ASSERT_EQUAL_MEMORY(expect[i].buf, got[i].buf, expect[i].size);
+        free(got[i].buf);
+        got[i] = (struct MemCtx) { 0 };
+    }
+
+    /* the optimal parse with a filter stays in its larger estimate too */
+    struct bsdiff_options options = { .filter = BSFILTER_ARMTHUMB, .optimal = 1 };
+    largest = 0;
+    for (int i = 0; i < nbases; i++) {
+        const int64_t need = bsmulti_memory(&bases[i], newsize, &options);
+        largest = need > largest ? need : largest;
+    }
+    peak_bytes = 0;
+    TEST_ASSERT_EQUAL(0, bsdiff_multi(bases, nbases, new, newsize, &options, 3, largest));
+    TEST_ASSERT_LESS_OR_EQUAL(largest, peak_bytes);
+    TEST_ASSERT_EQUAL(0, live_bytes);
+
+    for (int i = 0; i < nbases; i++) {
+        TEST_ASSERT_EQUAL(0, bases[i].result);
+        free(got[i].buf);
+        free(expect[i].buf);
+        free(olds[i]);
+    }
+    free(new);
+}
+
+/* Checks est against the patch bsdiff_ex() makes of old and new, within the bounds of bsestimate.h */
+static void _check_estimate(const uint8_t* old, int oldsize, const uint8_t* new, int newsize,
+    const struct bsestimate* est)
+{
+    struct MemCtx patch = { 0 };
+    struct bsdiff_stream stream = { .opaque = &patch, .malloc = malloc, .free = free, .write = _mw };
+    TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, new, newsize, &stream, NULL));
+
+    TEST_ASSERT_GREATER_OR_EQUAL(patch.size / 2, est->raw_size);
+    TEST_ASSERT_LESS_OR_EQUAL(patch.size * 11 / 10, est->raw_size);
+
+#ifdef BSESTIMATE_ZLIB
+    uLongf zsize = compressBound(patch.size);
+    uint8_t* z = malloc(zsize);
+    TEST_ASSERT_EQUAL(Z_OK, compress2(z, &zsize, patch.buf, patch.size, Z_DEFAULT_COMPRESSION));
+    TEST_ASSERT_GREATER_OR_EQUAL((int64_t)zsize / 2, est->compressed_size);
+    TEST_ASSERT_LESS_OR_EQUAL((int64_t)zsize * 3 / 2, est->compressed_size);
+    free(z);
+#else
+    /* order-0 entropy of the diff and the extra bytes, and 8 bytes a block */
+    int64_t hist[2][256] = { 0 }, blocks = 0;
+    double bits = 0;
+    for (int p = 0; p < patch.size; blocks++) {
+        const int64_t x = bsformat_offtin(patch.buf + p), y = bsformat_offtin(patch.buf + p + 8);
+        p += BSPATCH_CTRL_SIZE;
+        for (int64_t i = 0; i < x + y; i++) {
+            hist[i >= x][patch.buf[p + i]]++;
+        }
+        p += x + y;
+    }
+    for (int k = 0; k < 2; k++) {
+        int64_t n = 0;
+        for (int i = 0; i < 256; i++) {
+            n += hist[k][i];
+        }
+        for (int i = 0; i < 256; i++) {
+            bits += hist[k][i] > 0 ? hist[k][i] * log2((double)n / hist[k][i]) : 0;
+        }
+    }
+    const int64_t real = (int64_t)ceil(bits / 8) + 8 * blocks;
+    TEST_ASSERT_GREATER_OR_EQUAL(real * 4 / 5, est->compressed_size);
+    TEST_ASSERT_LESS_OR_EQUAL(real * 3 / 2, est->compressed_size);
+#endif
+
+    free(patch.buf);
+}
+
+void test_bsestimate(void)
+{
+    int oldsize, newsize;
+    uint8_t* old = load_f("../bsdiff.c", &oldsize);
+    uint8_t* new = load_f("../bspatch.c", &newsize);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(new);
+    struct bsdiff_stream stream = { .malloc = malloc, .free = free };
+    struct bsestimate est;
+
+    /* an unchanged image is matched almost entirely and costs next to nothing */
+    TEST_ASSERT_EQUAL(0, bsestimate(old, oldsize, old, oldsize, &stream, &est));
+    TEST_ASSERT_GREATER_THAN(oldsize - BSESTIMATE_SEED - BSESTIMATE_SAMPLE, est.matched);
+    TEST_ASSERT_EQUAL(oldsize + 24 * est.blocks, est.raw_size);
+    TEST_ASSERT_LESS_THAN(est.full_size / 50, est.compressed_size);
+
+    /* a copy with a few bytes changed stays well below the full image */
+    uint8_t* edited = malloc(oldsize);
+    memcpy(edited, old, oldsize);
+    for (int i = 100; i < oldsize; i += oldsize / 8) {
+        edited[i] ^= 0x55;
+    }
+    TEST_ASSERT_EQUAL(0, bsestimate(old, oldsize, edited, oldsize, &stream, &est));
+    TEST_ASSERT_LESS_THAN(est.full_size / 10, est.compressed_size);
+    _check_estimate(old, oldsize, edited, oldsize, &est);
+
+    /* unrelated random data gains nothing over the full image */
+    srand(2);
+    for (int i = 0; i < oldsize; i++) {
+        edited[i] = rand();
+    }
+    TEST_ASSERT_EQUAL(0, bsestimate(old, oldsize, edited, oldsize, &stream, &est));
+    TEST_ASSERT_EQUAL(0, est.matched);
+    TEST_ASSERT_GREATER_OR_EQUAL(est.full_size, est.compressed_size);
+    _check_estimate(old, oldsize, edited, oldsize, &est);
+
+    /* different sources share some of their lines */
+    TEST_ASSERT_EQUAL(0, bsestimate(old, oldsize, new, newsize, &stream, &est));
+    TEST_ASSERT_GREATER_THAN(0, est.matched);
+    TEST_ASSERT_LESS_THAN(newsize, est.matched);
+    _check_estimate(old, oldsize, new, newsize, &est);
+
+    free(edited);
+    free(new);
+    free(old);
+}
+
+#ifdef BSDEFLATE_ZLIB
+/* Appends size bytes of text to image, deflated as a zlib stream or a gzip member with window_bits 31 */
+static void _deflated(uint8_t* image, int* image_size, int cap, const uint8_t* text, int size, int window_bits)
+{
+    z_stream z = { 0 };
+    TEST_ASSERT_EQUAL(Z_OK, deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY));
+    z.next_in = (uint8_t*)text;
+    z.avail_in = size;
+    z.next_out = image + *image_size;
+    z.avail_out = cap - *image_size;
+    TEST_ASSERT_EQUAL(Z_STREAM_END, deflate(&z, Z_FINISH));
+    deflateEnd(&z);
+    *image_size += z.total_out;
+}
+
+void test_bsdeflate(void)
+{
+    const int assetsize = 1024 * 1024;
+    int textsize, srcsize;
+    uint8_t* text = load_f("../bsdiff.c", &textsize);
+    uint8_t* src = load_f("../bspatch.c", &srcsize);
+    TEST_ASSERT_NOT_NULL(text);
+    TEST_ASSERT_NOT_NULL(src);
+    uint8_t* asset = malloc(assetsize);
+    uint8_t* images[2];
+    int sizes[2];
+    const int cap = assetsize + 2 * srcsize + 1024;
+
+    /* a large asset as a zlib stream and a source file as a gzip member, with a few
+     * words changed in the new image */
+    for (int v = 0; v < 2; v++) {
+        for (int i = 0; i < assetsize; i++) {
+            asset[i] = text[i % textsize];
+        }
+        if (v) {
+            memcpy(asset + 1000, "CHANGED", 7);
+            memcpy(asset + 700000, "CHANGED", 7);
+            memcpy(src + 5000, "CHANGED", 7);
+        }
+        images[v] = malloc(cap);
+        for (int i = 0; i < 256; i++) {
+            images[v][i] = i;
+        }
+        sizes[v] = 256;
+        _deflated(images[v], &sizes[v], cap, asset, assetsize, 15);
+        _deflated(images[v], &sizes[v], cap, src, srcsize, 31);
+    }
+
+    struct MemCtx patch = { 0 };
+    struct bsdiff_stream stream = { .opaque = &patch, .malloc = malloc, .free = free, .write = _mw };
+    TEST_ASSERT_EQUAL(0, bsdeflate_diff(images[0], sizes[0], images[1], sizes[1], &stream, NULL));
+
+    /* applied in chunks without holding either image: one section is open on each side */
+    uint8_t* out = malloc(sizes[1]);
+    struct OldCtx oldctx = { images[0], sizes[0] };
+    struct NewCtx newctx = { out, 0, sizes[1] };
+    struct bspatch_stream_i old = { BSPATCH_STREAM_INIT, .opaque = &oldctx, .read = _or };
+    struct bspatch_stream_n new = { BSPATCH_STREAM_INIT, .opaque = &newctx, .write = _nw };
+    struct bsdiff_stream alloc = { .malloc = _tracking_malloc, .free = _tracking_free };
+    struct bsdeflate_patch p;
+    peak_bytes = 0;
+    bsdeflate_patch_init(&p, &old, sizes[0], &new, &alloc);
+    for (int pos = 0; pos < patch.size; pos += 1000) {
+        TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bsdeflate_patch(&p, patch.buf + pos, min(1000, patch.size - pos)));
+    }
+    TEST_ASSERT_EQUAL(BSPATCH_SUCCESS, bsdeflate_patch_finish(&p));
+    TEST_ASSERT_EQUAL(sizes[1], newctx.pos_write);
+    TEST_ASSERT_EQUAL_MEMORY(images[1], out, sizes[1]);
+    TEST_ASSERT_EQUAL(0, live_bytes);
+    /* the deflate and inflate states and the window, about 340 KB */
+    TEST_ASSERT_LESS_THAN(384 * 1024, peak_bytes);
+
+    /* anything else is refused, and finish still frees what was set up */
+    bsdeflate_patch_init(&p, &old, sizes[0], &new, &alloc);
+    TEST_ASSERT_EQUAL(BSPATCH_ERROR, bsdeflate_patch(&p, (const uint8_t*)"BSDIFF40", 8));
+    TEST_ASSERT_EQUAL(BSPATCH_ERROR, bsdeflate_patch_finish(&p));
+    TEST_ASSERT_EQUAL(0, live_bytes);
+
+    free(out);
+    free(patch.buf);
+    free(images[1]);
+    free(images[0]);
+    free(asset);
+    free(src);
+    free(text);
+}
+#endif
+
+static int malloc_count;
+
+static void* _counting_malloc(size_t size)
+{
+    malloc_count++;
+    return malloc(size);
+}
+
+/* Largest number of live bytes seen while the patch was being written */
+static int64_t written_live;
+
+static int _mw_live(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+    written_live = live_bytes > written_live ? live_bytes : written_live;
+    return _mw(stream, buffer, size);
+}
+
+void test_bsdiff_ctx_reuse(void)
+{
+    int v1size, v2size, v3size;
+    uint8_t* v1 = load_f("main/test_bsdiff.c", &v1size);
+    uint8_t* v2 = load_f("../bspatch.c", &v2size);
+    uint8_t* v3 = load_f("main/CMakeLists.txt", &v3size);
+    TEST_ASSERT_NOT_NULL(v1);
+    TEST_ASSERT_NOT_NULL(v2);
+    TEST_ASSERT_NOT_NULL(v3);
+
+    struct bsdiff_ctx ctx = { 0 };
+    struct MemCtx first = { 0 }, second = { 0 }, again = { 0 };
+    struct bsdiff_stream stream = { .malloc = _counting_malloc, .free = free, .write = _mw };
+
+    /* the work arrays and diff buffer are allocated once, then the arrays grow for a larger old image */
+    malloc_count = 0;
+    stream.opaque = &first;
+    TEST_ASSERT_EQUAL(0, bsdiff_ctx_diff(&ctx, v3, v3size, v1, v1size, &stream, NULL));
+    TEST_ASSERT_EQUAL(3, malloc_count);
+    stream.opaque = &second;
+    TEST_ASSERT_EQUAL(0, bsdiff_ctx_diff(&ctx, v2, v2size, v1, v1size, &stream, NULL));
+    TEST_ASSERT_EQUAL(5, malloc_count);
+
+    /* a smaller old image reuses them and produces the same patch as a fresh run */
+    stream.opaque = &again;
+    TEST_ASSERT_EQUAL(0, bsdiff_ctx_diff(&ctx, v3, v3size, v1, v1size, &stream, NULL));
+    TEST_ASSERT_EQUAL(5, malloc_count);
+    TEST_ASSERT_EQUAL(first.size, again.size);
+    TEST_ASSERT_EQUAL_MEMORY(first.buf, again.buf, first.size);
+
+    /* a one-shot diff frees the scratch array of the sort before it writes */
+    struct MemCtx once = { 0 };
+    struct bsdiff_stream tracked = { .opaque = &once, .malloc = _tracking_malloc, .free = _tracking_free, .write = _mw_live };
+    written_live = 0;
+    TEST_ASSERT_EQUAL(0, bsdiff(v2, v2size, v1, v1size, &tracked));
+    TEST_ASSERT_LESS_THAN(2 * 8 * (v2size + 1), written_live);
+    TEST_ASSERT_EQUAL(0, live_bytes);
+
+    bsdiff_ctx_free(&ctx);
+    free(once.buf);
+    free(again.buf);
+    free(second.buf);
+    free(first.buf);
+    free(v3);
+    free(v2);
+    free(v1);
+}
+
+void test_bsdiff_index(void)
+{
+    int oldsize, newsize, othersize;
+    uint8_t* old = load_f("../bsdiff.c", &oldsize);
+    uint8_t* new = load_f("../bspatch.c", &newsize);
+    uint8_t* other = load_f("../bscompose.c", &othersize);
+    TEST_ASSERT_NOT_NULL(old);
+    TEST_ASSERT_NOT_NULL(new);
+    TEST_ASSERT_NOT_NULL(other);
+
+    const int filters[] = { BSFILTER_NONE, BSFILTER_ARMTHUMB };
+    for (int f = 0; f < 2; f++) {
+        struct bsdiff_index index;
+        struct bsdiff_options options = { .filter = filters[f], .speed = 1, .digest = 1 };
+        struct bsdiff_stream stream = { .malloc = _counting_malloc, .free = free, .write = _mw };
+        TEST_ASSERT_EQUAL(0, bsdiff_index_build(&index, old, oldsize, filters[f], &stream));
+
+        /* one index serves several new images, sorting nothing again */
+        uint8_t* targets[] = { new, other };
+        int sizes[] = { newsize, othersize };
+        for (int i = 0; i < 2; i++) {
+            struct MemCtx fresh = { 0 }, indexed = { 0 };
+            stream.opaque = &fresh;
+            TEST_ASSERT_EQUAL(0, bsdiff_ex(old, oldsize, targets[i], sizes[i], &stream, &options));
+            malloc_count = 0;
+            stream.opaque = &indexed;
+            TEST_ASSERT_EQUAL(0, bsdiff_index_diff(&index, targets[i], sizes[i], &stream, &options));
+            TEST_ASSERT_EQUAL(1 + (filters[f] != BSFILTER_NONE), malloc_count);
+            TEST_ASSERT_EQUAL(fresh.size, indexed.size);
+            TEST_ASSERT_EQUAL_MEMORY(fresh.buf, indexed.buf, fresh.size);
+            free(indexed.buf);
+            free(fresh.buf);
+        }
+
+        /* the filter is part of the index */
+        options.filter = filters[1 - f];
+        TEST_ASSERT_EQUAL(-1, bsdiff_index_diff(&index, new, newsize, &stream, &options));
+        bsdiff_index_free(&index);
+    }
+
+    free(other);
+    free(new);
+    free(old);
+}
+
 void test_bsdiff_same_file_wrong(void)
 {
     const int cmp_result = cmp("main/test_bsdiff.c", "main/CMakeLists.txt");
@@ -247,6 +1716,28 @@ int main(int argc, char** argv)
     UNITY_BEGIN();
     RUN_TEST(test_bsdiff_different_files);
     RUN_TEST(test_bsdiff_same_file);
+    RUN_TEST(test_bsdiff_bulk_chunks);
+    RUN_TEST(test_bspatch_chain);
+    RUN_TEST(test_bscompose);
+    RUN_TEST(test_bsdiff_branch_filter);
+    RUN_TEST(test_bspatch_index);
+    RUN_TEST(test_bspatch_would_block);
+    RUN_TEST(test_bspatch_pipeline);
+    RUN_TEST(test_bspatch_verify);
+    RUN_TEST(test_bspatch_precheck);
+    RUN_TEST(test_bsdiff_fill);
+    RUN_TEST(test_bsinspect);
+    RUN_TEST(test_bspatch_64bit_offsets);
+    RUN_TEST(test_bsdiff_speed_levels);
+    RUN_TEST(test_bsdiff_optimal);
+    RUN_TEST(test_bsdiff_optimal_periodic);
+    RUN_TEST(test_bsdiff_multi);
+    RUN_TEST(test_bsestimate);
+#ifdef BSDEFLATE_ZLIB
+    RUN_TEST(test_bsdeflate);
+#endif
+    RUN_TEST(test_bsdiff_ctx_reuse);
+    RUN_TEST(test_bsdiff_index);
     RUN_TEST(test_bsdiff_same_file_wrong);
     RUN_TEST(test_bsdiff_different_files_oldwrong);
     RUN_TEST(test_bsdiff_different_files_missingfile);
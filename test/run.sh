@@ -14,8 +14,9 @@ idf.py build
 ./build/test_bsdiff.elf
 
 # build bsdiff and bspatch
-gcc -O2 -DBSDIFF_EXECUTABLE -o esp32_bsdiff ../bsdiff.c
-gcc -O2 -DBSPATCH_EXECUTABLE -o esp32_bspatch ../bspatch.c
+gcc -O2 -DBSDIFF_EXECUTABLE -o esp32_bsdiff ../bsdiff.c ../bsfilter.c ../bsformat.c ../bssha256.c
+gcc -O2 -pthread -DBSPATCH_EXECUTABLE -o esp32_bspatch ../bspatch.c ../bsfilter.c ../bsformat.c ../bssha256.c
+gcc -O2 -DBSCOMPOSE_EXECUTABLE -o esp32_bscompose ../bscompose.c ../bspatch.c ../bsfilter.c ../bsformat.c ../bssha256.c
 
 # run a smoke test
 ./esp32_bsdiff ../bsdiff.c ../bspatch.c build/test_patch.bin
@@ -24,3 +25,112 @@ gcc -O2 -DBSPATCH_EXECUTABLE -o esp32_bspatch ../bspatch.c
 # compare files are identical
 cmp --silent ../bspatch.c build/bspatch.c
 
+# compose bsdiff.c -> bspatch.c -> bsdiff.h into one patch and apply it
+./esp32_bsdiff ../bspatch.c ../bsdiff.h build/test_patch2.bin
+./esp32_bscompose build/test_patch.bin build/test_patch2.bin build/test_patch3.bin
+./esp32_bspatch ../bsdiff.c build/bsdiff.h $(stat --printf="%s" ../bsdiff.h) build/test_patch3.bin
+cmp --silent ../bsdiff.h build/bsdiff.h
+
+# apply with several threads
+./esp32_bspatch -j 4 ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/test_patch.bin
+cmp --silent ../bspatch.c build/bspatch.c
+
+# round trip through the Thumb branch filter
+./esp32_bsdiff -f thumb ../bsdiff.c ../bspatch.c build/test_patch4.bin
+./esp32_bspatch -f thumb ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/test_patch4.bin
+cmp --silent ../bspatch.c build/bspatch.c
+# the filter block refuses the patch without its filter
+if ./esp32_bspatch ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/test_patch4.bin 2>/dev/null; then
+    exit 1
+fi
+
+
+# write the output from a worker thread while decoding
+./esp32_bspatch -p 2 ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/test_patch.bin
+cmp --silent ../bspatch.c build/bspatch.c
+
+# diff images with compressed sections through their decompressed contents
+gcc -O2 -DBSDEFLATE_EXECUTABLE -o esp32_bsdeflate ../bsdeflate.c ../bsdiff.c ../bspatch.c ../bsfilter.c ../bsformat.c ../bssha256.c -lz
+python3 - build/deflate_old.bin build/deflate_new.bin <<'PY'
+import gzip, sys, zlib
+a, b = open('../bsdiff.c', 'rb').read(), open('../bspatch.c', 'rb').read()
+image = lambda a, b: bytes(range(256)) + zlib.compress(a, 9) + gzip.compress(b, mtime=0) + zlib.compress(a + b)
+open(sys.argv[1], 'wb').write(image(a, b))
+open(sys.argv[2], 'wb').write(image(a.replace(b'bsdiff', b'BSDIFF', 3), b.replace(b'ctx', b'CTX', 2)))
+PY
+./esp32_bsdeflate build/deflate_old.bin build/deflate_new.bin build/deflate.patch
+./esp32_bsdeflate -a build/deflate_old.bin build/deflate_out.bin build/deflate.patch
+cmp --silent build/deflate_new.bin build/deflate_out.bin
+
+# patches from several bases to one target, two at a time
+gcc -O2 -pthread -DBSMULTI_EXECUTABLE -o esp32_bsmulti ../bsmulti.c ../bsdiff.c ../bsfilter.c ../bsformat.c ../bssha256.c
+./esp32_bsmulti -j 2 ../bspatch.c ../bsdiff.c build/multi1.bin ../bscompose.c build/multi2.bin
+./esp32_bspatch ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/multi1.bin
+cmp --silent ../bspatch.c build/bspatch.c
+./esp32_bspatch ../bscompose.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/multi2.bin
+cmp --silent ../bspatch.c build/bspatch.c
+./esp32_bsmulti -o -r ../bspatch.c ../bsdiff.c build/multi3.bin
+./esp32_bspatch ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/multi3.bin
+cmp --silent ../bspatch.c build/bspatch.c
+
+# estimate a patch size without diffing
+gcc -O2 -DBSESTIMATE_EXECUTABLE -o esp32_bsestimate ../bsestimate.c -lm
+./esp32_bsestimate ../bsdiff.c ../bspatch.c
+gcc -O2 -DBSESTIMATE_ZLIB -DBSESTIMATE_EXECUTABLE -o esp32_bsestimate ../bsestimate.c ../bsformat.c -lm -lz
+./esp32_bsestimate ../bsdiff.c ../bspatch.c
+
+# a patch with a digest block is checked while it is applied
+./esp32_bsdiff -d ../bsdiff.c ../bspatch.c build/digest.bin
+./esp32_bspatch ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/digest.bin
+cmp --silent ../bspatch.c build/bspatch.c
+./esp32_bspatch -j 4 ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/digest.bin
+cmp --silent ../bspatch.c build/bspatch.c
+sed 's/int/INT/' ../bsdiff.c > build/bsdiff_bad.c
+if ./esp32_bspatch -j 4 build/bsdiff_bad.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/digest.bin; then
+	exit 1
+fi
+
+# a patch that starts with a precheck block checks the old file before writing
+./esp32_bsdiff -c ../bsdiff.c ../bspatch.c build/precheck.bin
+./esp32_bspatch ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/precheck.bin
+cmp --silent ../bspatch.c build/bspatch.c
+
+# serve diffs from a cached index over a Unix socket, two clients at once
+gcc -O2 -pthread -DBSDIFFD_EXECUTABLE -o esp32_bsdiffd ../bsdiffd.c ../bsdiff.c ../bsfilter.c ../bsformat.c ../bssha256.c
+rm -f build/bsdiffd.sock
+./esp32_bsdiffd -l -j 2 -m 16 build/bsdiffd.sock &
+SERVICE=$!
+while [ ! -S build/bsdiffd.sock ]; do sleep 0.1; done
+# only the owner may connect
+[ "$(stat --printf="%a" build/bsdiffd.sock)" = 600 ]
+./esp32_bsdiffd build/bsdiffd.sock ../bsdiff.c ../bspatch.c build/service1.bin &
+./esp32_bsdiffd build/bsdiffd.sock ../bsdiff.c ../bspatch.c build/service2.bin
+wait $!
+# options travel with the request
+./esp32_bsdiffd -o -r build/bsdiffd.sock ../bsdiff.c ../bspatch.c build/service3.bin
+./esp32_bsdiff -o -r ../bsdiff.c ../bspatch.c build/test_patch5.bin
+cmp --silent build/test_patch5.bin build/service3.bin
+kill $SERVICE
+cmp --silent build/test_patch.bin build/service1.bin
+cmp --silent build/test_patch.bin build/service2.bin
+
+# runs of erased flash and padding become fill blocks
+python3 - build/fill_old.bin build/fill_new.bin <<'PY'
+import sys
+a, b = open('../bsdiff.c', 'rb').read(), open('../bspatch.c', 'rb').read()
+open(sys.argv[1], 'wb').write(a + b'\xff' * 4096 + b)
+open(sys.argv[2], 'wb').write(b + b'\xff' * 8192 + a + b'\x00' * 1024)
+PY
+./esp32_bsdiff -r build/fill_old.bin build/fill_new.bin build/fill.bin
+./esp32_bspatch build/fill_old.bin build/fill_out.bin $(stat --printf="%s" build/fill_new.bin) build/fill.bin
+cmp --silent build/fill_new.bin build/fill_out.bin
+
+# choose the blocks by dynamic programming
+./esp32_bsdiff -o ../bsdiff.c ../bspatch.c build/optimal.bin
+./esp32_bspatch ../bsdiff.c build/bspatch.c $(stat --printf="%s" ../bspatch.c) build/optimal.bin
+cmp --silent ../bspatch.c build/bspatch.c
+
+# report what is inside a patch, as text and as JSON
+gcc -O2 -pthread -DBSINSPECT_EXECUTABLE -o esp32_bsinspect ../bsinspect.c ../bspatch.c ../bsfilter.c ../bsformat.c ../bssha256.c
+./esp32_bsinspect build/fill.bin
+./esp32_bsinspect -j -e -b 1024 build/fill.bin | python3 -m json.tool